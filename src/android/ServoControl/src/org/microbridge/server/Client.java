@@ -6,6 +6,7 @@ import java.io.OutputStream;
 import java.net.Socket;
 import java.net.SocketException;
 
+import android.net.LocalSocket;
 import android.util.Log;
 
 public class Client
@@ -13,6 +14,8 @@ public class Client
 	
 	private Socket socket;
 	
+	private LocalSocket localSocket;
+	
 	private final Server server;
 	
 	private final InputStream input;
@@ -32,6 +35,17 @@ public class Client
 		startCommunicationThread();
 	}	
 	
+	public Client(Server server, LocalSocket localSocket) throws IOException
+	{
+		this.server = server;
+		this.localSocket = localSocket;
+		
+		this.input = this.localSocket.getInputStream();
+		this.output = this.localSocket.getOutputStream();
+
+		startCommunicationThread();
+	}
+	
 	public void startCommunicationThread()
 	{
 		(new Thread() {
@@ -76,14 +90,17 @@ public class Client
 		// Close the socket, will throw an IOException in the listener thread.
 		try
 		{
-			socket.close();
+			if (socket!=null)
+				socket.close();
+			else
+				localSocket.close();
 		} catch (IOException e)
 		{
 			Log.e("microbridge", "error while closing socket", e);
 		}
 	}
 	
-	public void send(byte[] data) throws IOException
+	public synchronized void send(byte[] data) throws IOException
 	{
 		try {
 			output.write(data);
@@ -96,6 +113,19 @@ public class Client
 		}
 	}
 
+	public synchronized void send(byte[] data, int offset, int length) throws IOException
+	{
+		try {
+			output.write(data, offset, length);
+			output.flush();
+		} catch (SocketException ex)
+		{
+			// Broken socket, disconnect
+			close();
+			server.disconnectClient(this);
+		}
+	}
+
 	public void send(String command) throws IOException
 	{
 		send(command.getBytes());
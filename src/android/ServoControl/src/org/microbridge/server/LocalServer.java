@@ -0,0 +1,99 @@
+package org.microbridge.server;
+
+import java.io.IOException;
+import java.net.SocketException;
+
+import android.net.LocalServerSocket;
+import android.net.LocalSocket;
+import android.net.LocalSocketAddress;
+
+/**
+ * Server that listens on an Android local socket in the abstract namespace instead of a TCP port. Sketches
+ * connect to it with 'localabstract:<name>', which adbd opens directly, without going through its TCP
+ * client and the loopback network stack.
+ */
+public class LocalServer extends Server
+{
+
+	// Server socket for the local connection
+	private LocalServerSocket serverSocket = null;
+	
+	// Socket name to use
+	private final String name;
+	
+	// Set when the server is being stopped.
+	private volatile boolean closing = false;
+	
+	/**
+	 * Constructs a new server instance on socket 'microbridge'.
+	 */
+	public LocalServer()
+	{
+		this("microbridge");
+	}
+	
+	/**
+	 * Constructs a new server instance.
+	 * @param name name of the socket in the abstract namespace.
+	 */
+	public LocalServer(String name)
+	{
+		super(-1);
+		this.name = name;
+	}
+	
+	/**
+	 * @return name of the socket this server accepts connections on.
+	 */
+	public String getName()
+	{
+		return name;
+	}
+	
+	@Override
+	protected void listen() throws IOException
+	{
+		closing = false;
+		serverSocket = new LocalServerSocket(name);
+	}
+	
+	@Override
+	protected Client accept() throws IOException
+	{
+		LocalSocket socket = serverSocket.accept();
+		
+		// Woken up by close.
+		if (closing)
+		{
+			socket.close();
+			throw new SocketException("Server stopped");
+		}
+		
+		return new Client(this, socket);
+	}
+	
+	@Override
+	protected void close() throws IOException
+	{
+		if (serverSocket==null)
+			return;
+		
+		// Closing a LocalServerSocket does not interrupt a pending accept, so connect to it once to wake the
+		// listen thread up.
+		closing = true;
+		LocalSocket socket = new LocalSocket();
+		try
+		{
+			socket.connect(new LocalSocketAddress(name));
+		} catch (IOException e)
+		{
+			// Not accepting anymore.
+		} finally
+		{
+			socket.close();
+		}
+		
+		serverSocket.close();
+	}
+	
+}
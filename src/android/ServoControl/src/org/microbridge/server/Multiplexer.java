@@ -0,0 +1,251 @@
+package org.microbridge.server;
+
+import java.io.IOException;
+import java.util.concurrent.ConcurrentHashMap;
+
+/**
+ * Demultiplexer for the channel protocol of the AdbMux class on the microcontroller. Many numbered
+ * channels are carried over a single connection; every frame starts with the channel number, a type, and
+ * the payload length as a little-endian 16-bit value. Flow control is per channel: a side may only send as
+ * many data bytes on a channel as the other side has granted with CREDIT frames.
+ *
+ * Add the multiplexer as a listener to a server, and open the channels that should receive data. Received
+ * data is passed to the channel listener, after which it is granted back to the client.
+ */
+public class Multiplexer extends AbstractServerListener
+{
+
+	// Frame types.
+	public static final int DATA = 0;
+	public static final int CREDIT = 1;
+
+	public static final int HEADER_SIZE = 4;
+
+	public static final int MAX_CHANNELS = 256;
+
+	/**
+	 * Listener for data received on a channel.
+	 */
+	public interface ChannelListener
+	{
+		/**
+		 * Called when a data frame is received on a channel.
+		 * @param client source client
+		 * @param channel channel number
+		 * @param data frame payload
+		 */
+		public void onReceive(Client client, int channel, byte data[]);
+	}
+
+	// Per-client parser and credit state.
+	private static class ClientState
+	{
+		byte header[] = new byte[HEADER_SIZE];
+		int headerLength = 0;
+		byte payload[];
+		int payloadLength = 0;
+
+		int txCredits[] = new int[MAX_CHANNELS];
+		int rxConsumed[] = new int[MAX_CHANNELS];
+	}
+
+	private final ChannelListener channelListeners[] = new ChannelListener[MAX_CHANNELS];
+	private final int windows[] = new int[MAX_CHANNELS];
+
+	private final ConcurrentHashMap<Client, ClientState> states = new ConcurrentHashMap<Client, ClientState>();
+
+	/**
+	 * Opens a channel for receiving. The receive window is granted to clients when they connect.
+	 *
+	 * @param channel channel number
+	 * @param window number of bytes a client may send before it has to wait for more credits, at most 65535
+	 * @param listener listener for received data
+	 */
+	public void open(int channel, int window, ChannelListener listener)
+	{
+		channelListeners[channel] = listener;
+		windows[channel] = window;
+
+		// Grant the window to clients that are already connected.
+		for (Client client : states.keySet())
+			try
+			{
+				sendFrame(client, channel, CREDIT, credit(window));
+			} catch (IOException e)
+			{
+				// The client will be disconnected.
+			}
+	}
+
+	/**
+	 * Sends data on a channel, if the client has granted enough credits.
+	 *
+	 * @param client target client
+	 * @param channel channel number
+	 * @param data data to send, at most 65535 bytes
+	 * @return true if the data was sent, false if there weren't enough credits.
+	 * @throws IOException
+	 */
+	public boolean send(Client client, int channel, byte data[]) throws IOException
+	{
+		ClientState state = states.get(client);
+		if (state==null)
+			return false;
+
+		synchronized (state)
+		{
+			if (state.txCredits[channel] < data.length)
+				return false;
+			state.txCredits[channel] -= data.length;
+		}
+
+		sendFrame(client, channel, DATA, data);
+		return true;
+	}
+
+	/**
+	 * @param client client
+	 * @param channel channel number
+	 * @return the number of bytes that may currently be sent to the client on the channel.
+	 */
+	public int getCredits(Client client, int channel)
+	{
+		ClientState state = states.get(client);
+		if (state==null)
+			return 0;
+
+		synchronized (state)
+		{
+			return state.txCredits[channel];
+		}
+	}
+
+	/**
+	 * Returns the state of a client, creating it if needed. The client's reader thread is started before
+	 * the server calls onClientConnect, so the first frames may arrive before the client is announced.
+	 */
+	private ClientState getState(Client client)
+	{
+		ClientState state = states.get(client);
+		if (state==null)
+		{
+			ClientState created = new ClientState();
+			state = states.putIfAbsent(client, created);
+			if (state==null)
+				state = created;
+		}
+		return state;
+	}
+
+	@Override
+	public void onClientConnect(Server server, Client client)
+	{
+		getState(client);
+
+		// Announce the receive windows.
+		for (int channel = 0; channel < MAX_CHANNELS; channel++)
+			if (channelListeners[channel]!=null && windows[channel]>0)
+				try
+				{
+					sendFrame(client, channel, CREDIT, credit(windows[channel]));
+				} catch (IOException e)
+				{
+					// The client will be disconnected.
+				}
+	}
+
+	@Override
+	public void onClientDisconnect(Server server, Client client)
+	{
+		states.remove(client);
+	}
+
+	@Override
+	public void onReceive(Client client, byte[] data)
+	{
+		ClientState state = getState(client);
+
+		int pos = 0;
+		while (pos < data.length)
+		{
+			// Collect the frame header.
+			if (state.headerLength < HEADER_SIZE)
+			{
+				state.header[state.headerLength++] = data[pos++];
+				if (state.headerLength == HEADER_SIZE)
+				{
+					state.payload = new byte[(state.header[2] & 0xff) | ((state.header[3] & 0xff) << 8)];
+					state.payloadLength = 0;
+				} else
+					continue;
+			}
+
+			// Collect the payload.
+			int count = Math.min(data.length - pos, state.payload.length - state.payloadLength);
+			System.arraycopy(data, pos, state.payload, state.payloadLength, count);
+			state.payloadLength += count;
+			pos += count;
+
+			if (state.payloadLength == state.payload.length)
+			{
+				state.headerLength = 0;
+				handleFrame(client, state, state.header[0] & 0xff, state.header[1] & 0xff, state.payload);
+			}
+		}
+	}
+
+	/**
+	 * Handles a complete frame.
+	 */
+	private void handleFrame(Client client, ClientState state, int channel, int type, byte payload[])
+	{
+		if (type == CREDIT && payload.length >= 2)
+		{
+			synchronized (state)
+			{
+				state.txCredits[channel] = Math.min(65535, state.txCredits[channel] + ((payload[0] & 0xff) | ((payload[1] & 0xff) << 8)));
+			}
+		} else if (type == DATA && channelListeners[channel]!=null)
+		{
+			channelListeners[channel].onReceive(client, channel, payload);
+
+			// Grant the bytes back once half of the window has been used.
+			state.rxConsumed[channel] += payload.length;
+			if (state.rxConsumed[channel] >= windows[channel] / 2)
+			{
+				try
+				{
+					sendFrame(client, channel, CREDIT, credit(state.rxConsumed[channel]));
+				} catch (IOException e)
+				{
+					// The client will be disconnected.
+				}
+				state.rxConsumed[channel] = 0;
+			}
+		}
+	}
+
+	/**
+	 * @return the payload of a CREDIT frame.
+	 */
+	private static byte[] credit(int bytes)
+	{
+		return new byte[] { (byte)bytes, (byte)(bytes >> 8) };
+	}
+
+	/**
+	 * Sends a frame in a single write, so that frames of different threads don't interleave.
+	 */
+	private void sendFrame(Client client, int channel, int type, byte payload[]) throws IOException
+	{
+		byte frame[] = new byte[HEADER_SIZE + payload.length];
+		frame[0] = (byte)channel;
+		frame[1] = (byte)type;
+		frame[2] = (byte)payload.length;
+		frame[3] = (byte)(payload.length >> 8);
+		System.arraycopy(payload, 0, frame, HEADER_SIZE, payload.length);
+
+		client.send(frame);
+	}
+
+}
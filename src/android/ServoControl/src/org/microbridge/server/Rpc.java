@@ -0,0 +1,441 @@
+package org.microbridge.server;
+
+import java.io.IOException;
+import java.util.concurrent.ConcurrentHashMap;
+
+import android.util.SparseArray;
+
+/**
+ * Typed messages and remote calls between the phone and the AdbRpc class on the microcontroller. Message
+ * types are generated from an interface description by rpcgen.py.
+ * 
+ * Every frame is prefixed with its length as a varint, and holds the frame kind, a request id, the method
+ * id, the message fields, and optionally a CRC-16. Incoming messages are decoded into the object that was
+ * registered for their method, and responses into the response object of the request, so no objects are
+ * created per message. Registered objects are shared by all clients; handlers are called one at a time
+ * per method.
+ */
+public class Rpc extends AbstractServerListener
+{
+
+	// Frame kinds, in the low bits of the first byte of a frame.
+	public static final int MESSAGE = 0;
+	public static final int REQUEST = 1;
+	public static final int RESPONSE = 2;
+	public static final int ERROR = 3;
+	public static final int KIND_MASK = 0x03;
+
+	// Set in the first byte of a frame that ends with a CRC.
+	public static final int FLAG_CRC = 0x04;
+
+	// Room reserved in front of an outgoing frame for its length prefix.
+	private static final int PREFIX_SIZE = 3;
+
+	// Maximum number of calls per client that are waiting for a response.
+	public static final int MAX_PENDING = 8;
+
+	/**
+	 * Handler for one-way messages.
+	 */
+	public interface MessageHandler
+	{
+		public void onMessage(Client client, RpcMessage message);
+	}
+
+	/**
+	 * Handler for calls from the microcontroller. Fills in the response of the request, which is sent back
+	 * when the handler returns.
+	 */
+	public interface RequestHandler
+	{
+		public void onRequest(Client client, RpcCall request);
+	}
+
+	/**
+	 * Handler for the response to a call. On success, the response of the request holds the result.
+	 */
+	public interface ResponseHandler
+	{
+		public void onResponse(Client client, RpcCall request, boolean success);
+	}
+
+	// Registered message or request object and its handler.
+	private static class Entry
+	{
+		RpcMessage message;
+		MessageHandler messageHandler;
+		RequestHandler requestHandler;
+	}
+
+	// Per-client frame parser and calls in flight.
+	private class ClientState
+	{
+		final byte frame[] = new byte[frameSize];
+		int frameLength = 0;
+		int received = 0;
+		int lengthShift = 0;
+		boolean lengthDone = false;
+		final RpcReader reader = new RpcReader();
+
+		final int pendingIds[] = new int[MAX_PENDING];
+		final RpcCall pendingRequests[] = new RpcCall[MAX_PENDING];
+		final ResponseHandler pendingHandlers[] = new ResponseHandler[MAX_PENDING];
+	}
+
+	private final int frameSize;
+	private volatile boolean crc = false;
+
+	private final SparseArray<Entry> entries = new SparseArray<Entry>();
+	private final ConcurrentHashMap<Client, ClientState> states = new ConcurrentHashMap<Client, ClientState>();
+
+	// Transmit buffer, shared by all senders.
+	private final byte txBuffer[];
+	private final RpcWriter writer = new RpcWriter();
+	private int nextId = 1;
+
+	/**
+	 * Constructs a new RPC endpoint. Add it as a listener to a server.
+	 * @param frameSize largest frame that can be sent or received, should match the microcontroller side.
+	 */
+	public Rpc(int frameSize)
+	{
+		this.frameSize = frameSize;
+		this.txBuffer = new byte[PREFIX_SIZE + frameSize];
+	}
+
+	/**
+	 * Enables or disables the CRC on outgoing frames. Incoming frames are checked if they carry one.
+	 * @param enable true to append a CRC-16 to every frame
+	 */
+	public void setCrc(boolean enable)
+	{
+		crc = enable;
+	}
+
+	/**
+	 * Registers the handler for a message type.
+	 * @param message object that incoming messages are decoded into
+	 * @param handler message handler
+	 */
+	public synchronized void register(RpcMessage message, MessageHandler handler)
+	{
+		Entry entry = new Entry();
+		entry.message = message;
+		entry.messageHandler = handler;
+		entries.put(message.getMethod(), entry);
+	}
+
+	/**
+	 * Registers the handler for calls from the microcontroller.
+	 * @param request object that incoming requests are decoded into
+	 * @param handler request handler
+	 */
+	public synchronized void register(RpcCall request, RequestHandler handler)
+	{
+		Entry entry = new Entry();
+		entry.message = request;
+		entry.requestHandler = handler;
+		entries.put(request.getMethod(), entry);
+	}
+
+	/**
+	 * Sends a message that doesn't expect a response.
+	 * @param client target client
+	 * @param message message to send
+	 * @throws IOException
+	 */
+	public void send(Client client, RpcMessage message) throws IOException
+	{
+		sendFrame(client, MESSAGE, 0, message.getMethod(), message);
+	}
+
+	/**
+	 * Calls a method on the microcontroller. The request object must not be reused until the handler has
+	 * been called.
+	 * @param client target client
+	 * @param request request to send
+	 * @param handler handler that is called when the response arrives, or the client disconnects
+	 * @return true if the request was sent, false if too many calls are in flight
+	 * @throws IOException
+	 */
+	public boolean call(Client client, RpcCall request, ResponseHandler handler) throws IOException
+	{
+		ClientState state = states.get(client);
+		if (state==null)
+			return false;
+
+		int id;
+		synchronized (state)
+		{
+			int slot = 0;
+			while (slot < MAX_PENDING && state.pendingRequests[slot]!=null)
+				slot++;
+			if (slot == MAX_PENDING)
+				return false;
+
+			synchronized (this)
+			{
+				id = nextId;
+				nextId = nextId == 0xffff ? 1 : nextId + 1;
+			}
+
+			state.pendingIds[slot] = id;
+			state.pendingRequests[slot] = request;
+			state.pendingHandlers[slot] = handler;
+		}
+
+		sendFrame(client, REQUEST, id, request.getMethod(), request);
+		return true;
+	}
+
+	/**
+	 * Returns the state of a client, creating it if needed. The client's reader thread is started before
+	 * the server calls onClientConnect, so the first frames may arrive before the client is announced.
+	 */
+	private ClientState getState(Client client)
+	{
+		ClientState state = states.get(client);
+		if (state==null)
+		{
+			ClientState created = new ClientState();
+			state = states.putIfAbsent(client, created);
+			if (state==null)
+				state = created;
+		}
+		return state;
+	}
+
+	@Override
+	public void onClientConnect(Server server, Client client)
+	{
+		getState(client);
+	}
+
+	@Override
+	public void onClientDisconnect(Server server, Client client)
+	{
+		ClientState state = states.remove(client);
+		if (state==null)
+			return;
+
+		// Fail the calls in flight.
+		for (int slot = 0; slot < MAX_PENDING; slot++)
+		{
+			RpcCall request;
+			ResponseHandler handler;
+			synchronized (state)
+			{
+				request = state.pendingRequests[slot];
+				handler = state.pendingHandlers[slot];
+				state.pendingRequests[slot] = null;
+			}
+
+			if (request!=null)
+				handler.onResponse(client, request, false);
+		}
+	}
+
+	@Override
+	public void onReceive(Client client, byte[] data)
+	{
+		ClientState state = getState(client);
+
+		int pos = 0;
+		while (pos < data.length)
+		{
+			// Decode the length prefix.
+			if (!state.lengthDone)
+			{
+				int c = data[pos++] & 0xff;
+
+				// A length needs at most three bytes and 16 bits, as on the microcontroller. Drop a longer
+				// prefix and start over at the next byte, since the stream is out of step anyway.
+				if (state.lengthShift == 7 * (PREFIX_SIZE - 1) && c > 0x03)
+				{
+					state.frameLength = 0;
+					state.lengthShift = 0;
+					continue;
+				}
+
+				state.frameLength |= (c & 0x7f) << state.lengthShift;
+				state.lengthShift += 7;
+				state.lengthDone = (c & 0x80) == 0;
+				state.received = 0;
+
+				// Ignore empty frames.
+				if (state.lengthDone && state.frameLength == 0)
+				{
+					state.lengthShift = 0;
+					state.lengthDone = false;
+				}
+				continue;
+			}
+
+			// Collect the frame. Frames that don't fit are skipped.
+			int count = Math.min(state.frameLength - state.received, data.length - pos);
+			if (state.frameLength <= frameSize)
+				System.arraycopy(data, pos, state.frame, state.received, count);
+			state.received += count;
+			pos += count;
+
+			if (state.received == state.frameLength)
+			{
+				if (state.frameLength <= frameSize)
+					handleFrame(client, state, state.frameLength);
+
+				state.frameLength = 0;
+				state.lengthShift = 0;
+				state.lengthDone = false;
+			}
+		}
+	}
+
+	/**
+	 * Handles a complete frame.
+	 */
+	private void handleFrame(Client client, ClientState state, int length)
+	{
+		byte frame[] = state.frame;
+		int kind = frame[0] & 0xff;
+
+		// Check and strip the CRC.
+		if ((kind & FLAG_CRC) != 0)
+		{
+			if (length < 3)
+				return;
+			length -= 2;
+			if (crc16(frame, 0, length) != ((frame[length] & 0xff) | ((frame[length + 1] & 0xff) << 8)))
+				return;
+		}
+
+		RpcReader reader = state.reader;
+		reader.reset(frame, 1, length - 1);
+		int id = (int)reader.getVarint();
+		int method = (int)reader.getVarint();
+		if (reader.isError())
+			return;
+
+		try
+		{
+			switch (kind & KIND_MASK)
+			{
+			case MESSAGE:
+			case REQUEST:
+				Entry entry;
+				synchronized (this)
+				{
+					entry = entries.get(method);
+				}
+
+				boolean handled = false;
+				if (entry!=null)
+				{
+					synchronized (entry)
+					{
+						entry.message.decode(reader);
+						if (!reader.isError())
+						{
+							if (entry.messageHandler!=null && (kind & KIND_MASK) == MESSAGE)
+							{
+								entry.messageHandler.onMessage(client, entry.message);
+								handled = true;
+							} else if (entry.requestHandler!=null && (kind & KIND_MASK) == REQUEST)
+							{
+								RpcCall call = (RpcCall)entry.message;
+								entry.requestHandler.onRequest(client, call);
+								sendFrame(client, RESPONSE, id, method, call.getResponse());
+								handled = true;
+							}
+						}
+					}
+				}
+
+				// Unknown method or malformed request, let the caller know.
+				if (!handled && (kind & KIND_MASK) == REQUEST)
+					sendFrame(client, ERROR, id, method, null);
+				break;
+
+			case RESPONSE:
+			case ERROR:
+				RpcCall request = null;
+				ResponseHandler handler = null;
+				synchronized (state)
+				{
+					for (int slot = 0; slot < MAX_PENDING; slot++)
+						if (state.pendingRequests[slot]!=null && state.pendingIds[slot] == id)
+						{
+							request = state.pendingRequests[slot];
+							handler = state.pendingHandlers[slot];
+							state.pendingRequests[slot] = null;
+							break;
+						}
+				}
+
+				if (request!=null)
+				{
+					boolean success = (kind & KIND_MASK) == RESPONSE;
+					if (success)
+					{
+						request.getResponse().decode(reader);
+						success = !reader.isError();
+					}
+					handler.onResponse(client, request, success);
+				}
+				break;
+			}
+		} catch (IOException e)
+		{
+			// The client will be disconnected.
+		}
+	}
+
+	/**
+	 * Encodes a frame and sends it in a single write.
+	 */
+	private void sendFrame(Client client, int kind, int id, int method, RpcMessage message) throws IOException
+	{
+		synchronized (txBuffer)
+		{
+			writer.reset(txBuffer, PREFIX_SIZE, frameSize);
+			writer.putByte(kind | (crc ? FLAG_CRC : 0));
+			writer.putVarint(id);
+			writer.putVarint(method);
+			if (message!=null)
+				message.encode(writer);
+
+			if (crc)
+			{
+				int value = crc16(txBuffer, PREFIX_SIZE, writer.getPosition() - PREFIX_SIZE);
+				writer.putByte(value);
+				writer.putByte(value >> 8);
+			}
+
+			if (writer.isOverflow())
+				throw new IOException("RPC frame too large");
+
+			// Put the varint length right in front of the frame.
+			int length = writer.getPosition() - PREFIX_SIZE;
+			int start = PREFIX_SIZE - (length < 0x80 ? 1 : length < 0x4000 ? 2 : 3);
+			writer.reset(txBuffer, start, PREFIX_SIZE - start);
+			writer.putVarint(length);
+
+			client.send(txBuffer, start, PREFIX_SIZE - start + length);
+		}
+	}
+
+	/**
+	 * @return the CRC-16 (CCITT polynomial, reflected) of a block of data, as computed by the microcontroller.
+	 */
+	private static int crc16(byte data[], int offset, int length)
+	{
+		int crc = 0xffff;
+		for (int i = offset; i < offset + length; i++)
+		{
+			crc ^= data[i] & 0xff;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc & 1) != 0 ? (crc >>> 1) ^ 0x8408 : crc >>> 1;
+		}
+		return crc;
+	}
+
+}
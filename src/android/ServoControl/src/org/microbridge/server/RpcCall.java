@@ -0,0 +1,15 @@
+package org.microbridge.server;
+
+/**
+ * Request type of a remote call. Every request object owns the response object that the result is decoded
+ * into, so calls don't allocate.
+ */
+public interface RpcCall extends RpcMessage
+{
+
+	/**
+	 * @return the response of this call.
+	 */
+	public RpcMessage getResponse();
+
+}
@@ -0,0 +1,27 @@
+package org.microbridge.server;
+
+/**
+ * Message type for the Rpc class. Implementations are generated from an interface description by
+ * rpcgen.py, together with the matching C++ types for the microcontroller.
+ */
+public interface RpcMessage
+{
+
+	/**
+	 * @return the method id of the message type.
+	 */
+	public int getMethod();
+
+	/**
+	 * Writes the fields of the message.
+	 * @param writer target writer
+	 */
+	public void encode(RpcWriter writer);
+
+	/**
+	 * Reads the fields of the message, overwriting the current values.
+	 * @param reader source reader
+	 */
+	public void decode(RpcReader reader);
+
+}
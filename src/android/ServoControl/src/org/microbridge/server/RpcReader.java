@@ -0,0 +1,90 @@
+package org.microbridge.server;
+
+/**
+ * Decodes message fields from a byte array, in the format of the RpcWriter class on the microcontroller.
+ * Reads past the end return zero and are flagged.
+ */
+public class RpcReader
+{
+
+	private byte buffer[];
+	private int position;
+	private int end;
+	private boolean error;
+
+	/**
+	 * Starts reading from a buffer.
+	 * @param buffer source buffer
+	 * @param offset position of the first byte
+	 * @param length number of bytes
+	 */
+	public void reset(byte buffer[], int offset, int length)
+	{
+		this.buffer = buffer;
+		this.position = offset;
+		this.end = offset + length;
+		this.error = false;
+	}
+
+	public int getByte()
+	{
+		if (position < end)
+			return buffer[position++] & 0xff;
+
+		error = true;
+		return 0;
+	}
+
+	public long getVarint()
+	{
+		long value = 0;
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			int c = getByte();
+			value |= (long)(c & 0x7f) << shift;
+			if ((c & 0x80) == 0)
+				break;
+		}
+		return value & 0xffffffffL;
+	}
+
+	public int getSigned()
+	{
+		int value = (int)getVarint();
+		return (value >>> 1) ^ -(value & 1);
+	}
+
+	public float getFloat()
+	{
+		int bits = 0;
+		for (int i = 0; i < 4; i++)
+			bits |= getByte() << (i * 8);
+		return Float.intBitsToFloat(bits);
+	}
+
+	/**
+	 * Reads a block of bytes. Bytes that don't fit in the target are skipped.
+	 * @param target target array
+	 * @return number of bytes stored
+	 */
+	public int getBytes(byte target[])
+	{
+		int length = (int)getVarint();
+		for (int i = 0; i < length; i++)
+		{
+			int c = getByte();
+			if (i < target.length)
+				target[i] = (byte)c;
+		}
+		return Math.min(length, target.length);
+	}
+
+	/**
+	 * @return true if a read went past the end of the buffer.
+	 */
+	public boolean isError()
+	{
+		return error;
+	}
+
+}
@@ -0,0 +1,88 @@
+package org.microbridge.server;
+
+/**
+ * Encodes message fields into a byte array, in the format of the RpcWriter class on the microcontroller.
+ * Unsigned integers are written as varints, signed integers as zigzag varints. Writes past the end of the
+ * buffer are dropped and flagged.
+ */
+public class RpcWriter
+{
+
+	private byte buffer[];
+	private int position;
+	private int end;
+	private boolean overflow;
+
+	/**
+	 * Starts writing into a buffer.
+	 * @param buffer target buffer
+	 * @param offset position of the first byte
+	 * @param length number of bytes available
+	 */
+	public void reset(byte buffer[], int offset, int length)
+	{
+		this.buffer = buffer;
+		this.position = offset;
+		this.end = offset + length;
+		this.overflow = false;
+	}
+
+	public void putByte(int value)
+	{
+		if (position < end)
+			buffer[position++] = (byte)value;
+		else
+			overflow = true;
+	}
+
+	public void putBoolean(boolean value)
+	{
+		putByte(value ? 1 : 0);
+	}
+
+	public void putVarint(long value)
+	{
+		while ((value & ~0x7fL) != 0)
+		{
+			putByte((int)(value & 0x7f) | 0x80);
+			value >>>= 7;
+		}
+		putByte((int)value);
+	}
+
+	public void putSigned(int value)
+	{
+		putVarint(((value << 1) ^ (value >> 31)) & 0xffffffffL);
+	}
+
+	public void putFloat(float value)
+	{
+		int bits = Float.floatToIntBits(value);
+		for (int i = 0; i < 4; i++)
+			putByte(bits >> (i * 8));
+	}
+
+	public void putBytes(byte data[], int length)
+	{
+		putVarint(length);
+		for (int i = 0; i < length; i++)
+			putByte(data[i]);
+	}
+
+	/**
+	 * @return the position after the last byte written.
+	 */
+	public int getPosition()
+	{
+		return position;
+	}
+
+	/**
+	 * @return true if a write didn't fit in the buffer.
+	 */
+	public boolean isOverflow()
+	{
+		return overflow;
+	}
+
+}
@@ -2,7 +2,6 @@ package org.microbridge.server;
 
 import java.io.IOException;
 import java.net.ServerSocket;
-import java.net.Socket;
 import java.net.SocketException;
 import java.util.HashSet;
 import java.util.concurrent.CopyOnWriteArrayList;
@@ -30,7 +29,7 @@ public class Server
 	private HashSet<ServerListener> listeners = new HashSet<ServerListener>();
 	
 	// Indicates that the main server loop should keep running. 
-	private boolean keepAlive = true;
+	private volatile boolean keepAlive = true;
 	
 	// Main thread.
 	private Thread listenThread;
@@ -83,12 +82,11 @@ public class Server
 	public void start() throws IOException
 	{
 		keepAlive = true;
-		serverSocket = new ServerSocket(port);
+		listen();
 		
 		(listenThread = new Thread(){
 			public void run()
 			{
-				Socket socket;
 				try
 				{
 					while (keepAlive)
@@ -96,10 +94,8 @@ public class Server
 						
 						try {
 
-							socket = serverSocket.accept();
-
 							// Create Client object.
-							Client client = new Client(Server.this, socket);
+							Client client = accept();
 							clients.add(client);
 							
 							// Notify listeners.
@@ -134,15 +130,15 @@ public class Server
 	 */
 	public void stop()
 	{
-		// Stop listening in the TCP port.
-		if (serverSocket!=null)
-			try
-			{
-				serverSocket.close();
-			} catch (IOException e)
-			{
-				// TODO
-			}
+		// Stop accepting connections.
+		keepAlive = false;
+		try
+		{
+			close();
+		} catch (IOException e)
+		{
+			// TODO
+		}
 			
 		// Close all clients.
 		for (Client client : clients)
@@ -154,6 +150,38 @@ public class Server
 		
 	}
 	
+	/**
+	 * Opens the server socket. Called by start.
+	 * @throws IOException
+	 */
+	protected void listen() throws IOException
+	{
+		serverSocket = new ServerSocket(port);
+	}
+	
+	/**
+	 * Waits for the next incoming connection. Called from the listen thread.
+	 * 
+	 * @return a Client for the new connection.
+	 * @throws SocketException when the server socket has been closed.
+	 * @throws IOException
+	 */
+	protected Client accept() throws IOException
+	{
+		return new Client(this, serverSocket.accept());
+	}
+	
+	/**
+	 * Closes the server socket, which makes a pending accept throw a SocketException. Called by stop.
+	 * @throws IOException
+	 */
+	protected void close() throws IOException
+	{
+		// Stop listening in the TCP port.
+		if (serverSocket!=null)
+			serverSocket.close();
+	}
+	
 	/**
 	 * Called by the Client class to remove itself from the server. 
 	 * 
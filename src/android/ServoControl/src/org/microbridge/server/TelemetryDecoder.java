@@ -0,0 +1,237 @@
+package org.microbridge.server;
+
+import java.util.Arrays;
+
+/**
+ * Decoder for the sensor streams of the AdbTelemetry class on the microcontroller. Feed it the data
+ * received from a client, in pieces of any size; it reassembles the blocks and passes every row of samples
+ * to the listener.
+ *
+ * Blocks hold the differences between consecutive samples of each channel, as zigzag varints or
+ * bit-packed. Keyframe blocks start from zero, so decoding starts at the first keyframe, and resumes at the
+ * next keyframe after a gap in the sequence numbers.
+ */
+public class TelemetryDecoder
+{
+
+	public static final int HEADER_SIZE = 7;
+
+	// Block flags.
+	public static final int KEYFRAME = 0x01;
+	public static final int PACKED = 0x02;
+
+	// Size in bits of an escaped value in packed blocks.
+	private static final int ESCAPE_BITS = 17;
+
+	/**
+	 * Receives decoded samples.
+	 */
+	public interface Listener
+	{
+		/**
+		 * Called for every row of samples. The array is reused for the next row.
+		 * @param values one value per channel
+		 */
+		public void onSamples(int values[]);
+	}
+
+	private final Listener listener;
+
+	// Block being reassembled.
+	private byte block[] = new byte[256];
+	private int received = 0;
+
+	// Decoder state.
+	private int previous[] = new int[0];
+	private int values[] = new int[0];
+	private boolean synced = false;
+	private int expectedSequence;
+
+	// Statistics.
+	private long blocks = 0;
+	private long skippedBlocks = 0;
+	private long samples = 0;
+
+	// Position in the block while decoding.
+	private int position;
+	private int bits, bitCount;
+
+	/**
+	 * Constructs a new decoder.
+	 * @param listener receiver of the decoded samples
+	 */
+	public TelemetryDecoder(Listener listener)
+	{
+		this.listener = listener;
+	}
+
+	/**
+	 * Feeds received data to the decoder.
+	 * @param data received data
+	 */
+	public void receive(byte data[])
+	{
+		receive(data, 0, data.length);
+	}
+
+	/**
+	 * Feeds received data to the decoder.
+	 * @param data received data
+	 * @param offset position of the first byte
+	 * @param length number of bytes
+	 */
+	public void receive(byte data[], int offset, int length)
+	{
+		while (length > 0)
+		{
+			// Collect the length field first, then the rest of the block.
+			int wanted = received < 2 ? 2 : (block[0] & 0xff) | ((block[1] & 0xff) << 8);
+			if (received >= 2 && wanted < HEADER_SIZE)
+			{
+				// Not a block header, give up on this stream position.
+				received = 0;
+				synced = false;
+				continue;
+			}
+
+			if (wanted > block.length)
+			{
+				byte larger[] = new byte[wanted];
+				System.arraycopy(block, 0, larger, 0, received);
+				block = larger;
+			}
+
+			int count = Math.min(wanted - received, length);
+			System.arraycopy(data, offset, block, received, count);
+			received += count;
+			offset += count;
+			length -= count;
+
+			if (received >= HEADER_SIZE && received == wanted)
+			{
+				decodeBlock(wanted);
+				received = 0;
+			}
+		}
+	}
+
+	/**
+	 * Decodes a complete block.
+	 */
+	private void decodeBlock(int length)
+	{
+		int flags = block[2] & 0xff;
+		int sequence = block[3] & 0xff;
+		int channels = block[4] & 0xff;
+		int rows = (block[5] & 0xff) | ((block[6] & 0xff) << 8);
+
+		blocks++;
+
+		// Deltas only make sense right after the previous block.
+		if ((flags & KEYFRAME) != 0)
+			synced = true;
+		else if (!synced || sequence != expectedSequence || channels != previous.length)
+		{
+			synced = false;
+			skippedBlocks++;
+			return;
+		}
+		expectedSequence = (sequence + 1) & 0xff;
+
+		if (previous.length != channels)
+		{
+			previous = new int[channels];
+			values = new int[channels];
+		}
+		if ((flags & KEYFRAME) != 0)
+			Arrays.fill(previous, 0);
+
+		int width = (flags & PACKED) != 0 ? flags >> 4 : 0;
+		int escape = (1 << width) - 1;
+
+		position = HEADER_SIZE;
+		bits = 0;
+		bitCount = 0;
+
+		for (int row = 0; row < rows; row++)
+		{
+			for (int channel = 0; channel < channels; channel++)
+			{
+				int code;
+				if (width == 0)
+					code = getVarint(length);
+				else
+				{
+					code = getBits(width, length);
+					if (code == escape)
+						code = getBits(ESCAPE_BITS, length);
+				}
+
+				// Undo the zigzag encoding, and wrap around to 16 bits like the encoder.
+				int delta = (code >>> 1) ^ -(code & 1);
+				previous[channel] = (short)(previous[channel] + delta);
+				values[channel] = previous[channel];
+			}
+
+			samples += channels;
+			listener.onSamples(values);
+		}
+	}
+
+	private int getByte(int length)
+	{
+		return position < length ? block[position++] & 0xff : 0;
+	}
+
+	private int getVarint(int length)
+	{
+		int value = 0;
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			int c = getByte(length);
+			value |= (c & 0x7f) << shift;
+			if ((c & 0x80) == 0)
+				break;
+		}
+		return value;
+	}
+
+	private int getBits(int count, int length)
+	{
+		while (bitCount < count)
+		{
+			bits |= getByte(length) << bitCount;
+			bitCount += 8;
+		}
+
+		int value = bits & ((1 << count) - 1);
+		bits >>>= count;
+		bitCount -= count;
+		return value;
+	}
+
+	/**
+	 * @return the number of blocks received.
+	 */
+	public long getBlocks()
+	{
+		return blocks;
+	}
+
+	/**
+	 * @return the number of blocks that were skipped while waiting for a keyframe.
+	 */
+	public long getSkippedBlocks()
+	{
+		return skippedBlocks;
+	}
+
+	/**
+	 * @return the number of values decoded.
+	 */
+	public long getSamples()
+	{
+		return samples;
+	}
+
+}
@@ -23,15 +23,93 @@
 
 static usb_device * adbDevice;
 static Connection * firstConnection;
+static adb_service * firstService;
 static boolean connected;
+
+// Handshake state. When not connected, CNXN messages are sent every handshakeInterval milliseconds
+// until the device responds, doubling the interval after every attempt.
+static boolean handshakePending;
+static uint32_t handshakeTime;
+static uint16_t handshakeInterval;
 static int connectionLocalId = 1;
 
+// Maximum payload size negotiated with the device.
+static uint16_t maxPayload = MAX_PAYLOAD;
+
+// Start tag of the last write sent by the transmit scheduler. Connections that have been idle resume from here.
+static uint32_t virtualTime;
+
+// Maximum number of queued writes waiting for an OKAY at the same time.
+static uint8_t transmitWindow = ADB_TRANSMIT_WINDOW;
+
+// Receive state. Message payloads are read one USB packet at a time, so that a partially received message
+// can be resumed on the next call to poll. The payload of messages other than WRTE is collected in
+// controlPayload, truncated to its size.
+static adb_message currentMessage;
+static boolean receivingPayload;
+static uint32_t payloadLeft;
+static Connection * payloadConnection;
+static uint8_t controlPayload[ADB_USB_PACKETSIZE];
+static uint8_t controlPayloadLength;
+
+// System identity string sent with the CNXN message.
+static const char adbSystemIdentity[] PROGMEM = "host::microbridge";
+
+// Authentication state. The first token of a handshake is signed, a step at a time from ADB::poll; if the
+// device answers the signature with another token, it was rejected and the public key is offered instead.
+#define ADB_AUTH_NONE 0
+#define ADB_AUTH_SIGNING 1
+#define ADB_AUTH_SIGNATURE_SENT 2
+#define ADB_AUTH_KEY_SENT 3
+
+static rsa_key authKey;
+static PGM_P authPublicKey;
+static uint8_t authState;
+static rsa_context * authContext;
+
+// Readiness bitmasks, indexed by Connection::index, and the connections they refer to. These are kept up to
+// date as connections change state, so ADB::select doesn't have to scan the connection list.
+static uint32_t readableMask;
+static uint32_t writableMask;
+static uint32_t openedMask;
+static uint32_t closedMask;
+static Connection * connectionTable[ADB_MAX_SELECT];
+
 // Event handler callback function.
 adb_eventHandler * eventHandler;
 
+// Deferred event queue. When allocated, events are recorded here and passed to the event handlers from
+// ADB::dispatchEvents. Payloads are copied into a ring of eventDataSize bytes; each payload is stored
+// contiguously, wrapping to the start of the buffer when it doesn't fit at the end.
+static adb_event * eventQueue;
+static uint8_t eventQueueSize;
+static uint8_t eventHead;
+static uint8_t eventCount;
+static uint8_t * eventData;
+static uint16_t eventDataSize;
+static uint16_t eventDataHead;
+static uint16_t eventDataTail;
+static uint16_t eventOverflow;
+static boolean dispatchingEvents;
+
 // Forward declaration
 static void usbEventHandler(usb_device * device, usb_eventType event);
 
+/**
+ * Updates the readable bit of a connection after data was added to or taken from its receive buffer.
+ *
+ * @param connection ADB connection.
+ */
+static void updateReadable(Connection * connection)
+{
+	if (connection->index == ADB_NO_INDEX) return;
+
+	if (connection->rxCount > 0)
+		readableMask |= 1UL << connection->index;
+	else
+		readableMask &= ~(1UL << connection->index);
+}
+
 /**
  * Initialises the ADB protocol. This function initialises the USB layer underneath so no further setup is required.
  */
@@ -40,6 +118,7 @@ void ADB::init()
 	// Signal that we are not connected.
 	adbDevice = NULL;
 	connected = false;
+	ADB::resetHandshake();
 
 	// Initialise the USB layer and attach an event handler.
 	USB::setEventHandler(usbEventHandler);
@@ -59,13 +138,33 @@ void ADB::setEventHandler(adb_eventHandler * handler)
 }
 
 /**
- * Fires an ADB event.
+ * Fires an ADB event. If an event queue has been set up, the event is queued to be dispatched later
+ * by ADB::dispatchEvents. Otherwise the event handlers are called immediately.
+ *
  * @param connection ADB connection. May be NULL in case of global connect/disconnect events.
  * @param type event type.
  * @param length payload length or zero if no payload.
  * @param data payload data if relevant or NULL otherwise.
  */
 void ADB::fireEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data)
+{
+	if (eventQueue!=NULL)
+	{
+		if (!ADB::queueEvent(connection, type, length, data))
+			eventOverflow++;
+	} else
+		ADB::dispatchEvent(connection, type, length, data);
+}
+
+/**
+ * Calls the global event handler and the event handler of the connection in question.
+ *
+ * @param connection ADB connection. May be NULL in case of global connect/disconnect events.
+ * @param type event type.
+ * @param length payload length or zero if no payload.
+ * @param data payload data if relevant or NULL otherwise.
+ */
+void ADB::dispatchEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data)
 {
 	// Fire the global event handler, if set.
 	if (eventHandler!=NULL)
@@ -77,654 +176,2668 @@ void ADB::fireEvent(Connection * connection, adb_eventType type, uint16_t length
 }
 
 /**
- * Adds a new ADB connection. The connection string is per ADB specs, for example "tcp:1234" opens a
- * connection to tcp port 1234, and "shell:ls" outputs a listing of the phone root filesystem. Connections
- * can be made persistent by setting reconnect to true. Persistent connections will be automatically
- * reconnected when the USB cable is re-plugged in. Non-persistent connections will connect only once,
- * and should never be used after they are closed.
- *
- * The connection string is copied into the Connection record and may not exceed ADB_CONNECTIONSTRING_LENGTH-1
- * characters.
+ * Changes the state of a connection and updates the readiness bitmasks accordingly.
  *
- * @param connectionString ADB connectionstring. I.e. "tcp:1234" or "shell:ls".
- * @param reconnect true for automatic reconnect (persistent connections).
- * @param handler event handler.
- * @return an ADB connection record or NULL on failure (not enough slots or connection string too long).
+ * @param connection ADB connection.
+ * @param status new connection state.
  */
-Connection * ADB::addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * handler)
+void ADB::setStatus(Connection * connection, ConnectionStatus status)
 {
+	ConnectionStatus previous = connection->status;
+	uint32_t bit;
 
-	// Allocate a new ADB connection object
-	Connection * connection = (Connection*)malloc(sizeof(Connection));
-	if (connection == NULL) return NULL;
+	connection->status = status;
 
-	// Allocate memory for the connection string
-	connection->connectionString = (char*)strdup(connectionString);
-	if (connection->connectionString==NULL)
-	{
-		// Free the connection object and return null
-		free(connection);
-		return NULL;
-	}
+	if (connection->index == ADB_NO_INDEX) return;
+	bit = 1UL << connection->index;
 
-	// Initialise the newly created object.
-	connection->localID = connectionLocalId ++;
-	connection->status = ADB_CLOSED;
-	connection->lastConnectionAttempt = 0;
-	connection->reconnect = reconnect;
-	connection->eventHandler = handler;
+	if (status == ADB_OPEN)
+		writableMask |= bit;
+	else
+		writableMask &= ~bit;
 
-	// Add the connection to the linked list. Note that it's easier to just insert
-	// at position 0 because you don't have to traverse the list :)
-	connection->next = firstConnection;
-	firstConnection = connection;
+	if (status == ADB_OPEN && previous != ADB_OPEN && previous != ADB_WRITING)
+		openedMask |= bit;
 
-	// Unable to find an empty spot, all connection slots in use.
-	return connection;
+	if ((previous == ADB_OPEN || previous == ADB_WRITING) && status != ADB_OPEN && status != ADB_WRITING)
+		closedMask |= bit;
 }
 
 /**
- * Prints an ADB_message, for debugging purposes.
- * @param message ADB message to print.
+ * Adds an event to the deferred event queue, copying its payload into the event data buffer. A RECEIVE
+ * event directly following a RECEIVE event for the same connection is merged into it when the payloads
+ * are adjacent in the buffer.
+ *
+ * @param connection ADB connection. May be NULL in case of global connect/disconnect events.
+ * @param type event type.
+ * @param length payload length or zero if no payload.
+ * @param data payload data if relevant or NULL otherwise.
+ * @return true on success, false if there was no room for the event or its payload.
  */
-#ifdef DEBUG
-static void adb_printMessage(adb_message * message)
+boolean ADB::queueEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data)
 {
-	switch(message->command)
+	adb_event * event;
+	uint16_t offset;
+	boolean wrapped = eventCount > 0 && eventDataTail < eventDataHead;
+
+	// Payload length of events without payload data.
+	if (data==NULL) length = 0;
+
+	// Try to append the payload to the last queued event. The event currently being dispatched is left alone.
+	if (type==ADB_CONNECTION_RECEIVE && eventCount > (dispatchingEvents ? 1 : 0))
 	{
-	case A_OKAY:
-		serialPrintf("OKAY message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
-		break;
-	case A_CLSE:
-		serialPrintf("CLSE message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
-		break;
-	case A_WRTE:
-		serialPrintf("WRTE message [%lx] %ld %ld, %ld bytes\n", message->command, message->arg0, message->arg1, message->data_length);
-		break;
-	case A_CNXN:
-		serialPrintf("CNXN message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
-		break;
-	case A_SYNC:
-		serialPrintf("SYNC message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
-		break;
-	case A_OPEN:
-		serialPrintf("OPEN message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
-		break;
-	default:
-		serialPrintf("WTF message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
-		break;
+		event = &eventQueue[(eventHead + eventCount - 1) % eventQueueSize];
+
+		if (event->type==ADB_CONNECTION_RECEIVE && event->connection==connection &&
+			event->offset + event->length == eventDataTail &&
+			(uint32_t)event->length + length <= 0xffff &&
+			(wrapped ? eventDataTail + length < eventDataHead : (uint32_t)eventDataTail + length <= eventDataSize))
+		{
+			memcpy(eventData + eventDataTail, data, length);
+			eventDataTail += length;
+			event->length += length;
+			return true;
+		}
 	}
-}
-#endif
 
-/**
- * Writes an empty message (without payload) to the ADB device.
- *
- * @param device USB device handle.
- * @param command ADB command.
- * @param arg0 first ADB argument (command dependent).
- * @param arg0 second ADB argument (command dependent).
- * @return error code or 0 for success.
- */
-int ADB::writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1)
-{
-	adb_message message;
+	if (eventCount == eventQueueSize) return false;
 
-	message.command = command;
-	message.arg0 = arg0;
-	message.arg1 = arg1;
-	message.data_length = 0;
-	message.data_check = 0;
-	message.magic = command ^ 0xffffffff;
+	// Find a contiguous block of free space for the payload.
+	if (eventCount == 0)
+	{
+		eventDataHead = eventDataTail = 0;
+		if (length > eventDataSize) return false;
+		offset = 0;
+	} else if (wrapped)
+	{
+		if (eventDataTail + length >= eventDataHead) return false;
+		offset = eventDataTail;
+	} else if ((uint32_t)eventDataTail + length <= eventDataSize)
+		offset = eventDataTail;
+	else if (length < eventDataHead)
+		offset = 0;
+	else
+		return false;
 
-#ifdef DEBUG
-	serialPrint("OUT << "); adb_printMessage(&message);
-#endif
+	if (length > 0)
+		memcpy(eventData + offset, data, length);
+	eventDataTail = offset + length;
 
-	return USB::bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
+	event = &eventQueue[(eventHead + eventCount) % eventQueueSize];
+	event->connection = connection;
+	event->type = type;
+	event->length = length;
+	event->offset = offset;
+	eventCount++;
+
+	return true;
 }
 
 /**
- * Writes an ADB message with payload to the ADB device.
+ * Sets up a deferred event queue. Once set up, events are no longer passed to the event handlers while
+ * USB transfers are in progress, but recorded and dispatched by calling ADB::dispatchEvents, typically from
+ * the main loop. Event payloads are copied into a separate data buffer. Events that do not fit in the queue
+ * are dropped and counted, see ADB::getEventOverflow.
  *
- * @param device USB device handle.
- * @param command ADB command.
- * @param arg0 first ADB argument (command dependent).
- * @param arg0 second ADB argument (command dependent).
- * @param length payload length.
- * @param data command payload.
- * @return error code or 0 for success.
+ * Passing a size of zero removes the queue, and events are passed to the event handlers immediately again.
+ * Any events still in the queue are discarded. The queue cannot be changed from within an event handler
+ * while events are being dispatched.
+ *
+ * @param size maximum number of queued events.
+ * @param dataSize size of the event payload buffer in bytes.
+ * @return true on success, false if the buffers could not be allocated.
  */
-int ADB::writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data)
+boolean ADB::setEventQueue(uint8_t size, uint16_t dataSize)
 {
-	adb_message message;
-	uint32_t count, sum = 0;
-	uint8_t * x;
-	uint8_t rcode;
+	adb_event * queue = NULL;
+	uint8_t * data = NULL;
 
-	// Calculate data checksum
-    count = length;
-    x = data;
-    while(count-- > 0) sum += *x++;
+	if (dispatchingEvents) return false;
 
-	// Fill out the message record.
-	message.command = command;
-	message.arg0 = arg0;
-	message.arg1 = arg1;
-	message.data_length = length;
-	message.data_check = sum;
-	message.magic = command ^ 0xffffffff;
+	if (size > 0)
+	{
+		queue = (adb_event*)malloc(size * sizeof(adb_event));
+		data = (uint8_t*)malloc(dataSize > 0 ? dataSize : 1);
 
-#ifdef DEBUG
-	serialPrint("OUT << "); adb_printMessage(&message);
-#endif
+		if (queue == NULL || data == NULL)
+		{
+			free(queue);
+			free(data);
+			return false;
+		}
+	}
 
-	rcode = USB::bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
-	if (rcode) return rcode;
+	free(eventQueue);
+	free(eventData);
 
-	rcode = USB::bulkWrite(device, length, data);
-	return rcode;
-}
+	eventQueue = queue;
+	eventQueueSize = size;
+	eventData = data;
+	eventDataSize = dataSize;
+	eventHead = 0;
+	eventCount = 0;
+	eventDataHead = 0;
+	eventDataTail = 0;
 
-/**
- * Writes an ADB command with a string as payload.
- *
- * @param device USB device handle.
- * @param command ADB command.
- * @param arg0 first ADB argument (command dependent).
- * @param arg0 second ADB argument (command dependent).
- * @param str payload string.
- * @return error code or 0 for success.
- */
-int ADB::writeStringMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str)
-{
-	return ADB::writeMessage(device, command, arg0, arg1, strlen(str) + 1, (uint8_t*)str);
+	return true;
 }
 
 /**
- * Poll an ADB message.
- * @param message on success, the ADB message will be returned in this struct.
- * @param poll true to poll for a packet on the input endpoint, false to wait for a packet. Use false here when a packet is expected (i.e. OKAY in response to WRTE)
- * @return true iff a packet was successfully received, false otherwise.
+ * Passes the events in the deferred event queue to the event handlers, in the order in which they occurred.
+ * Only events that were queued before the call are dispatched, so calling ADB::poll from an event handler
+ * does not lead to unbounded recursion.
+ *
+ * @return the number of events dispatched.
  */
-boolean ADB::pollMessage(adb_message * message, boolean poll)
+uint8_t ADB::dispatchEvents()
 {
-	int bytesRead;
-	uint8_t buf[ADB_USB_PACKETSIZE];
-
-	// Poll a packet from the USB
-	bytesRead = USB::bulkRead(adbDevice, ADB_USB_PACKETSIZE, buf, poll);
+	adb_event event;
+	uint8_t count, i;
 
-	// Check if the USB in transfer was successful.
-	if (bytesRead<0) return false;
+	if (eventQueue == NULL || dispatchingEvents) return 0;
 
-	// Check if the buffer contains a valid message
-	memcpy((void*)message, (void*)buf, sizeof(adb_message));
+	dispatchingEvents = true;
 
-	// If the message is corrupt, return.
-	if (message->magic != (message->command ^ 0xffffffff))
+	count = eventCount;
+	for (i = 0; i < count && eventCount > 0; i++)
 	{
-#ifdef DEBUG
-		serialPrintf("Broken message, magic mismatch, %d bytes\n", bytesRead);
-		return false;
-#endif
+		// Leave the event in the queue while its handlers run, so its payload is not overwritten.
+		event = eventQueue[eventHead];
+		ADB::dispatchEvent(event.connection, event.type, event.length, event.length > 0 ? eventData + event.offset : NULL);
+
+		eventHead = (eventHead + 1) % eventQueueSize;
+		eventCount--;
+		if (eventCount > 0)
+			eventDataHead = eventQueue[eventHead].offset;
 	}
 
-	// Check if the received number of bytes matches our expected 24 bytes of ADB message header.
-	if (bytesRead != sizeof(adb_message)) return false;
+	dispatchingEvents = false;
 
-	return true;
+	return i;
 }
 
 /**
- * Sends an ADB OPEN message for any connections that are currently in the CLOSED state.
+ * @return the number of events that were dropped because the deferred event queue was full.
  */
-void ADB::openClosedConnections()
+uint16_t ADB::getEventOverflow()
 {
-	uint32_t timeSinceLastConnect;
-	Connection * connection;
-
-	// Iterate over the connection list and send "OPEN" for the ones that are currently closed.
-	for (connection = firstConnection; connection!=NULL; connection = connection->next)
-	{
-		timeSinceLastConnect = millis() - connection->lastConnectionAttempt;
-		if (connection->status==ADB_CLOSED && timeSinceLastConnect>ADB_CONNECTION_RETRY_TIME)
-		{
-			// Issue open command.
-			ADB::writeStringMessage(adbDevice, A_OPEN, connection->localID, 0, connection->connectionString);
-
-			// Record the last attempt time
-			connection->lastConnectionAttempt = millis();
-			connection->status = ADB_OPENING;
-
-		}
-	}
-
+	return eventOverflow;
 }
 
 /**
- * Handles and ADB OKAY message, which represents a transition in the connection state machine.
+ * Reports, in a single call, which connections are readable, writable, newly opened or closed. This is
+ * constant-time regardless of the number of connections, so an event loop can serve many streams by
+ * calling this once per iteration and handling the connections whose bits are set, using
+ * ADB::getConnection to map bits to connections.
  *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * Readable and writable are levels, and stay set for as long as the condition holds. A connection is
+ * readable when its receive buffer holds data, so only connections with a receive buffer ever become
+ * readable. Opened and closed are edges, and are cleared by this call.
+ *
+ * Only the first ADB_MAX_SELECT connections that are added are tracked.
+ *
+ * @param ready filled in with the readiness of the connections.
+ * @return true iff any bit is set.
  */
-void ADB::handleOkay(Connection * connection, adb_message * message)
+boolean ADB::select(adb_readySet * ready)
 {
-	// Check if the OKAY message was a response to a CONNECT message.
-	if (connection->status==ADB_OPENING)
-	{
-		connection->status = ADB_OPEN;
-		connection->remoteID = message->arg0;
+	ready->readable = readableMask;
+	ready->writable = writableMask;
+	ready->opened = openedMask;
+	ready->closed = closedMask;
 
-		ADB::fireEvent(connection, ADB_CONNECTION_OPEN, 0, NULL);
-	}
-
-	// Check if the OKAY message was a response to a WRITE message.
-	if (connection->status == ADB_WRITING)
-		connection->status = ADB_OPEN;
+	openedMask = 0;
+	closedMask = 0;
 
+	return (ready->readable | ready->writable | ready->opened | ready->closed) != 0;
 }
 
 /**
- * Handles an ADB CLOSE message, and fires an ADB event accordingly.
+ * Looks up a connection by its index in the readiness bitmasks.
  *
- * @param connection ADB connection
+ * @param index connection index, as found in Connection::index.
+ * @return the connection, or NULL if there is no connection with the given index.
  */
-void ADB::handleClose(Connection * connection)
+Connection * ADB::getConnection(uint8_t index)
 {
-	// Check if the CLOSE message was a response to a CONNECT message.
-	if (connection->status==ADB_OPENING)
-		ADB::fireEvent(connection, ADB_CONNECTION_FAILED, 0, NULL);
-	else
-		ADB::fireEvent(connection, ADB_CONNECTION_CLOSE, 0, NULL);
-
-	// Connection failed
-	if (connection->reconnect)
-		connection->status = ADB_CLOSED;
-	else
-		connection->status = ADB_UNUSED;
-
+	return index < ADB_MAX_SELECT ? connectionTable[index] : NULL;
 }
 
 /**
- * Handles an ADB WRITE message.
+ * Sets all fields of a connection record, other than its identifiers and its place in the connection list,
+ * to their defaults.
  *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * @param connection connection record.
+ * @param connectionString connection string.
+ * @param inFlash true if the connection string resides in program memory.
+ * @param reconnect true for automatic reconnect.
+ * @param handler event handler.
  */
-void ADB::handleWrite(Connection * connection, adb_message * message)
+static void initConnection(Connection * connection, const char * connectionString, boolean inFlash, boolean reconnect, adb_eventHandler * handler)
 {
-	uint32_t bytesLeft = message->data_length;
-	uint8_t buf[ADB_USB_PACKETSIZE];
-	ConnectionStatus previousStatus;
-	int bytesRead;
-
-	previousStatus = connection->status;
+	uint16_t i;
+	uint32_t sum = 0;
 
-	connection->status = ADB_RECEIVING;
-	connection->dataRead = 0;
-	connection->dataSize = message->data_length;
-
-	while (bytesLeft>0)
+	// Calculate length and checksum of the connection string, including the trailing zero.
+	if (inFlash)
 	{
-		int len = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
-
-		// Read payload
-		bytesRead = USB::bulkRead(adbDevice, len, buf, false);
-
-//		if (len != bytesRead)
-//			serialPrintf("bytes read mismatch: %d expected, %d read, %ld left\n", len, bytesRead, bytesLeft);
-
-		// Break out of the read loop if there's no data to read :(
-		if (bytesRead==-1) break;
-
-		connection->dataRead += len;
-		ADB::fireEvent(connection, ADB_CONNECTION_RECEIVE, len, buf);
-
-		bytesLeft -= bytesRead;
+		for (i = 0; pgm_read_byte(connectionString + i) != 0; i++)
+			sum += pgm_read_byte(connectionString + i);
+	} else
+	{
+		for (i = 0; connectionString[i] != 0; i++)
+			sum += (uint8_t)connectionString[i];
 	}
 
-	// Send OKAY message in reply.
-	bytesRead = ADB::writeEmptyMessage(adbDevice, A_OKAY, message->arg1, message->arg0);
-
-	connection->status = previousStatus;
+	connection->connectionString = connectionString;
+	connection->connectionStringLength = i + 1;
+	connection->connectionStringChecksum = sum;
+	connection->connectionStringInFlash = inFlash;
+	connection->status = ADB_CLOSED;
+	connection->accepted = false;
+	connection->userData = NULL;
+	connection->lastConnectionAttempt = 0;
+	connection->retryDelay = 0;
+	connection->refusals = 0;
+	connection->reconnect = reconnect;
+	connection->eventHandler = handler;
+	connection->rxBuffer = NULL;
+	connection->rxBufferSize = 0;
+	connection->rxHead = 0;
+	connection->rxCount = 0;
+	connection->rxOverflow = 0;
+	connection->ackPolicy = ADB_ACK_EAGER;
+	connection->rxLowWatermark = 0;
+	connection->rxHighWatermark = 0;
+	connection->credits = 0;
+	connection->okayPending = false;
+	connection->txBuffer = NULL;
+	connection->txBufferSize = 0;
+	connection->txHead = 0;
+	connection->txCount = 0;
+	connection->txInFlight = 0;
+	connection->coalesce = false;
+	connection->coalesceLatency = 0;
+	connection->txLastRecord = 0;
+	connection->txFirstQueued = 0;
+	connection->txKick = false;
+	connection->txPriority = ADB_PRIORITY_NORMAL;
+	connection->txWeight = 1;
+	connection->txVirtualTime = 0;
+	connection->txChunkSize = 0;
+	connection->txRate = 0;
+	connection->txBurst = 0;
+	connection->txTokens = 0;
+	connection->txLastRefill = 0;
+	connection->isrBuffer = NULL;
+	connection->isrMask = 0;
+	connection->isrHead = 0;
+	connection->isrTail = 0;
+	connection->isrOverflow = 0;
 }
 
 /**
- * Close all ADB connections.
+ * Allocates and initialises a new connection record and adds it to the connection list. The length and
+ * checksum of the connection string are computed once here, so that re-sending the OPEN message on
+ * reconnect does not have to walk the string again.
  *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * @param connectionString ADB connection string, either in SRAM or in program memory.
+ * @param inFlash true iff connectionString points to program memory.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL on failure.
  */
-void ADB::closeAll()
+Connection * ADB::createConnection(const char * connectionString, boolean inFlash, boolean reconnect, adb_eventHandler * handler)
 {
-	Connection * connection;
+	// Allocate a new ADB connection object
+	Connection * connection = (Connection*)malloc(sizeof(Connection));
+	if (connection == NULL) return NULL;
+
+	// Initialise the newly created object.
+	initConnection(connection, connectionString, inFlash, reconnect, handler);
+	connection->localID = connectionLocalId ++;
+	connection->index = connection->localID <= ADB_MAX_SELECT ? connection->localID - 1 : ADB_NO_INDEX;
+
+	// Add the connection to the linked list. Note that it's easier to just insert
+	// at position 0 because you don't have to traverse the list :)
+	connection->next = firstConnection;
+	firstConnection = connection;
+
+	if (connection->index != ADB_NO_INDEX)
+		connectionTable[connection->index] = connection;
+
+	return connection;
+}
+
+/**
+ * Adds a new ADB connection. The connection string is per ADB specs, for example "tcp:1234" opens a
+ * connection to tcp port 1234, and "shell:ls" outputs a listing of the phone root filesystem. Local
+ * sockets are reached with "localabstract:name" and friends, see addLocalConnection. Connections
+ * can be made persistent by setting reconnect to true. Persistent connections will be automatically
+ * reconnected when the USB cable is re-plugged in. Non-persistent connections will connect only once,
+ * and should never be used after they are closed.
+ *
+ * The connection string is copied into SRAM. Use addConnection_P for constant connection strings to avoid
+ * the copy.
+ *
+ * @param connectionString ADB connectionstring. I.e. "tcp:1234" or "shell:ls".
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL on failure (out of memory).
+ */
+Connection * ADB::addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * handler)
+{
+	Connection * connection;
+
+	// Allocate memory for the connection string
+	char * copy = (char*)strdup(connectionString);
+	if (copy == NULL) return NULL;
+
+	connection = ADB::createConnection(copy, false, reconnect, handler);
+	if (connection == NULL)
+		free(copy);
+
+	return connection;
+}
+
+/**
+ * Adds a new ADB connection with a connection string that resides in program memory, for example
+ * ADB::addConnection_P(PSTR("tcp:4567"), true, handler). The string is not copied into SRAM but is
+ * streamed directly from flash whenever the connection is opened.
+ *
+ * @param connectionString ADB connection string in program memory.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL on failure (out of memory).
+ */
+Connection * ADB::addConnection_P(PGM_P connectionString, boolean reconnect, adb_eventHandler * handler)
+{
+	return ADB::createConnection(connectionString, true, reconnect, handler);
+}
+
+/**
+ * Adds a new ADB connection to an Android local socket, such as one created by
+ * android.net.LocalServerSocket. This avoids the TCP hop of a 'tcp:' connection: adbd connects to the
+ * socket directly. The connection string is built in SRAM; for constant names, addConnection_P with
+ * PSTR(ADB_LOCAL_ABSTRACT "name") avoids the copy.
+ *
+ * @param name socket name.
+ * @param space socket namespace.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL on failure (out of memory).
+ */
+Connection * ADB::addLocalConnection(const char * name, adb_socketNamespace space, boolean reconnect, adb_eventHandler * handler)
+{
+	Connection * connection;
+	PGM_P prefix;
+	uint8_t prefixLength;
+	char * connectionString;
+
+	switch (space)
+	{
+	case ADB_SOCKET_RESERVED:
+		prefix = PSTR(ADB_LOCAL_RESERVED);
+		break;
+	case ADB_SOCKET_FILESYSTEM:
+		prefix = PSTR(ADB_LOCAL_FILESYSTEM);
+		break;
+	default:
+		prefix = PSTR(ADB_LOCAL_ABSTRACT);
+		break;
+	}
+
+	// Allocate memory for the connection string
+	prefixLength = strlen_P(prefix);
+	connectionString = (char*)malloc(prefixLength + strlen(name) + 1);
+	if (connectionString == NULL) return NULL;
+
+	memcpy_P(connectionString, prefix, prefixLength);
+	strcpy(connectionString + prefixLength, name);
+
+	connection = ADB::createConnection(connectionString, false, reconnect, handler);
+	if (connection == NULL)
+		free(connectionString);
+
+	return connection;
+}
+
+#if defined(ARDUINO) && ARDUINO >= 100
+/**
+ * Adds a new ADB connection with a connection string wrapped in the F() macro, for example
+ * ADB::addConnection(F("tcp:4567"), true, handler). See addConnection_P.
+ */
+Connection * ADB::addConnection(const __FlashStringHelper * connectionString, boolean reconnect, adb_eventHandler * handler)
+{
+	return ADB::createConnection((PGM_P)connectionString, true, reconnect, handler);
+}
+#endif
+
+/**
+ * Allocates a service record and adds it to the service list.
+ *
+ * @param name service name, either in SRAM or in program memory.
+ * @param inFlash true iff name points to program memory.
+ * @param handler event handler for streams opened to the service.
+ * @return the service record or NULL on failure (out of memory).
+ */
+adb_service * ADB::createService(const char * name, boolean inFlash, adb_eventHandler * handler)
+{
+	adb_service * service = (adb_service*)malloc(sizeof(adb_service));
+	if (service == NULL) return NULL;
+
+	service->name = name;
+	service->inFlash = inFlash;
+	service->eventHandler = handler;
+	service->next = firstService;
+	firstService = service;
+
+	return service;
+}
+
+/**
+ * Registers a service that the ADB device can open streams to, so that the phone can connect to the
+ * board instead of the other way around. When the device opens a stream with a matching name, a connection
+ * is set up and the handler receives an ADB_CONNECTION_OPEN event with the requested name as payload.
+ * From then on the connection behaves like one opened with addConnection, except that it is not reopened
+ * once closed. Requests for unknown services are refused.
+ *
+ * A name ending in a colon, for example "gpio:", matches any stream name that starts with it, so that
+ * the remainder can be used as an argument ("gpio:13").
+ *
+ * The name is copied into SRAM. Use addService_P for constant names to avoid the copy.
+ *
+ * @param name service name.
+ * @param handler event handler for streams opened to the service.
+ * @return the service record or NULL on failure (out of memory).
+ */
+adb_service * ADB::addService(const char * name, adb_eventHandler * handler)
+{
+	adb_service * service;
+
+	char * copy = (char*)strdup(name);
+	if (copy == NULL) return NULL;
+
+	service = ADB::createService(copy, false, handler);
+	if (service == NULL)
+		free(copy);
+
+	return service;
+}
+
+/**
+ * Registers a service with a name in program memory, for instance ADB::addService_P(PSTR("sensor:"), handler).
+ * See addService.
+ *
+ * @param name service name in program memory.
+ * @param handler event handler for streams opened to the service.
+ * @return the service record or NULL on failure (out of memory).
+ */
+adb_service * ADB::addService_P(PGM_P name, adb_eventHandler * handler)
+{
+	return ADB::createService(name, true, handler);
+}
+
+/**
+ * Checks whether a stream name requested by the device matches a service.
+ *
+ * @param service service record.
+ * @param length length of the requested name.
+ * @param data requested name, not necessarily zero-terminated.
+ * @return true iff the name matches.
+ */
+static boolean matchService(adb_service * service, uint16_t length, uint8_t * data)
+{
+	uint16_t i;
+	char c, previous = 0;
+
+	// Ignore the trailing zero.
+	while (length > 0 && data[length - 1] == 0) length--;
+
+	for (i = 0; ; i++)
+	{
+		c = service->inFlash ? pgm_read_byte(service->name + i) : service->name[i];
+
+		// Either the whole name matched, or the service takes arguments.
+		if (c == 0) return i == length || previous == ':';
+
+		if (i == length || data[i] != c) return false;
+		previous = c;
+	}
+}
+
+/**
+ * Handles an ADB OPEN message, sent by the device to open a stream to one of our services. Replies with
+ * OKAY if there is a matching service and a connection could be set up, or CLSE otherwise. Connection
+ * records of accepted streams that have been closed are reused.
+ *
+ * @param message ADB message.
+ * @param length length of the (possibly truncated) payload, the requested stream name.
+ * @param data payload.
+ */
+void ADB::handleOpen(adb_message * message, uint16_t length, uint8_t * data)
+{
+	adb_service * service;
+	Connection * connection;
+
+	for (service = firstService; service != NULL; service = service->next)
+		if (matchService(service, length, data)) break;
+
+	// Look for a connection record that can be reused.
+	connection = NULL;
+	if (service != NULL)
+		for (connection = firstConnection; connection != NULL; connection = connection->next)
+			if (connection->accepted && connection->status == ADB_UNUSED) break;
+
+	if (service != NULL && connection == NULL)
+	{
+		connection = ADB::createConnection(service->name, service->inFlash, false, service->eventHandler);
+		if (connection != NULL)
+			connection->accepted = true;
+	}
+
+	// Refuse the stream.
+	if (connection == NULL)
+	{
+		ADB::writeEmptyMessage(adbDevice, A_CLSE, 0, message->arg0);
+		return;
+	}
+
+	if (connection->status == ADB_UNUSED)
+	{
+		// A record left over from an earlier stream, possibly to another service. Start from a clean slate,
+		// and take a fresh local id so that late messages for the old stream don't reach the new one.
+		if (connection->rxBuffer != NULL) free(connection->rxBuffer);
+		if (connection->txBuffer != NULL) free(connection->txBuffer);
+		if (connection->isrBuffer != NULL) free((uint8_t*)connection->isrBuffer);
+
+		initConnection(connection, service->name, service->inFlash, false, service->eventHandler);
+		connection->localID = connectionLocalId ++;
+		connection->accepted = true;
+	}
+
+	connection->remoteID = message->arg0;
+	updateReadable(connection);
+
+	ADB::setStatus(connection, ADB_OPEN);
+	ADB::writeEmptyMessage(adbDevice, A_OKAY, connection->localID, connection->remoteID);
+
+	ADB::fireEvent(connection, ADB_CONNECTION_OPEN, length, data);
+}
+
+/**
+ * Prints an ADB_message, for debugging purposes.
+ * @param message ADB message to print.
+ */
+#ifdef DEBUG
+static void adb_printMessage(adb_message * message)
+{
+	switch(message->command)
+	{
+	case A_OKAY:
+		serialPrintf("OKAY message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
+		break;
+	case A_CLSE:
+		serialPrintf("CLSE message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
+		break;
+	case A_WRTE:
+		serialPrintf("WRTE message [%lx] %ld %ld, %ld bytes\n", message->command, message->arg0, message->arg1, message->data_length);
+		break;
+	case A_CNXN:
+		serialPrintf("CNXN message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
+		break;
+	case A_SYNC:
+		serialPrintf("SYNC message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
+		break;
+	case A_OPEN:
+		serialPrintf("OPEN message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
+		break;
+	default:
+		serialPrintf("WTF message [%lx] %ld %ld\n", message->command, message->arg0, message->arg1);
+		break;
+	}
+}
+#endif
+
+/**
+ * Writes an empty message (without payload) to the ADB device.
+ *
+ * @param device USB device handle.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @return error code or 0 for success.
+ */
+int ADB::writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1)
+{
+	adb_message message;
+
+	message.command = command;
+	message.arg0 = arg0;
+	message.arg1 = arg1;
+	message.data_length = 0;
+	message.data_check = 0;
+	message.magic = command ^ 0xffffffff;
+
+#ifdef DEBUG
+	serialPrint("OUT << "); adb_printMessage(&message);
+#endif
+
+	return USB::bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
+}
+
+/**
+ * Writes the header of an ADB message with a precomputed payload checksum. The payload itself must be
+ * written by the caller.
+ *
+ * @param device USB device handle.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param length payload length.
+ * @param checksum payload checksum.
+ * @return error code or 0 for success.
+ */
+int ADB::writeMessageHeader(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint32_t checksum)
+{
+	adb_message message;
+
+	// Fill out the message record.
+	message.command = command;
+	message.arg0 = arg0;
+	message.arg1 = arg1;
+	message.data_length = length;
+	message.data_check = checksum;
+	message.magic = command ^ 0xffffffff;
+
+#ifdef DEBUG
+	serialPrint("OUT << "); adb_printMessage(&message);
+#endif
+
+	return USB::bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
+}
+
+/**
+ * Writes an ADB message with payload to the ADB device.
+ *
+ * @param device USB device handle.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param length payload length.
+ * @param data command payload.
+ * @return error code or 0 for success.
+ */
+int ADB::writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data)
+{
+	uint32_t count, sum = 0;
+	uint8_t * x;
+	uint8_t rcode;
+
+	// Calculate data checksum
+    count = length;
+    x = data;
+    while(count-- > 0) sum += *x++;
+
+	rcode = ADB::writeMessageHeader(device, command, arg0, arg1, length, sum);
+	if (rcode) return rcode;
+
+	rcode = USB::bulkWrite(device, length, data);
+	return rcode;
+}
+
+/**
+ * Writes an ADB message with a payload that resides in program memory.
+ *
+ * @param device USB device handle.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param length payload length.
+ * @param data command payload in program memory.
+ * @return error code or 0 for success.
+ */
+int ADB::writeMessage_P(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, const uint8_t * data)
+{
+	uint32_t i, sum = 0;
+	uint8_t rcode;
+
+	// Calculate data checksum
+	for (i = 0; i < length; i++)
+		sum += pgm_read_byte(data + i);
+
+	rcode = ADB::writeMessageHeader(device, command, arg0, arg1, length, sum);
+	if (rcode) return rcode;
+
+	return USB::bulkWrite_P(device, length, data);
+}
+
+/**
+ * Writes an ADB message with a payload gathered from several segments. The checksum is computed across all
+ * segments and the segments are streamed into the USB send FIFO one after another, so the payload never
+ * has to be assembled in a contiguous buffer.
+ *
+ * @param device USB device handle.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param count number of segments.
+ * @param segments payload segments, in SRAM or program memory.
+ * @return error code or 0 for success.
+ */
+int ADB::writeMessagev(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, const adb_segment * segments)
+{
+	uint32_t length = 0, sum = 0;
+	uint16_t j;
+	uint8_t i, rcode;
+
+	// Calculate payload length and checksum
+	for (i = 0; i < count; i++)
+	{
+		length += segments[i].length;
+
+		if (segments[i].progmem)
+			for (j = 0; j < segments[i].length; j++) sum += pgm_read_byte(segments[i].data + j);
+		else
+			for (j = 0; j < segments[i].length; j++) sum += segments[i].data[j];
+	}
+
+	rcode = ADB::writeMessageHeader(device, command, arg0, arg1, length, sum);
+	if (rcode) return rcode;
+
+	return USB::bulkWritev(device, count, segments);
+}
+
+/**
+ * Writes an ADB command with a string as payload.
+ *
+ * @param device USB device handle.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param str payload string.
+ * @return error code or 0 for success.
+ */
+int ADB::writeStringMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str)
+{
+	return ADB::writeMessage(device, command, arg0, arg1, strlen(str) + 1, (uint8_t*)str);
+}
+
+/**
+ * Writes an ADB OPEN message for a connection, using the connection string length and checksum that were
+ * cached when the connection was added. Connection strings in program memory are streamed directly from
+ * flash into the USB send FIFO.
+ *
+ * @param connection ADB connection.
+ * @return error code or 0 for success.
+ */
+int ADB::writeOpenMessage(Connection * connection)
+{
+	uint8_t rcode;
+
+	rcode = ADB::writeMessageHeader(adbDevice, A_OPEN, connection->localID, 0, connection->connectionStringLength, connection->connectionStringChecksum);
+	if (rcode) return rcode;
+
+	if (connection->connectionStringInFlash)
+		return USB::bulkWrite_P(adbDevice, connection->connectionStringLength, (const uint8_t*)connection->connectionString);
+	else
+		return USB::bulkWrite(adbDevice, connection->connectionStringLength, (uint8_t*)connection->connectionString);
+}
+
+/**
+ * Poll an ADB message.
+ * @param message on success, the ADB message will be returned in this struct.
+ * @param poll true to poll for a packet on the input endpoint, false to wait for a packet. Use false here when a packet is expected (i.e. OKAY in response to WRTE)
+ * @return true iff a packet was successfully received, false otherwise.
+ */
+boolean ADB::pollMessage(adb_message * message, boolean poll)
+{
+	int bytesRead;
+	uint8_t buf[ADB_USB_PACKETSIZE];
+
+	// Poll a packet from the USB
+	bytesRead = USB::bulkRead(adbDevice, ADB_USB_PACKETSIZE, buf, poll);
+
+	// Check if the USB in transfer was successful.
+	if (bytesRead<0) return false;
+
+	// Check if the buffer contains a valid message
+	memcpy((void*)message, (void*)buf, sizeof(adb_message));
+
+	// If the message is corrupt, return.
+	if (message->magic != (message->command ^ 0xffffffff))
+	{
+#ifdef DEBUG
+		serialPrintf("Broken message, magic mismatch, %d bytes\n", bytesRead);
+#endif
+		return false;
+	}
+
+	// Check if the received number of bytes matches our expected 24 bytes of ADB message header.
+	if (bytesRead != sizeof(adb_message)) return false;
+
+	return true;
+}
+
+/**
+ * Sends an ADB OPEN message for any connections that are currently in the CLOSED state and whose retry
+ * delay has expired. All due OPEN messages are issued back-to-back; the OKAY/CLSE responses are matched to
+ * their connections by local ID as they come in. OPEN attempts that go unanswered for
+ * ADB_CONNECTION_OPEN_TIMEOUT are considered lost and retried.
+ */
+void ADB::openClosedConnections()
+{
+	uint32_t now = millis();
+	Connection * connection;
+
+	// Iterate over the connection list and send "OPEN" for the ones that are currently closed.
+	for (connection = firstConnection; connection!=NULL; connection = connection->next)
+	{
+		// Transient failure: the OPEN or its response got lost. Retry without backing off.
+		if (connection->status==ADB_OPENING && now - connection->lastConnectionAttempt > ADB_CONNECTION_OPEN_TIMEOUT)
+		{
+			ADB::setStatus(connection, ADB_CLOSED);
+			connection->retryDelay = 0;
+			ADB::fireEvent(connection, ADB_CONNECTION_FAILED, 0, NULL);
+		}
+
+		if (connection->status==ADB_CLOSED && now - connection->lastConnectionAttempt >= connection->retryDelay)
+		{
+			// Record the last attempt time
+			connection->lastConnectionAttempt = now;
+
+			// Issue open command. If the message could not be sent, try again after the minimum delay.
+			if (ADB::writeOpenMessage(connection))
+				connection->retryDelay = ADB_CONNECTION_RETRY_TIME;
+			else
+				ADB::setStatus(connection, ADB_OPENING);
+		}
+	}
+
+}
+
+/**
+ * Resets the retry state of all connections, so that they are all opened immediately. Called when a new
+ * ADB session starts. Connections that were marked unavailable get another chance.
+ */
+void ADB::resetRetries()
+{
+	Connection * connection;
+
+	for (connection = firstConnection; connection!=NULL; connection = connection->next)
+	{
+		connection->retryDelay = 0;
+		connection->refusals = 0;
+
+		if (connection->status==ADB_UNAVAILABLE)
+			ADB::setStatus(connection, ADB_CLOSED);
+	}
+}
+
+/**
+ * Re-enables a connection that was marked ADB_UNAVAILABLE after being refused too often, and resets its
+ * retry delay so that it is opened on the next poll.
+ *
+ * @param connection ADB connection.
+ */
+void ADB::retryConnection(Connection * connection)
+{
+	connection->retryDelay = 0;
+	connection->refusals = 0;
+
+	if (connection->status==ADB_UNAVAILABLE)
+		ADB::setStatus(connection, ADB_CLOSED);
+}
+
+/**
+ * Closes a connection from our side. The connection's event handlers receive an ADB_CONNECTION_CLOSE
+ * event. Persistent connections are reopened right away, as a new stream; they get a new local ID so that
+ * messages still underway for the old stream are not mistaken for messages of the new one.
+ *
+ * @param connection ADB connection.
+ */
+void ADB::close(Connection * connection)
+{
+	if (connection->status!=ADB_OPEN && connection->status!=ADB_WRITING && connection->status!=ADB_OPENING) return;
+
+	if (connected)
+		ADB::writeEmptyMessage(adbDevice, A_CLSE, connection->localID, connection->remoteID);
+
+	ADB::fireEvent(connection, ADB_CONNECTION_CLOSE, 0, NULL);
+
+	connection->txInFlight = 0;
+	connection->okayPending = false;
+	connection->localID = connectionLocalId ++;
+	connection->retryDelay = 0;
+	ADB::setStatus(connection, connection->reconnect ? ADB_CLOSED : ADB_UNUSED);
+}
+
+/**
+ * Handles and ADB OKAY message, which represents a transition in the connection state machine.
+ *
+ * @param connection ADB connection
+ * @param message ADB message struct.
+ */
+void ADB::handleOkay(Connection * connection, adb_message * message)
+{
+	// Check if the OKAY message was a response to a CONNECT message.
+	if (connection->status==ADB_OPENING)
+	{
+		ADB::setStatus(connection, ADB_OPEN);
+		connection->remoteID = message->arg0;
+
+		// Successfully opened, reset the backoff.
+		connection->refusals = 0;
+		connection->retryDelay = ADB_CONNECTION_RETRY_TIME;
+
+		// Discard any data left over from a previous session.
+		connection->rxHead = 0;
+		connection->rxCount = 0;
+		connection->okayPending = false;
+		updateReadable(connection);
+
+		ADB::fireEvent(connection, ADB_CONNECTION_OPEN, 0, NULL);
+	}
+
+	// Check if the OKAY message was a response to a WRITE message.
+	else if (connection->status == ADB_WRITING)
+	{
+		ADB::setStatus(connection, ADB_OPEN);
+		ADB::fireEvent(connection, ADB_CONNECTION_WRITE_COMPLETE, connection->txInFlight, NULL);
+	}
+
+	// Send the next queued write, if any. Coalesced data is sent now rather than waiting for its deadline,
+	// since the link is free again.
+	connection->txKick = true;
+	ADB::flushTransmitQueues();
+}
+
+/**
+ * Handles an ADB CLOSE message, and fires an ADB event accordingly.
+ *
+ * @param connection ADB connection
+ */
+void ADB::handleClose(Connection * connection)
+{
+	boolean refused = connection->status==ADB_OPENING;
+	uint16_t interval;
+
+	// Check if the CLOSE message was a response to a CONNECT message.
+	if (refused)
+		ADB::fireEvent(connection, ADB_CONNECTION_FAILED, 0, NULL);
+	else
+		ADB::fireEvent(connection, ADB_CONNECTION_CLOSE, 0, NULL);
+
+	// A write that was in flight is lost.
+	connection->txInFlight = 0;
+
+	// Connection failed
+	if (!connection->reconnect)
+	{
+		ADB::setStatus(connection, ADB_UNUSED);
+		return;
+	}
+
+	ADB::setStatus(connection, ADB_CLOSED);
+
+	// The device refused to open the stream, for instance because nothing is listening on the TCP port.
+	// Back off exponentially, with some jitter so that several refused connections don't retry in
+	// lock-step. A destination that keeps refusing is considered permanently unavailable.
+	if (refused)
+	{
+		interval = connection->retryDelay < ADB_CONNECTION_RETRY_TIME ? ADB_CONNECTION_RETRY_TIME : connection->retryDelay;
+		interval = interval < ADB_CONNECTION_RETRY_MAX / 2 ? interval * 2 : ADB_CONNECTION_RETRY_MAX;
+		connection->retryDelay = interval - random() % (interval / 4 + 1);
+
+		if (++connection->refusals >= ADB_CONNECTION_MAX_REFUSALS)
+			ADB::setStatus(connection, ADB_UNAVAILABLE);
+	}
+
+}
+
+/**
+ * Handles a packet of payload data of an ADB WRITE message.
+ *
+ * @param connection ADB connection
+ * @param length number of bytes received.
+ * @param data payload data.
+ */
+void ADB::handleWriteData(Connection * connection, uint16_t length, uint8_t * data)
+{
+	connection->dataRead += length;
+
+	// Store the data in the receive buffer if the connection has one, otherwise pass it straight
+	// to the event handler.
+	if (connection->rxBuffer!=NULL)
+		ADB::storeReceivedData(connection, length, data);
+	else
+		ADB::fireEvent(connection, ADB_CONNECTION_RECEIVE, length, data);
+}
+
+/**
+ * Handles the end of an ADB WRITE message, once the complete payload has been received.
+ *
+ * @param connection ADB connection
+ */
+void ADB::handleWrite(Connection * connection)
+{
+	// Send OKAY message in reply, or hold it back until the application has caught up.
+	if (ADB::canAcknowledge(connection))
+		ADB::acknowledge(connection);
+	else
+		connection->okayPending = true;
+}
+
+/**
+ * Checks whether an incoming write may be acknowledged under the acknowledgement policy of the connection.
+ * For deferred acknowledgement, the high watermark is checked for a freshly received write, and the low
+ * watermark for a write whose acknowledgement is already being withheld.
+ *
+ * @param connection ADB connection
+ * @return true iff an OKAY message may be sent.
+ */
+boolean ADB::canAcknowledge(Connection * connection)
+{
+	switch (connection->ackPolicy)
+	{
+	case ADB_ACK_DEFERRED:
+		if (connection->rxBuffer == NULL) return true;
+		if (connection->okayPending)
+			return connection->rxCount <= connection->rxLowWatermark;
+		else
+			return connection->rxCount <= connection->rxHighWatermark;
+	case ADB_ACK_CREDIT:
+		return connection->credits > 0;
+	default:
+		return true;
+	}
+}
+
+/**
+ * Sends an OKAY message for the last received write and updates the acknowledgement state.
+ *
+ * @param connection ADB connection
+ */
+void ADB::acknowledge(Connection * connection)
+{
+	ADB::writeEmptyMessage(adbDevice, A_OKAY, connection->localID, connection->remoteID);
+
+	connection->okayPending = false;
+	if (connection->ackPolicy == ADB_ACK_CREDIT)
+		connection->credits--;
+}
+
+/**
+ * Sends withheld OKAY messages for connections whose application has caught up.
+ */
+void ADB::sendPendingAcknowledgements()
+{
+	Connection * connection;
+
+	for (connection = firstConnection; connection != NULL; connection = connection->next)
+		if (connection->okayPending && connection->status != ADB_UNUSED && connection->status != ADB_CLOSED && connection->status != ADB_UNAVAILABLE && ADB::canAcknowledge(connection))
+			ADB::acknowledge(connection);
+}
+
+/**
+ * Appends received data to the receive ring buffer of a connection. Bytes that do not fit are dropped and
+ * counted in rxOverflow. Connections with ADB_ACK_DEFERRED only get here once the buffer has room for the
+ * packet, or when a packet is larger than the whole buffer.
+ *
+ * @param connection ADB connection
+ * @param length number of bytes to store.
+ * @param data received data.
+ */
+void ADB::storeReceivedData(Connection * connection, uint16_t length, uint8_t * data)
+{
+	uint16_t tail;
+
+	// Drop what doesn't fit.
+	if (length > connection->rxBufferSize - connection->rxCount)
+	{
+		connection->rxOverflow += length - (connection->rxBufferSize - connection->rxCount);
+		length = connection->rxBufferSize - connection->rxCount;
+	}
+
+	tail = connection->rxHead + connection->rxCount;
+	if (tail >= connection->rxBufferSize) tail -= connection->rxBufferSize;
+
+	connection->rxCount += length;
+
+	while (length-- > 0)
+	{
+		connection->rxBuffer[tail++] = *data++;
+		if (tail == connection->rxBufferSize) tail = 0;
+	}
+
+	updateReadable(connection);
+}
+
+/**
+ * Close all ADB connections.
+ *
+ * @param connection ADB connection
+ * @param message ADB message struct.
+ */
+void ADB::closeAll()
+{
+	Connection * connection;
 
 	// Iterate over all connections and close the ones that are currently open.
 	for (connection = firstConnection; connection != NULL; connection = connection->next)
-		if (!(connection->status==ADB_UNUSED || connection->status==ADB_CLOSED))
-			ADB::handleClose(connection);
+		if (!(connection->status==ADB_UNUSED || connection->status==ADB_CLOSED || connection->status==ADB_UNAVAILABLE))
+			ADB::handleClose(connection);
+
+}
+
+/**
+ * Handles an ADB connect message. This is a response to a connect message sent from our side.
+ * @param message ADB message.
+ * @param length length of the (possibly truncated) payload, the remote ADB device ID.
+ * @param data payload.
+ */
+void ADB::handleConnect(adb_message * message, uint16_t length, uint8_t * data)
+{
+	// An unsolicited CNXN while we are connected means adbd has restarted on the device. All streams
+	// are gone on the remote side, so close them here and start a new session.
+	if (connected)
+	{
+		ADB::closeAll();
+		ADB::fireEvent(NULL, ADB_DISCONNECT, 0, NULL);
+	}
+
+	// The device announces its maximum payload size in arg1.
+	maxPayload = message->arg1 < MAX_PAYLOAD ? message->arg1 : MAX_PAYLOAD;
+
+	// Signal that we are now connected to an Android device (yay!)
+	connected = true;
+	ADB::resetHandshake();
+
+	// Open all streams right away in the new session.
+	ADB::resetRetries();
+
+	// Fire event.
+	ADB::fireEvent(NULL, ADB_CONNECT, length, data);
+
+}
+
+/**
+ * Sets the RSA key used to authenticate to the device. Devices running Android 4.2.2 or later refuse
+ * connections from unknown hosts, and reply to CNXN with an AUTH token that has to be signed. If the device
+ * doesn't know the key yet, the public key is offered and the user is asked to accept it on the phone. Once
+ * accepted (and remembered) later connections are authenticated without user interaction.
+ *
+ * The key is generated with tools/adbkey.py, which also produces the public key string.
+ *
+ * Signing is slow: some 2,600 Montgomery multiplications of 1024-bit numbers, with an inner loop in AVR
+ * assembly. By cycle count that is a little over a minute on a 16MHz AVR; the RsaBenchmark example
+ * measures it on the board. The signature is computed a step at a time from ADB::poll, within its time
+ * limit, so the sketch keeps running, and no CNXN is sent in the meantime so that adbd keeps waiting for
+ * it. Signing needs about 1.6k of free memory, which is allocated while it runs. Where a handshake of
+ * over a minute is a problem, leave the key unset and disable authentication on the phone instead.
+ *
+ * @param key private key, in the layout described in rsa.h.
+ * @param storage RSA_STORAGE_FLASH if key points to program memory, or RSA_STORAGE_EEPROM if it is an
+ * EEPROM address.
+ * @param publicKey public key string in program memory, or NULL to never offer the key.
+ */
+void ADB::setAuthKey(const uint8_t * key, uint8_t storage, PGM_P publicKey)
+{
+	authKey.data = key;
+	authKey.storage = storage;
+	authPublicKey = publicKey;
+}
+
+/**
+ * Handles an ADB AUTH message. Starts signing the token with our private key, and offers our public key
+ * when the device answers our signature with another token, which means the signature was rejected.
+ *
+ * @param message ADB message.
+ * @param length length of the payload.
+ * @param data payload, the token to sign.
+ */
+void ADB::handleAuth(adb_message * message, uint16_t length, uint8_t * data)
+{
+	if (message->arg0 != ADB_AUTH_TOKEN || authKey.data == NULL) return;
+
+	if (authState == ADB_AUTH_SIGNATURE_SENT && authPublicKey != NULL)
+	{
+		ADB::writeMessage_P(adbDevice, A_AUTH, ADB_AUTH_RSAPUBLICKEY, 0, strlen_P(authPublicKey) + 1, (const uint8_t*)authPublicKey);
+
+		// Give the user time to accept the key before sending another CNXN.
+		authState = ADB_AUTH_KEY_SENT;
+		handshakeTime = millis();
+		handshakeInterval = ADB_AUTH_CONFIRM_TIMEOUT;
+		return;
+	}
+
+	if (length != RSA_DIGEST_SIZE) return;
+
+	if (authContext == NULL)
+	{
+		authContext = (rsa_context*)malloc(sizeof(rsa_context));
+		if (authContext == NULL) return;
+	}
+
+	// A token that arrives while signing replaces the one being signed, which the device no longer accepts.
+	rsa_signBegin(authContext, &authKey, data);
+	authState = ADB_AUTH_SIGNING;
+}
+
+/**
+ * Continues signing an AUTH token until the time budget is spent, and sends the signature when it is done.
+ * Takes at least one step, so signing also progresses when the budget was used up by other work.
+ *
+ * @param start time at which the budget started, from micros().
+ * @param maxMicros time budget in microseconds, or 0 for ADB_AUTH_SIGN_SLICE.
+ */
+void ADB::pollAuth(uint32_t start, uint16_t maxMicros)
+{
+	int result;
+
+	if (maxMicros == 0)
+	{
+		start = micros();
+		maxMicros = ADB_AUTH_SIGN_SLICE;
+	}
+
+	do
+		result = rsa_signStep(authContext);
+	while (result == RSA_BUSY && micros() - start < maxMicros);
+
+	if (result == RSA_BUSY) return;
+
+	if (result == RSA_DONE)
+	{
+		ADB::writeMessage(adbDevice, A_AUTH, ADB_AUTH_SIGNATURE, 0, RSA_MODULUS_SIZE, authContext->signature);
+
+		// Wait for the verdict from here.
+		authState = ADB_AUTH_SIGNATURE_SENT;
+		handshakeTime = millis();
+	} else
+		authState = ADB_AUTH_NONE;
+
+	free(authContext);
+	authContext = NULL;
+}
+
+/**
+ * Resets the handshake state machine, so that the next CNXN is sent immediately and retries start at
+ * the minimum interval.
+ */
+void ADB::resetHandshake()
+{
+	handshakePending = false;
+	handshakeInterval = ADB_HANDSHAKE_RETRY_MIN;
+	authState = ADB_AUTH_NONE;
+
+	// Drop a signature in progress.
+	free(authContext);
+	authContext = NULL;
+}
+
+/**
+ * Advances the handshake state machine. Sends a CNXN message if none has been sent yet, or if the previous
+ * one went unanswered for the current retry interval, in which case the interval is doubled. This function
+ * never blocks; the CNXN reply is picked up by the regular message polling.
+ */
+void ADB::pollHandshake()
+{
+	// adbd waits for the signature of its token; another CNXN would only get a new token.
+	if (authState == ADB_AUTH_SIGNING) return;
+
+	if (handshakePending)
+	{
+		// Still waiting for a response.
+		if (millis() - handshakeTime < handshakeInterval) return;
+
+		// Timed out, back off.
+		handshakeInterval = handshakeInterval < ADB_HANDSHAKE_RETRY_MAX / 2 ? handshakeInterval * 2 : ADB_HANDSHAKE_RETRY_MAX;
+	}
+
+	// A token in reply to this CNXN starts a new exchange, it says nothing about an earlier signature.
+	authState = ADB_AUTH_NONE;
+
+	ADB::writeMessage_P(adbDevice, A_CNXN, 0x01000000, MAX_PAYLOAD, sizeof(adbSystemIdentity), (const uint8_t*)adbSystemIdentity);
+
+	handshakePending = true;
+	handshakeTime = millis();
+}
+
+/**
+ * Finds the connection that an incoming message is addressed to.
+ *
+ * @param localID local ID of the connection (arg1 of the message).
+ * @return the connection, or NULL if there is no such active connection.
+ */
+Connection * ADB::findConnection(uint32_t localID)
+{
+	Connection * connection;
+
+	for (connection = firstConnection; connection != NULL; connection = connection->next)
+		if (connection->status!=ADB_UNUSED && connection->status!=ADB_UNAVAILABLE && connection->localID==localID)
+			return connection;
+
+	return NULL;
+}
+
+/**
+ * Handles a completely received message.
+ */
+void ADB::dispatchMessage()
+{
+	Connection * connection;
+
+	// Handle a response from the ADB device to our CONNECT message.
+	if (currentMessage.command == A_CNXN)
+	{
+		ADB::handleConnect(&currentMessage, controlPayloadLength, controlPayload);
+		return;
+	}
+
+	// Handle an authentication challenge.
+	if (currentMessage.command == A_AUTH)
+	{
+		ADB::handleAuth(&currentMessage, controlPayloadLength, controlPayload);
+		return;
+	}
+
+	// Handle a request from the ADB device to open a stream to one of our services.
+	if (currentMessage.command == A_OPEN)
+	{
+		ADB::handleOpen(&currentMessage, controlPayloadLength, controlPayload);
+		return;
+	}
+
+	// Handle messages for specific connections
+	connection = ADB::findConnection(currentMessage.arg1);
+	if (connection == NULL) return;
+
+	switch(currentMessage.command)
+	{
+	case A_OKAY:
+		ADB::handleOkay(connection, &currentMessage);
+		break;
+	case A_CLSE:
+		ADB::handleClose(connection);
+		break;
+	case A_WRTE:
+		ADB::handleWrite(connection);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Performs a single non-blocking receive step: either polls for a new message header, or reads the next
+ * USB packet of the payload of the current message. Never waits for data that is not there yet.
+ *
+ * @return ADB_RECEIVE_IDLE if no data was available, ADB_RECEIVE_PARTIAL if part of a payload was read,
+ * or ADB_RECEIVE_COMPLETE if a message was completely received and handled.
+ */
+uint8_t ADB::receiveStep()
+{
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	uint16_t len;
+	int bytesRead;
+
+	if (!receivingPayload)
+	{
+		// Check for an incoming ADB message.
+		if (!ADB::pollMessage(&currentMessage, true))
+			return ADB_RECEIVE_IDLE;
+
+		payloadLeft = currentMessage.data_length;
+		controlPayloadLength = 0;
+
+		// Payload data of WRTE messages goes straight to the connection.
+		payloadConnection = NULL;
+		if (currentMessage.command == A_WRTE)
+		{
+			payloadConnection = ADB::findConnection(currentMessage.arg1);
+			if (payloadConnection != NULL)
+			{
+				payloadConnection->dataRead = 0;
+				payloadConnection->dataSize = currentMessage.data_length;
+			}
+		}
+
+		if (payloadLeft > 0)
+		{
+			receivingPayload = true;
+			return ADB_RECEIVE_PARTIAL;
+		}
+	} else
+	{
+		len = payloadLeft < ADB_USB_PACKETSIZE ? payloadLeft : ADB_USB_PACKETSIZE;
+
+		// With deferred acknowledgement, leave the payload in the USB pipe while the receive buffer can't
+		// take the next packet, rather than dropping it. An empty buffer always takes what it can.
+		if (payloadConnection != NULL && payloadConnection->rxBuffer != NULL
+				&& payloadConnection->ackPolicy == ADB_ACK_DEFERRED && payloadConnection->rxCount > 0
+				&& payloadConnection->rxBufferSize - payloadConnection->rxCount < len)
+			return ADB_RECEIVE_IDLE;
+
+		// Read the next packet of the payload, if it's there.
+		bytesRead = USB::bulkRead(adbDevice, len, buf, true);
+		if (bytesRead < 0) return ADB_RECEIVE_IDLE;
+		if ((uint32_t)bytesRead > payloadLeft) bytesRead = payloadLeft;
+
+		if (payloadConnection != NULL)
+			ADB::handleWriteData(payloadConnection, bytesRead, buf);
+		else if (currentMessage.command != A_WRTE)
+		{
+			// Keep as much of the payload as fits.
+			len = sizeof(controlPayload) - controlPayloadLength;
+			if (len > (uint16_t)bytesRead) len = bytesRead;
+			memcpy(controlPayload + controlPayloadLength, buf, len);
+			controlPayloadLength += len;
+		}
+
+		payloadLeft -= bytesRead;
+		if (payloadLeft > 0) return ADB_RECEIVE_PARTIAL;
+
+		receivingPayload = false;
+	}
+
+	ADB::dispatchMessage();
+
+	return ADB_RECEIVE_COMPLETE;
+}
+
+/**
+ * This method is called periodically to check for new messages on the USB bus and process them. Handles at
+ * most one incoming message, but does not wait for payload data that has not arrived yet.
+ */
+void ADB::poll()
+{
+	ADB::poll(1, 0);
+}
+
+/**
+ * Checks for new messages on the USB bus and processes them within a budget. As many messages as fit in the
+ * budget are handled. Payloads are read one USB packet at a time, and a partially received message is
+ * resumed on the next call, so a single call never waits for data that is still on its way.
+ *
+ * The budget is checked before every USB packet that is read, so a call may overrun maxMicros by the time
+ * it takes to transfer and handle one packet (including the event handler, if it is called). While an AUTH
+ * token is being signed (see ADB::setAuthKey) the rest of the budget goes to signing, which may overrun it
+ * by one step of about 0.2ms.
+ *
+ * @param maxMessages maximum number of messages to handle.
+ * @param maxMicros maximum time to spend receiving, in microseconds, or 0 for no time limit.
+ */
+void ADB::poll(uint8_t maxMessages, uint16_t maxMicros)
+{
+	uint32_t start = micros();
+	uint8_t result;
+
+	// Poll the USB layer.
+	USB::poll();
+
+	// If no USB device, there's no work for us to be done, so just return.
+	if (adbDevice==NULL) return;
+
+	// If not connected, send a connection string to the device.
+	if (!connected)
+		ADB::pollHandshake();
+
+	// If we are connected, check if there are connections that need to be opened
+	if (connected)
+		ADB::openClosedConnections();
+
+	// Release acknowledgements that were held back for slow consumers.
+	if (connected)
+		ADB::sendPendingAcknowledgements();
+
+	// Send data queued by interrupt handlers.
+	if (connected)
+		ADB::drainIsrQueues();
+
+	// Send queued writes that could not be sent right away.
+	if (connected)
+		ADB::flushTransmitQueues();
+
+	// Receive messages until the budget is spent or there's nothing more to read.
+	while (maxMessages > 0 && (maxMicros == 0 || micros() - start < maxMicros))
+	{
+		result = ADB::receiveStep();
+
+		if (result == ADB_RECEIVE_IDLE) break;
+		if (result == ADB_RECEIVE_COMPLETE) maxMessages--;
+
+		// The device may have been unplugged from an event handler.
+		if (adbDevice == NULL) break;
+	}
+
+	// Continue signing an AUTH token.
+	if (adbDevice != NULL && authState == ADB_AUTH_SIGNING)
+		ADB::pollAuth(start, maxMicros);
+
+}
+
+/**
+ * Helper function for usb_isAdbDevice to check whether an interface is a valid ADB interface.
+ * @param interface interface descriptor struct.
+ */
+boolean ADB::isAdbInterface(usb_interfaceDescriptor * interface)
+{
+
+	// Check if the interface has exactly two endpoints.
+	if (interface->bNumEndpoints!=2) return false;
+
+	// Check if the endpoint supports bulk transfer.
+	if (interface->bInterfaceProtocol != ADB_PROTOCOL) return false;
+	if (interface->bInterfaceClass != ADB_CLASS) return false;
+	if (interface->bInterfaceSubClass != ADB_SUBCLASS) return false;
+
+	return true;
+}
+
+/**
+ * Checks whether the a connected USB device is an ADB device and populates a configuration record if it is.
+ *
+ * @param device USB device.
+ * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
+ * @return true iff the device is an ADB device.
+ */
+boolean ADB::isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle)
+{
+	boolean ret = false;
+	uint8_t buf[MAX_BUF_SIZE];
+	int bytesRead;
+
+	// Read the length of the configuration descriptor.
+	bytesRead = USB::getConfigurationDescriptor(device, configuration, MAX_BUF_SIZE, buf);
+	if (bytesRead<0) return false;
+
+	int pos = 0;
+	uint8_t descriptorLength;
+	uint8_t descriptorType;
+
+	usb_configurationDescriptor * config = NULL;
+	usb_interfaceDescriptor * interface = NULL;
+	usb_endpointDescriptor * endpoint = NULL;
+
+	while (pos < bytesRead)
+	{
+		descriptorLength = buf[pos];
+		descriptorType = buf[pos + 1];
+
+		switch (descriptorType)
+		{
+		case (USB_DESCRIPTOR_CONFIGURATION):
+			config = (usb_configurationDescriptor *)(buf + pos);
+			break;
+		case (USB_DESCRIPTOR_INTERFACE):
+			interface = (usb_interfaceDescriptor *)(buf + pos);
+
+			if (ADB::isAdbInterface(interface))
+			{
+				// handle->address = address;
+				handle->configuration = config->bConfigurationValue;
+				handle->interface = interface->bInterfaceNumber;
+
+				// Detected ADB interface!
+				ret = true;
+			}
+			break;
+		case (USB_DESCRIPTOR_ENDPOINT):
+			endpoint = (usb_endpointDescriptor *)(buf + pos);
+
+			// If this endpoint descriptor is found right after the ADB interface descriptor, it belong to that interface.
+			if (interface->bInterfaceNumber == handle->interface)
+			{
+				if (endpoint->bEndpointAddress & 0x80)
+					handle->inputEndPointAddress = endpoint->bEndpointAddress & ~0x80;
+				else
+					handle->outputEndPointAddress = endpoint->bEndpointAddress;
+			}
+
+			break;
+		default:
+			break;
+		}
+
+		pos += descriptorLength;
+	}
+
+	return ret;
+
+}
+
+/**
+ * Initialises an ADB device.
+ *
+ * @param device the USB device.
+ * @param configuration configuration information.
+ */
+void ADB::initUsb(usb_device * device, adb_usbConfiguration * handle)
+{
+	// Initialise/configure the USB device.
+	// TODO write a usb_initBulkDevice function?
+	USB::initDevice(device, handle->configuration);
+
+	// Initialise bulk input endpoint.
+	USB::initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
+	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// Initialise bulk output endpoint.
+	USB::initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
+	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// Success, signal that we are now connected.
+	adbDevice = device;
+	receivingPayload = false;
+	ADB::resetHandshake();
+}
+
+/**
+ * Releases the ADB device after it has been unplugged. Closes all connections and fires a disconnect event
+ * if an ADB session was established.
+ */
+void ADB::releaseUsb()
+{
+	// Close all open ADB connections.
+	ADB::closeAll();
+
+	if (connected)
+		ADB::fireEvent(NULL, ADB_DISCONNECT, 0, NULL);
+
+	// Signal that we're no longer connected by setting the global device handler to NULL;
+	adbDevice = NULL;
+	connected = false;
+	receivingPayload = false;
+	ADB::resetHandshake();
+}
+
+/**
+ * Handles events from the USB layer.
+ *
+ * @param device USB device that generated the event.
+ * @param event USB event.
+ */
+static void usbEventHandler(usb_device * device, usb_eventType event)
+{
+	adb_usbConfiguration handle;
+
+	switch (event)
+	{
+	case USB_CONNECT:
+
+		// Check if the newly connected device is an ADB device, and initialise it if so.
+		if (ADB::isAdbDevice(device, 0, &handle))
+			ADB::initUsb(device, &handle);
+
+		break;
+
+	case USB_DISCONNECT:
+
+		// Check if the device that was disconnected is the ADB device we've been using.
+		if (device == adbDevice)
+			ADB::releaseUsb();
+
+		break;
+
+	default:
+		// ignore
+		break;
+	}
+}
+
+/**
+ * Write a set of bytes to an open ADB connection.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int ADB::write(Connection * connection, uint16_t length, uint8_t * data)
+{
+	adb_segment segment = { data, length, false };
+
+	return ADB::writev(connection, 1, &segment);
+}
+
+/**
+ * Writes data gathered from several segments to an ADB connection as a single WRTE message. This avoids
+ * having to assemble headers, timestamps, and sample data in a temporary buffer first. Segments may point
+ * to program memory by setting their progmem flag. The checksum is computed across all segments, and the
+ * segments are streamed into the USB send FIFO in order.
+ *
+ * On connections with a transmit queue the segments are gathered into the queue instead.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param count number of segments.
+ * @param segments data segments.
+ * @return 0 on success, or a negative value or USB error code on failure.
+ */
+int ADB::writev(Connection * connection, uint8_t count, const adb_segment * segments)
+{
+	int ret;
+	uint8_t i;
+
+	// Queue the data if the connection has a transmit queue.
+	if (connection->txBuffer!=NULL)
+		return ADB::queueWritev(connection, count, segments);
+
+	// First check if we have a working ADB connection
+	if (adbDevice==NULL || !connected) return -1;
+
+	// Check if the connection is open for writing.
+	if (connection->status != ADB_OPEN) return -2;
+
+	// Write payload
+	ret = ADB::writeMessagev(adbDevice, A_WRTE, connection->localID, connection->remoteID, count, segments);
+	if (ret==0)
+	{
+		ADB::setStatus(connection, ADB_WRITING);
+		connection->txInFlight = 0;
+		for (i = 0; i < count; i++)
+			connection->txInFlight += segments[i].length;
+	}
+
+	return ret;
+}
+
+/**
+ * Returns the largest payload that can be sent in a single WRTE message, as negotiated with the device.
+ * Larger writes fail.
+ *
+ * @return maximum payload size in bytes.
+ */
+uint16_t ADB::getMaxPayload()
+{
+	return maxPayload;
+}
+
+/**
+ * Write a string to an open ADB connection. The trailing zero is not transmitted.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int ADB::writeString(Connection * connection, char * str)
+{
+	return ADB::write(connection, strlen(str) + 1, (uint8_t*)str);
+}
+
+/**
+ * Appends a write to the transmit queue of a connection. Each queued write is stored as a two-byte length
+ * followed by the data, and is sent as a single WRTE message. If the connection is idle the write is sent
+ * right away.
+ *
+ * On coalescing connections, the data is appended to the last queued record instead, as long as that
+ * record stays within the negotiated maximum payload size.
+ *
+ * @param connection ADB connection.
+ * @param count number of segments.
+ * @param segments data to queue. The data is copied, so the buffers may be reused immediately.
+ * @return 0 on success, -1 if the connection is not in use, -3 if the queue is full.
+ */
+int ADB::queueWritev(Connection * connection, uint8_t count, const adb_segment * segments)
+{
+	uint16_t tail, pos, recordLength, length, i;
+	uint8_t j;
+	boolean append;
+
+	if (connection->status == ADB_UNUSED) return -1;
+
+	length = 0;
+	for (j = 0; j < count; j++)
+	{
+		if (segments[j].length > maxPayload - length) return -3;
+		length += segments[j].length;
+	}
+
+	// Nothing to send.
+	if (length == 0) return 0;
+
+	// Check whether the data can be added to the last queued record.
+	append = false;
+	if (connection->coalesce && connection->txCount > 0)
+	{
+		pos = connection->txLastRecord;
+		recordLength = connection->txBuffer[pos++];
+		if (pos == connection->txBufferSize) pos = 0;
+		recordLength |= connection->txBuffer[pos] << 8;
+
+		append = recordLength + length <= maxPayload;
+	}
+
+	// Check if the write fits, including its length prefix if a new record is needed.
+	if (length + (append ? 0 : 2) > connection->txBufferSize - connection->txCount) return -3;
+
+	tail = connection->txHead + connection->txCount;
+	if (tail >= connection->txBufferSize) tail -= connection->txBufferSize;
+
+	if (append)
+	{
+		// Update the length prefix of the last record.
+		recordLength += length;
+		connection->txBuffer[connection->txLastRecord] = recordLength & 0xff;
+		connection->txBuffer[pos] = recordLength >> 8;
+
+		connection->txCount += length;
+	} else
+	{
+		if (connection->txCount == 0)
+			connection->txFirstQueued = millis();
+
+		connection->txLastRecord = tail;
+		connection->txCount += length + 2;
+
+		// Store the length prefix, followed by the data.
+		connection->txBuffer[tail++] = length & 0xff;
+		if (tail == connection->txBufferSize) tail = 0;
+		connection->txBuffer[tail++] = length >> 8;
+		if (tail == connection->txBufferSize) tail = 0;
+	}
+
+	for (j = 0; j < count; j++)
+		for (i = 0; i < segments[j].length; i++)
+		{
+			connection->txBuffer[tail++] = segments[j].progmem ? pgm_read_byte(segments[j].data + i) : segments[j].data[i];
+			if (tail == connection->txBufferSize) tail = 0;
+		}
+
+	// Send right away if the connection is idle, and no more urgent data is waiting.
+	ADB::flushTransmitQueues();
+
+	return 0;
+}
+
+/**
+ * Adds the tokens that have accumulated in the token bucket of a rate limited connection since the last
+ * refill.
+ *
+ * @param connection ADB connection.
+ */
+static void refillTokens(Connection * connection)
+{
+	uint32_t now = millis();
+	uint32_t elapsed = now - connection->txLastRefill;
+	uint32_t tokens;
+
+	// After a long idle period the bucket is simply full. This also keeps the multiplication below from
+	// overflowing.
+	if (elapsed >= (uint32_t)connection->txBurst * 1000 / connection->txRate)
+	{
+		connection->txTokens = connection->txBurst;
+		connection->txLastRefill = now;
+		return;
+	}
+
+	tokens = elapsed * connection->txRate / 1000;
+	if (tokens == 0) return;
+
+	// Only account for the time that was converted into whole tokens, so no fractions are lost.
+	connection->txLastRefill += tokens * 1000 / connection->txRate;
+
+	tokens += connection->txTokens;
+	if (tokens >= connection->txBurst)
+	{
+		tokens = connection->txBurst;
+		connection->txLastRefill = now;
+	}
+
+	connection->txTokens = tokens;
+}
+
+/**
+ * Returns the start tag of the next write of a connection for weighted-fair scheduling. A connection that
+ * has been idle doesn't get to make up for lost time, and starts at the current virtual time.
+ *
+ * @param connection ADB connection.
+ */
+static uint32_t startTag(Connection * connection)
+{
+	return (int32_t)(connection->txVirtualTime - virtualTime) < 0 ? virtualTime : connection->txVirtualTime;
+}
+
+/**
+ * Checks whether the next queued write of a connection can be sent, and how much of it. The connection must
+ * be open and not waiting for an OKAY, and the write must not be held back for coalescing or by the rate
+ * limit. Writes larger than the chunk size are sent in several parts.
+ *
+ * @param connection ADB connection.
+ * @param force true to send a partially filled coalesced record immediately.
+ * @return the number of bytes that can be sent, or 0 if the connection is not ready to send.
+ */
+uint16_t ADB::transmitReady(Connection * connection, boolean force)
+{
+	uint16_t length, limit, pos;
+
+	if (connection->status != ADB_OPEN || connection->txCount == 0) return 0;
+
+	// Read the length prefix.
+	pos = connection->txHead;
+	length = connection->txBuffer[pos++];
+	if (pos == connection->txBufferSize) pos = 0;
+	length |= connection->txBuffer[pos] << 8;
+
+	limit = connection->txChunkSize > 0 && connection->txChunkSize < maxPayload ? connection->txChunkSize : maxPayload;
+
+	// Hold back a record that can still grow.
+	if (connection->coalesce && !force && !connection->txKick && connection->txHead == connection->txLastRecord && length < limit)
+		if (millis() - connection->txFirstQueued < connection->coalesceLatency) return 0;
+
+	if (length > limit) length = limit;
+
+	// Wait for enough tokens. A full bucket always allows one write, so chunks larger than the burst size
+	// still get through.
+	if (connection->txRate > 0)
+	{
+		refillTokens(connection);
+		if (connection->txTokens < length && connection->txTokens < connection->txBurst) return 0;
+	}
+
+	return length;
+}
+
+/**
+ * Picks the connection that should send next: the one with a write ready to go in the highest priority
+ * class, and within that class the one with the lowest start tag.
+ *
+ * @return the connection, or NULL if no connection has a write ready.
+ */
+Connection * ADB::nextTransmit()
+{
+	Connection * connection, * best = NULL;
+
+	for (connection = firstConnection; connection != NULL; connection = connection->next)
+	{
+		if (ADB::transmitReady(connection, false) == 0) continue;
+
+		if (best == NULL || connection->txPriority > best->txPriority ||
+			(connection->txPriority == best->txPriority && (int32_t)(startTag(connection) - startTag(best)) < 0))
+			best = connection;
+	}
+
+	return best;
+}
+
+/**
+ * Sends the next queued write of a connection as a WRTE message, if the connection is ready to send (see
+ * ADB::transmitReady). A queued write that wraps around the end of the ring buffer is sent as two
+ * segments, so it never has to be copied. A write larger than the chunk size is sent in parts; the
+ * remainder stays at the head of the queue.
+ *
+ * On coalescing connections, the last record is held back so that more writes can be added to it, until
+ * it reaches the maximum payload size, its latency deadline expires, or force is set.
+ *
+ * @param connection ADB connection.
+ * @param force true to send a partially filled coalesced record immediately.
+ * @return 0 if a write was sent, 1 if the connection was not ready to send, or negative if the write failed.
+ */
+int ADB::sendQueued(Connection * connection, boolean force)
+{
+	adb_segment segments[2];
+	uint16_t length, recordLength, pos, head;
+
+	if (adbDevice==NULL || !connected) return 1;
+
+	length = ADB::transmitReady(connection, force);
+	if (length == 0) return 1;
+
+	// Skip the length prefix.
+	pos = connection->txHead;
+	recordLength = connection->txBuffer[pos++];
+	if (pos == connection->txBufferSize) pos = 0;
+	recordLength |= connection->txBuffer[pos++] << 8;
+	if (pos == connection->txBufferSize) pos = 0;
+
+	segments[0].data = connection->txBuffer + pos;
+	segments[0].length = length < connection->txBufferSize - pos ? length : connection->txBufferSize - pos;
+	segments[0].progmem = false;
+	segments[1].data = connection->txBuffer;
+	segments[1].length = length - segments[0].length;
+	segments[1].progmem = false;
+
+	// Leave the write in the queue if it could not be sent, it will be retried on the next poll.
+	if (ADB::writeMessagev(adbDevice, A_WRTE, connection->localID, connection->remoteID, 2, segments))
+		return -1;
+
+	pos += length;
+	if (pos >= connection->txBufferSize) pos -= connection->txBufferSize;
+
+	if (length < recordLength)
+	{
+		// Part of the record was sent. The new length prefix goes in the two bytes just before the rest of
+		// the data, which have been sent already.
+		head = pos >= 2 ? pos - 2 : pos + connection->txBufferSize - 2;
+		recordLength -= length;
+		connection->txBuffer[head] = recordLength & 0xff;
+		connection->txBuffer[head + 1 == connection->txBufferSize ? 0 : head + 1] = recordLength >> 8;
+
+		if (connection->txLastRecord == connection->txHead)
+			connection->txLastRecord = head;
+
+		connection->txHead = head;
+		connection->txCount -= length;
+	} else
+	{
+		// Remove the write from the queue.
+		connection->txHead = pos;
+		connection->txCount -= length + 2;
+
+		// The next record starts a new coalescing deadline.
+		connection->txFirstQueued = millis();
+	}
+
+	connection->txKick = false;
+
+	// Charge the write to the token bucket and the weighted-fair schedule.
+	if (connection->txRate > 0)
+		connection->txTokens = connection->txTokens > length ? connection->txTokens - length : 0;
+
+	virtualTime = startTag(connection);
+	connection->txVirtualTime = virtualTime + ((uint32_t)length << 4) / connection->txWeight;
+
+	ADB::setStatus(connection, ADB_WRITING);
+	connection->txInFlight = length;
+
+	return 0;
+}
+
+/**
+ * Sends queued writes while there are free slots in the transmit window. Each slot goes to the connection
+ * picked by ADB::nextTransmit, so when more connections have data ready than there are slots, lower
+ * priority classes wait, and within a class connections get slots in proportion to their weights.
+ */
+void ADB::flushTransmitQueues()
+{
+	Connection * connection;
+	uint8_t inFlight = 0;
+
+	// Queued writes that are still waiting for their OKAY occupy a slot.
+	for (connection = firstConnection; connection != NULL; connection = connection->next)
+		if (connection->txBuffer != NULL && connection->status == ADB_WRITING)
+			inFlight++;
 
+	while (inFlight < transmitWindow && (connection = ADB::nextTransmit()) != NULL)
+	{
+		if (ADB::sendQueued(connection, false) != 0) break;
+		inFlight++;
+	}
+}
+
+/**
+ * Sets the number of queued writes, across all connections, that may be waiting for an OKAY at the same
+ * time. Priorities and weights only take effect when more connections have data ready than the window
+ * allows; a window of 1 serialises all queued writes in scheduling order, at the cost of one round trip
+ * per write. Unqueued writes are not counted.
+ *
+ * @param writes window size, at least 1.
+ */
+void ADB::setTransmitWindow(uint8_t writes)
+{
+	transmitWindow = writes > 0 ? writes : 1;
+}
+
+/**
+ * Allocates a transmit queue for an ADB connection. Once a connection has a transmit queue, write() and
+ * writeString() copy the data into the queue and return immediately instead of failing while a previous
+ * write is still waiting for its OKAY. Queued writes are sent in order as OKAYs arrive, and an
+ * ADB_CONNECTION_WRITE_COMPLETE event reports the number of bytes delivered for every completed write.
+ *
+ * Writes may also be queued while the connection is still opening; they are sent once it is open.
+ *
+ * @param connection ADB connection.
+ * @param size queue size in bytes. Every queued write takes two extra bytes.
+ * @return true on success, false if the buffer could not be allocated.
+ */
+boolean ADB::setTransmitBuffer(Connection * connection, uint16_t size)
+{
+	uint8_t * buffer = (uint8_t*)malloc(size);
+	if (buffer == NULL) return false;
+
+	if (connection->txBuffer != NULL)
+		free(connection->txBuffer);
+
+	connection->txBuffer = buffer;
+	connection->txBufferSize = size;
+	connection->txHead = 0;
+	connection->txCount = 0;
+
+	return true;
+}
+
+/**
+ * Sends the contents of the interrupt queues of all connections. All bytes queued so far are sent as a
+ * single write, straight from the queue (or gathered into the transmit queue, if the connection has
+ * one). The tail is only advanced once the write has been accepted, so the interrupt handler can keep
+ * adding data in the meantime.
+ */
+void ADB::drainIsrQueues()
+{
+	Connection * connection;
+	adb_segment segments[2];
+	uint8_t head, tail, count, pos;
+
+	for (connection = firstConnection; connection != NULL; connection = connection->next)
+	{
+		if (connection->isrBuffer == NULL) continue;
+
+		// Take a snapshot of the head, the producer may move it at any time.
+		head = connection->isrHead;
+		tail = connection->isrTail;
+		count = head - tail;
+		if (count == 0) continue;
+
+		pos = tail & connection->isrMask;
+
+		segments[0].data = (const uint8_t *)connection->isrBuffer + pos;
+		segments[0].length = count < connection->isrMask + 1 - pos ? count : connection->isrMask + 1 - pos;
+		segments[0].progmem = false;
+		segments[1].data = (const uint8_t *)connection->isrBuffer;
+		segments[1].length = count - segments[0].length;
+		segments[1].progmem = false;
+
+		if (ADB::writev(connection, 2, segments) == 0)
+			connection->isrTail = tail + count;
+	}
+}
+
+/**
+ * Enables or disables write coalescing on a connection with a transmit queue. When enabled, small writes
+ * are merged into a single WRTE message. The merged data is sent when the OKAY for the previous write
+ * arrives, when it reaches the negotiated maximum payload size, when it has been waiting for latency
+ * milliseconds, or when flush() is called, whichever comes first.
+ *
+ * @param connection ADB connection.
+ * @param enable true to enable coalescing.
+ * @param latency maximum time in milliseconds that queued data may be held back.
+ */
+void ADB::setCoalescing(Connection * connection, boolean enable, uint16_t latency)
+{
+	connection->coalesce = enable;
+	connection->coalesceLatency = latency;
+}
+
+/**
+ * Sends coalesced data immediately if the connection is ready for a write.
+ *
+ * @param connection ADB connection.
+ */
+void ADB::flush(Connection * connection)
+{
+	if (connection->txCount > 0)
+	{
+		connection->txKick = true;
+		ADB::flushTransmitQueues();
+	}
+}
+
+/**
+ * Sets the transmit priority class and weight of a connection with a transmit queue. Queued writes of a
+ * connection are held back while a connection in a higher priority class has a write ready to go. Within
+ * a class, slots in the transmit window (see ADB::setTransmitWindow) are shared in proportion to the
+ * weights of the connections. Connections only compete when more of them have data ready than there are
+ * free slots.
+ *
+ * @param connection ADB connection.
+ * @param priority priority class.
+ * @param weight relative share of the transmit window within the priority class, at least 1.
+ */
+void ADB::setPriority(Connection * connection, adb_priority priority, uint8_t weight)
+{
+	connection->txPriority = priority;
+	connection->txWeight = weight > 0 ? weight : 1;
+}
+
+/**
+ * Sets the maximum payload size of the WRTE messages sent from the transmit queue of a connection. Larger
+ * writes are sent in several parts, so that writes on other connections can be interleaved.
+ *
+ * @param connection ADB connection.
+ * @param size maximum number of bytes per WRTE message, or 0 for the negotiated maximum payload size.
+ */
+void ADB::setChunkSize(Connection * connection, uint16_t size)
+{
+	connection->txChunkSize = size;
+}
+
+/**
+ * Limits the rate at which data is sent from the transmit queue of a connection, using a token bucket.
+ * Up to burst bytes may be sent at once after the connection has been idle. A write larger than the
+ * burst still goes out once the bucket is full, so the burst should be at least the chunk size.
+ *
+ * @param connection ADB connection.
+ * @param rate maximum average rate in bytes per second, or 0 for no limit.
+ * @param burst bucket size in bytes, at least 1.
+ */
+void ADB::setRateLimit(Connection * connection, uint16_t rate, uint16_t burst)
+{
+	// An empty bucket would never be refilled, and would disable the limit.
+	if (burst == 0) burst = 1;
+
+	connection->txRate = rate;
+	connection->txBurst = burst;
+	connection->txTokens = burst;
+	connection->txLastRefill = millis();
+}
+
+/**
+ * Returns the largest write that can currently be accepted without failing. For connections with a
+ * transmit queue this is the free space in the queue; otherwise it is the maximum payload size if the
+ * connection is ready for a write, and zero if it is not.
+ *
+ * @param connection ADB connection.
+ * @return number of bytes that can be written.
+ */
+int ADB::availableForWrite(Connection * connection)
+{
+	uint16_t space;
+
+	if (connection->txBuffer == NULL)
+		return (connection->status == ADB_OPEN && adbDevice != NULL && connected) ? maxPayload : 0;
+
+	space = connection->txBufferSize - connection->txCount;
+	if (space <= 2) return 0;
+
+	return space - 2 < maxPayload ? space - 2 : maxPayload;
+}
+
+/**
+ * Writes data gathered from several segments to this connection. See ADB::writev.
+ *
+ * @param count number of segments.
+ * @param segments data segments.
+ * @return 0 on success, or a negative value or USB error code on failure.
+ */
+int Connection::writev(uint8_t count, const adb_segment * segments)
+{
+	return ADB::writev(this, count, segments);
+}
+
+/**
+ * Write a set of bytes to this ADB connection.
+ *
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int Connection::write(uint16_t length, uint8_t * data)
+{
+	return ADB::write(this, length, data);
+}
+
+/**
+ * Write a string to this connection.
+ *
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int Connection::writeString(char * str)
+{
+	return ADB::writeString(this, str);
+}
+
+/**
+ * Checks if the connection is open for writing.
+ * @return true iff the connection is open and ready to accept write commands.
+ */
+bool Connection::isOpen()
+{
+	return this->status == ADB_OPEN;
+}
+
+/**
+ * Allocates a receive ring buffer for an ADB connection. Once a connection has a receive buffer, incoming
+ * data is queued there and no longer delivered through ADB_CONNECTION_RECEIVE events. The application can
+ * then consume it at its own pace using available(), read(), peek(), and readBytes().
+ *
+ * @param connection ADB connection.
+ * @param size buffer size in bytes.
+ * @return true on success, false if the buffer could not be allocated.
+ */
+boolean ADB::setReceiveBuffer(Connection * connection, uint16_t size)
+{
+	uint8_t * buffer = (uint8_t*)malloc(size);
+	if (buffer == NULL) return false;
+
+	if (connection->rxBuffer != NULL)
+		free(connection->rxBuffer);
+
+	connection->rxBuffer = buffer;
+	connection->rxBufferSize = size;
+	connection->rxHead = 0;
+	connection->rxCount = 0;
+	updateReadable(connection);
+
+	// Default watermarks for deferred acknowledgement.
+	connection->rxHighWatermark = size / 2;
+	connection->rxLowWatermark = size / 4;
+
+	return true;
+}
+
+/**
+ * Allocates a receive buffer for this connection. See ADB::setReceiveBuffer.
+ *
+ * @param size buffer size in bytes.
+ * @return true on success, false if the buffer could not be allocated.
+ */
+boolean Connection::setReceiveBuffer(uint16_t size)
+{
+	return ADB::setReceiveBuffer(this, size);
 }
 
 /**
- * Handles an ADB connect message. This is a response to a connect message sent from our side.
- * @param message ADB message.
+ * @return the number of bytes waiting in the receive buffer.
  */
-void ADB::handleConnect(adb_message * message)
+int Connection::available()
 {
-	unsigned int bytesRead;
-	uint8_t buf[MAX_BUF_SIZE];
-	uint16_t len;
+	return this->rxCount;
+}
 
-	// Read payload (remote ADB device ID)
-	len = message->data_length < MAX_BUF_SIZE ? message->data_length : MAX_BUF_SIZE;
-	bytesRead = USB::bulkRead(adbDevice, len, buf, false);
+/**
+ * Reads a single byte from the receive buffer.
+ * @return the next byte, or -1 if the receive buffer is empty.
+ */
+int Connection::read()
+{
+	uint8_t value;
 
-	// Signal that we are now connected to an Android device (yay!)
-	connected = true;
+	if (this->rxCount == 0) return -1;
 
-	// Fire event.
-	ADB::fireEvent(NULL, ADB_CONNECT, len, buf);
+	value = this->rxBuffer[this->rxHead++];
+	if (this->rxHead == this->rxBufferSize) this->rxHead = 0;
+	this->rxCount--;
+	updateReadable(this);
 
+	return value;
 }
 
 /**
- * This method is called periodically to check for new messages on the USB bus and process them.
+ * Returns the next byte in the receive buffer without removing it.
+ * @return the next byte, or -1 if the receive buffer is empty.
  */
-void ADB::poll()
+int Connection::peek()
 {
-	Connection * connection;
-	adb_message message;
+	if (this->rxCount == 0) return -1;
 
-	// Poll the USB layer.
-	USB::poll();
+	return this->rxBuffer[this->rxHead];
+}
 
-	// If no USB device, there's no work for us to be done, so just return.
-	if (adbDevice==NULL) return;
+/**
+ * Reads up to length bytes from the receive buffer. Does not block.
+ *
+ * @param buffer target buffer.
+ * @param length maximum number of bytes to read.
+ * @return number of bytes read.
+ */
+uint16_t Connection::readBytes(uint8_t * buffer, uint16_t length)
+{
+	uint16_t count = 0;
 
-	// If not connected, send a connection string to the device.
-	if (!connected)
+	while (count < length && this->rxCount > 0)
 	{
-		ADB::writeStringMessage(adbDevice, A_CNXN, 0x01000000, 4096, (char*)"host::microbridge");
-		delay(500); // Give the device some time to respond.
+		buffer[count++] = this->rxBuffer[this->rxHead++];
+		if (this->rxHead == this->rxBufferSize) this->rxHead = 0;
+		this->rxCount--;
 	}
 
-	// If we are connected, check if there are connections that need to be opened
-	if (connected)
-		ADB::openClosedConnections();
-
-	// Check for an incoming ADB message.
-	if (!ADB::pollMessage(&message, true))
-		return;
-
-	// Handle a response from the ADB device to our CONNECT message.
-	if (message.command == A_CNXN)
-		ADB::handleConnect(&message);
-
-	// Handle messages for specific connections
-	for (connection = firstConnection; connection != NULL; connection = connection->next)
-	{
-		if (connection->status!=ADB_UNUSED && connection->localID==message.arg1)
-		{
-			switch(message.command)
-			{
-			case A_OKAY:
-				ADB::handleOkay(connection, &message);
-				break;
-			case A_CLSE:
-				ADB::handleClose(connection);
-				break;
-			case A_WRTE:
-				ADB::handleWrite(connection, &message);
-				break;
-			default:
-				break;
-			}
-		}
-	}
+	updateReadable(this);
 
+	return count;
 }
 
 /**
- * Helper function for usb_isAdbDevice to check whether an interface is a valid ADB interface.
- * @param interface interface descriptor struct.
+ * Sets the acknowledgement policy for incoming writes on a connection. With ADB_ACK_EAGER every write is
+ * acknowledged as soon as it has been read, which is the default. ADB_ACK_DEFERRED requires a receive
+ * buffer and withholds the acknowledgement while the buffer is filled beyond its high watermark, until the
+ * application has read it down to the low watermark. ADB_ACK_CREDIT acknowledges one write per credit
+ * granted with addCredits.
+ *
+ * Note that the remote side may send up to the negotiated maximum payload (4096 bytes) in a single write,
+ * so for lossless deferred acknowledgement the space above the high watermark must be able to hold one
+ * full write.
+ *
+ * @param connection ADB connection.
+ * @param policy acknowledgement policy.
  */
-boolean ADB::isAdbInterface(usb_interfaceDescriptor * interface)
+void ADB::setAckPolicy(Connection * connection, adb_ackPolicy policy)
 {
-
-	// Check if the interface has exactly two endpoints.
-	if (interface->bNumEndpoints!=2) return false;
-
-	// Check if the endpoint supports bulk transfer.
-	if (interface->bInterfaceProtocol != ADB_PROTOCOL) return false;
-	if (interface->bInterfaceClass != ADB_CLASS) return false;
-	if (interface->bInterfaceSubClass != ADB_SUBCLASS) return false;
-
-	return true;
+	connection->ackPolicy = policy;
 }
 
 /**
- * Checks whether the a connected USB device is an ADB device and populates a configuration record if it is.
+ * Sets the receive buffer watermarks used by ADB_ACK_DEFERRED.
  *
- * @param device USB device.
- * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
- * @return true iff the device is an ADB device.
+ * @param connection ADB connection.
+ * @param low fill level (in bytes) at or below which a withheld acknowledgement is sent.
+ * @param high fill level (in bytes) above which acknowledgements are withheld.
  */
-boolean ADB::isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle)
+void ADB::setWatermarks(Connection * connection, uint16_t low, uint16_t high)
 {
-	boolean ret = false;
-	uint8_t buf[MAX_BUF_SIZE];
-	int bytesRead;
-
-	// Read the length of the configuration descriptor.
-	bytesRead = USB::getConfigurationDescriptor(device, configuration, MAX_BUF_SIZE, buf);
-	if (bytesRead<0) return false;
-
-	int pos = 0;
-	uint8_t descriptorLength;
-	uint8_t descriptorType;
-
-	usb_configurationDescriptor * config = NULL;
-	usb_interfaceDescriptor * interface = NULL;
-	usb_endpointDescriptor * endpoint = NULL;
-
-	while (pos < bytesRead)
-	{
-		descriptorLength = buf[pos];
-		descriptorType = buf[pos + 1];
-
-		switch (descriptorType)
-		{
-		case (USB_DESCRIPTOR_CONFIGURATION):
-			config = (usb_configurationDescriptor *)(buf + pos);
-			break;
-		case (USB_DESCRIPTOR_INTERFACE):
-			interface = (usb_interfaceDescriptor *)(buf + pos);
+	connection->rxLowWatermark = low;
+	connection->rxHighWatermark = high;
+}
 
-			if (ADB::isAdbInterface(interface))
-			{
-				// handle->address = address;
-				handle->configuration = config->bConfigurationValue;
-				handle->interface = interface->bInterfaceNumber;
+/**
+ * Grants credits to a connection using ADB_ACK_CREDIT. Each credit allows one incoming write to be
+ * acknowledged. A withheld acknowledgement is sent on the next call to ADB::poll.
+ *
+ * @param connection ADB connection.
+ * @param count number of credits to add.
+ */
+void ADB::addCredits(Connection * connection, uint8_t count)
+{
+	if (connection->credits > 255 - count)
+		connection->credits = 255;
+	else
+		connection->credits += count;
+}
 
-				// Detected ADB interface!
-				ret = true;
-			}
-			break;
-		case (USB_DESCRIPTOR_ENDPOINT):
-			endpoint = (usb_endpointDescriptor *)(buf + pos);
+/**
+ * Sets the transmit priority class and weight of this connection. See ADB::setPriority.
+ * @param priority priority class.
+ * @param weight relative share of the transmit window within the priority class.
+ */
+void Connection::setPriority(adb_priority priority, uint8_t weight)
+{
+	ADB::setPriority(this, priority, weight);
+}
 
-			// If this endpoint descriptor is found right after the ADB interface descriptor, it belong to that interface.
-			if (interface->bInterfaceNumber == handle->interface)
-			{
-				if (endpoint->bEndpointAddress & 0x80)
-					handle->inputEndPointAddress = endpoint->bEndpointAddress & ~0x80;
-				else
-					handle->outputEndPointAddress = endpoint->bEndpointAddress;
-			}
+/**
+ * Sets the maximum payload size of the WRTE messages sent by this connection. See ADB::setChunkSize.
+ * @param size maximum number of bytes per WRTE message, or 0 for no limit.
+ */
+void Connection::setChunkSize(uint16_t size)
+{
+	ADB::setChunkSize(this, size);
+}
 
-			break;
-		default:
-			break;
-		}
+/**
+ * Limits the rate at which this connection sends queued data. See ADB::setRateLimit.
+ * @param rate maximum average rate in bytes per second, or 0 for no limit.
+ * @param burst bucket size in bytes.
+ */
+void Connection::setRateLimit(uint16_t rate, uint16_t burst)
+{
+	ADB::setRateLimit(this, rate, burst);
+}
 
-		pos += descriptorLength;
-	}
+/**
+ * Sets the acknowledgement policy of this connection. See ADB::setAckPolicy.
+ * @param policy acknowledgement policy.
+ */
+void Connection::setAckPolicy(adb_ackPolicy policy)
+{
+	ADB::setAckPolicy(this, policy);
+}
 
-	return ret;
+/**
+ * Sets the receive buffer watermarks of this connection. See ADB::setWatermarks.
+ * @param low low watermark in bytes.
+ * @param high high watermark in bytes.
+ */
+void Connection::setWatermarks(uint16_t low, uint16_t high)
+{
+	ADB::setWatermarks(this, low, high);
+}
 
+/**
+ * Grants credits to this connection. See ADB::addCredits.
+ * @param count number of credits to add.
+ */
+void Connection::addCredits(uint8_t count)
+{
+	ADB::addCredits(this, count);
 }
 
 /**
- * Initialises an ADB device.
+ * Allocates a transmit queue for this connection. See ADB::setTransmitBuffer.
  *
- * @param device the USB device.
- * @param configuration configuration information.
+ * @param size queue size in bytes.
+ * @return true on success, false if the buffer could not be allocated.
  */
-void ADB::initUsb(usb_device * device, adb_usbConfiguration * handle)
+boolean Connection::setTransmitBuffer(uint16_t size)
 {
-	// Initialise/configure the USB device.
-	// TODO write a usb_initBulkDevice function?
-	USB::initDevice(device, handle->configuration);
-
-	// Initialise bulk input endpoint.
-	USB::initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
-	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
-	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
-
-	// Initialise bulk output endpoint.
-	USB::initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
-	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
-	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+	return ADB::setTransmitBuffer(this, size);
+}
 
-	// Success, signal that we are now connected.
-	adbDevice = device;
+/**
+ * @return the number of bytes that can be written without failing. See ADB::availableForWrite.
+ */
+int Connection::availableForWrite()
+{
+	return ADB::availableForWrite(this);
 }
 
 /**
- * Handles events from the USB layer.
+ * Enables or disables write coalescing on this connection. See ADB::setCoalescing.
  *
- * @param device USB device that generated the event.
- * @param event USB event.
+ * @param enable true to enable coalescing.
+ * @param latency maximum time in milliseconds that queued data may be held back.
  */
-static void usbEventHandler(usb_device * device, usb_eventType event)
+void Connection::setCoalescing(boolean enable, uint16_t latency)
 {
-	adb_usbConfiguration handle;
-
-	switch (event)
-	{
-	case USB_CONNECT:
+	ADB::setCoalescing(this, enable, latency);
+}
 
-		// Check if the newly connected device is an ADB device, and initialise it if so.
-		if (ADB::isAdbDevice(device, 0, &handle))
-			ADB::initUsb(device, &handle);
+/**
+ * Sends coalesced data immediately. See ADB::flush.
+ */
+void Connection::flush()
+{
+	ADB::flush(this);
+}
 
-		break;
+/**
+ * Allocates a lock-free queue that an interrupt handler can write into with isrWrite. The queue is drained
+ * into WRTE messages by ADB::poll, so interrupt handlers never have to touch the USB bus. There may be only
+ * one producer per connection, i.e. isrWrite may be called from a single interrupt handler (or only from
+ * code that runs with interrupts disabled).
+ *
+ * @param connection ADB connection.
+ * @param size queue size in bytes. Must be a power of two no larger than 256. One byte is kept free to tell
+ * a full queue from an empty one.
+ * @return true on success, false if the size is invalid or the buffer could not be allocated.
+ */
+boolean ADB::setIsrBuffer(Connection * connection, uint16_t size)
+{
+	uint8_t * buffer;
 
-	case USB_DISCONNECT:
+	if (size < 2 || size > 256 || (size & (size - 1)) != 0) return false;
 
-		// Check if the device that was disconnected is the ADB device we've been using.
-		if (device == adbDevice)
-		{
-			// Close all open ADB connections.
-			ADB::closeAll();
+	buffer = (uint8_t*)malloc(size);
+	if (buffer == NULL) return false;
 
-			// Signal that we're no longer connected by setting the global device handler to NULL;
-			adbDevice = NULL;
-			connected = false;
-		}
+	if (connection->isrBuffer != NULL)
+		free((uint8_t*)connection->isrBuffer);
 
-		break;
+	connection->isrBuffer = buffer;
+	connection->isrMask = size - 1;
+	connection->isrHead = 0;
+	connection->isrTail = 0;
 
-	default:
-		// ignore
-		break;
-	}
+	return true;
 }
 
 /**
- * Write a set of bytes to an open ADB connection.
+ * Adds a record to the interrupt queue of a connection. Safe to call from an interrupt handler: it does
+ * not block, does not touch the USB bus, and runs in time proportional to length. Records are added
+ * entirely or not at all; a record that does not fit is dropped and counted in isrOverflow.
  *
- * @param connection ADB connection to write the data to.
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param connection ADB connection.
+ * @param length number of bytes to add.
+ * @param data data to add.
+ * @return true on success, false if the queue is full.
  */
-int ADB::write(Connection * connection, uint16_t length, uint8_t * data)
+boolean ADB::isrWrite(Connection * connection, uint8_t length, const uint8_t * data)
 {
-	int ret;
+	uint8_t head = connection->isrHead;
+	uint8_t used = head - connection->isrTail;
 
-	// First check if we have a working ADB connection
-	if (adbDevice==NULL || !connected) return -1;
+	if (length > connection->isrMask - used)
+	{
+		connection->isrOverflow++;
+		return false;
+	}
 
-	// Check if the connection is open for writing.
-	if (connection->status != ADB_OPEN) return -2;
+	while (length--)
+		connection->isrBuffer[head++ & connection->isrMask] = *data++;
 
-	// Write payload
-	ret = ADB::writeMessage(adbDevice, A_WRTE, connection->localID, connection->remoteID, length, data);
-	if (ret==0)
-		connection->status = ADB_WRITING;
+	// Publish the data to the consumer.
+	connection->isrHead = head;
 
-	return ret;
+	return true;
 }
 
 /**
- * Write a string to an open ADB connection. The trailing zero is not transmitted.
- *
- * @param connection ADB connection to write the data to.
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param connection ADB connection.
+ * @return the number of records dropped because the interrupt queue was full.
  */
-int ADB::writeString(Connection * connection, char * str)
+uint16_t ADB::getIsrOverflow(Connection * connection)
 {
-	int ret;
-
-	// First check if we have a working ADB connection
-	if (adbDevice==NULL || !connected) return -1;
-
-	// Check if the connection is open for writing.
-	if (connection->status != ADB_OPEN) return -2;
+	uint16_t overflow;
+	uint8_t oldSREG = SREG;
 
-	// Write payload
-	ret = ADB::writeStringMessage(adbDevice, A_WRTE, connection->localID, connection->remoteID, str);
-	if (ret==0)
-		connection->status = ADB_WRITING;
+	// The counter is updated from interrupt context, so read it atomically.
+	cli();
+	overflow = connection->isrOverflow;
+	SREG = oldSREG;
 
-	return ret;
+	return overflow;
 }
 
 /**
- * Write a set of bytes to this ADB connection.
+ * Allocates an interrupt queue for this connection. See ADB::setIsrBuffer.
  *
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param size queue size in bytes, a power of two no larger than 256.
+ * @return true on success.
  */
-int Connection::write(uint16_t length, uint8_t * data)
+boolean Connection::setIsrBuffer(uint16_t size)
 {
-	return ADB::write(this, length, data);
+	return ADB::setIsrBuffer(this, size);
 }
 
 /**
- * Write a string to this connection.
+ * Adds a record to the interrupt queue of this connection. See ADB::isrWrite.
  *
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param length number of bytes to add.
+ * @param data data to add.
+ * @return true on success, false if the queue is full.
  */
-int Connection::writeString(char * str)
+boolean Connection::isrWrite(uint8_t length, const uint8_t * data)
 {
-	return ADB::writeString(this, str);
+	return ADB::isrWrite(this, length, data);
 }
 
 /**
- * Checks if the connection is open for writing.
- * @return true iff the connection is open and ready to accept write commands.
+ * @return the number of records dropped because the interrupt queue was full.
  */
-bool Connection::isOpen()
+uint16_t Connection::getIsrOverflow()
 {
-	return this->status == ADB_OPEN;
+	return ADB::getIsrOverflow(this);
 }
-
@@ -18,12 +18,14 @@
 #define __adb_h__
 
 #include "wiring.h"
+#include <avr/pgmspace.h>
 #include <usb.h>
 #include <ch9.h>
+#include <rsa.h>
 
 typedef void(usb_eventHandler)(usb_device * device, usb_eventType event);
 
-#define MAX_PAYLOAD 4096;
+#define MAX_PAYLOAD 4096
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -31,14 +33,63 @@ typedef void(usb_eventHandler)(usb_device * device, usb_eventType event);
 #define A_OKAY 0x59414b4f
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
+#define A_AUTH 0x48545541
+
+// AUTH message types (arg0).
+#define ADB_AUTH_TOKEN 1
+#define ADB_AUTH_SIGNATURE 2
+#define ADB_AUTH_RSAPUBLICKEY 3
 
 #define ADB_CLASS 0xff
 #define ADB_SUBCLASS 0x42
 #define ADB_PROTOCOL 0x1
 
 #define ADB_USB_PACKETSIZE 0x40
+
+// Number of connections that are tracked in the readiness bitmasks, and the index of connections beyond that.
+#define ADB_MAX_SELECT 32
+#define ADB_NO_INDEX 0xff
+
+// Results of a single receive step.
+#define ADB_RECEIVE_IDLE 0
+#define ADB_RECEIVE_PARTIAL 1
+#define ADB_RECEIVE_COMPLETE 2
+
 #define ADB_CONNECTION_RETRY_TIME 1000
 
+// Upper bound of the per-connection retry interval, which doubles (plus jitter) every time the device
+// refuses to open a stream.
+#define ADB_CONNECTION_RETRY_MAX 30000
+
+// Time to wait for an OKAY or CLSE in response to an OPEN before the attempt is considered lost.
+#define ADB_CONNECTION_OPEN_TIMEOUT 2000
+
+// Number of consecutive refusals after which a destination is considered permanently unavailable.
+#define ADB_CONNECTION_MAX_REFUSALS 8
+
+// CNXN retry interval bounds in milliseconds. The interval doubles after every unanswered CNXN.
+#define ADB_HANDSHAKE_RETRY_MIN 250
+#define ADB_HANDSHAKE_RETRY_MAX 8000
+
+// Time in milliseconds that the user gets to accept our public key on the phone before the handshake is
+// restarted.
+#define ADB_AUTH_CONFIRM_TIMEOUT 30000
+
+// Time in microseconds spent signing an AUTH token per call to ADB::poll, when the call has no time limit
+// of its own.
+#define ADB_AUTH_SIGN_SLICE 2000
+
+// Default number of queued writes that may be waiting for an OKAY at the same time, across all
+// connections. The transmit scheduler decides which connection gets a free slot.
+#define ADB_TRANSMIT_WINDOW 2
+
+// Connection string prefixes for Android local (unix domain) sockets. Streams to these skip adbd's TCP
+// client and the loopback network stack. The prefixes can be pasted onto a literal socket name, as in
+// PSTR(ADB_LOCAL_ABSTRACT "microbridge").
+#define ADB_LOCAL_ABSTRACT "localabstract:"
+#define ADB_LOCAL_RESERVED "localreserved:"
+#define ADB_LOCAL_FILESYSTEM "localfilesystem:"
+
 typedef struct
 {
 	uint8_t address;
@@ -77,7 +128,8 @@ typedef enum
 	ADB_OPEN,
 	ADB_OPENING,
 	ADB_RECEIVING,
-	ADB_WRITING
+	ADB_WRITING,
+	ADB_UNAVAILABLE
 } ConnectionStatus;
 
 typedef enum
@@ -87,30 +139,198 @@ typedef enum
 	ADB_CONNECTION_OPEN,
 	ADB_CONNECTION_CLOSE,
 	ADB_CONNECTION_FAILED,
-	ADB_CONNECTION_RECEIVE
+	ADB_CONNECTION_RECEIVE,
+	ADB_CONNECTION_WRITE_COMPLETE
 } adb_eventType;
 
+/**
+ * Policies for acknowledging (OKAY) incoming WRTE messages. The remote side will not send the next WRTE
+ * on a stream until the previous one has been acknowledged, so withholding the OKAY applies backpressure.
+ */
+typedef enum
+{
+	// Acknowledge as soon as the payload has been read.
+	ADB_ACK_EAGER = 0,
+
+	// Withhold the acknowledgement while the receive buffer is filled beyond the high watermark, and
+	// send it once the application has drained the buffer to the low watermark. Payload that doesn't fit
+	// in the receive buffer is left unread until the application makes room, which holds up all incoming
+	// messages in the meantime.
+	ADB_ACK_DEFERRED,
+
+	// Acknowledge only while the application has granted credits, one credit per WRTE.
+	ADB_ACK_CREDIT
+} adb_ackPolicy;
+
+/**
+ * A segment of data for scatter-gather writes. Set progmem to true for data in program memory.
+ */
+typedef usb_segment adb_segment;
+
+/**
+ * Transmit priority classes. Queued writes of a connection are only sent when no connection of a higher
+ * class has data ready to go.
+ */
+typedef enum
+{
+	ADB_PRIORITY_LOW = 0,
+	ADB_PRIORITY_NORMAL,
+	ADB_PRIORITY_HIGH
+} adb_priority;
+
+/**
+ * Namespaces of Android local sockets. Abstract sockets are the kind that android.net.LocalServerSocket
+ * creates; reserved sockets live in /dev/socket; filesystem sockets are bound to a path.
+ */
+typedef enum
+{
+	ADB_SOCKET_ABSTRACT = 0,
+	ADB_SOCKET_RESERVED,
+	ADB_SOCKET_FILESYSTEM
+} adb_socketNamespace;
+
 class Connection;
 
 // Event handler
 typedef void(adb_eventHandler)(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
 
+/**
+ * Record of an event in the deferred event queue. The payload is stored in the event data buffer at the
+ * given offset.
+ */
+typedef struct
+{
+	Connection * connection;
+	adb_eventType type;
+	uint16_t length;
+	uint16_t offset;
+} adb_event;
+
+/**
+ * Readiness of connections, as returned by ADB::select. Bit n refers to the connection with index n.
+ */
+typedef struct
+{
+	// Connections with data in their receive buffer.
+	uint32_t readable;
+
+	// Open connections without an outstanding WRTE.
+	uint32_t writable;
+
+	// Connections that were opened or closed since the last call to ADB::select.
+	uint32_t opened;
+	uint32_t closed;
+} adb_readySet;
+
+/**
+ * A named service that the ADB device can open streams to. See ADB::addService.
+ */
+typedef struct adb_service
+{
+	const char * name;
+	boolean inFlash;
+	adb_eventHandler * eventHandler;
+	struct adb_service * next;
+} adb_service;
+
 class Connection
 {
 private:
 public:
-	char * connectionString;
+	const char * connectionString;
+	uint16_t connectionStringLength;
+	uint32_t connectionStringChecksum;
+	boolean connectionStringInFlash;
 	uint32_t localID, remoteID;
 	uint32_t lastConnectionAttempt;
+	uint16_t retryDelay;
+	uint8_t refusals;
 	uint16_t dataSize, dataRead;
 	ConnectionStatus status;
 	boolean reconnect;
 	adb_eventHandler * eventHandler;
 	Connection * next;
 
+	// Position in the readiness bitmasks, or ADB_NO_INDEX.
+	uint8_t index;
+
+	// True for streams that were opened by the device, to one of our services.
+	boolean accepted;
+
+	// Application data, not used by the ADB layer.
+	void * userData;
+
+	// Optional receive ring buffer. When set, incoming data is stored here instead of being passed
+	// to the event handler with ADB_CONNECTION_RECEIVE events.
+	uint8_t * rxBuffer;
+	uint16_t rxBufferSize, rxHead, rxCount;
+	uint16_t rxOverflow;
+
+	// Acknowledgement policy for incoming writes.
+	adb_ackPolicy ackPolicy;
+	uint16_t rxLowWatermark, rxHighWatermark;
+	uint8_t credits;
+	boolean okayPending;
+
+	// Optional transmit queue. When set, writes are queued as length-prefixed records and sent one WRTE
+	// at a time as the remote side acknowledges them.
+	uint8_t * txBuffer;
+	uint16_t txBufferSize, txHead, txCount;
+	uint16_t txInFlight;
+
+	// Write coalescing. Small writes are appended to the last queued record, which is held back for at
+	// most coalesceLatency milliseconds after its first byte was queued.
+	boolean coalesce;
+	uint16_t coalesceLatency;
+	uint16_t txLastRecord;
+	uint32_t txFirstQueued;
+	boolean txKick;
+
+	// Transmit scheduling. Queued writes compete for the slots of the transmit window; within a priority
+	// class, connections get slots in proportion to their weights. Records larger than txChunkSize are sent
+	// in several WRTEs, so other connections can get a turn in between. An optional token bucket limits the
+	// rate to txRate bytes per second.
+	adb_priority txPriority;
+	uint8_t txWeight;
+	uint32_t txVirtualTime;
+	uint16_t txChunkSize;
+	uint16_t txRate, txBurst, txTokens;
+	uint32_t txLastRefill;
+
+	// Optional lock-free single-producer/single-consumer queue that an interrupt handler can write into
+	// without touching USB. The free-running head is only written by the producer and the tail only by
+	// ADB::poll, which drains the queue into WRTE messages.
+	volatile uint8_t * isrBuffer;
+	uint8_t isrMask;
+	volatile uint8_t isrHead, isrTail;
+	volatile uint16_t isrOverflow;
+
 	int write(uint16_t length, uint8_t * data);
+	int writev(uint8_t count, const adb_segment * segments);
 	int writeString(char * str);
 	bool isOpen();
+
+	boolean setTransmitBuffer(uint16_t size);
+	int availableForWrite();
+	void setCoalescing(boolean enable, uint16_t latency);
+	void flush();
+	void setPriority(adb_priority priority, uint8_t weight);
+	void setChunkSize(uint16_t size);
+	void setRateLimit(uint16_t rate, uint16_t burst);
+
+	boolean setIsrBuffer(uint16_t size);
+	boolean isrWrite(uint8_t length, const uint8_t * data);
+	uint16_t getIsrOverflow();
+
+	boolean setReceiveBuffer(uint16_t size);
+	int available();
+	int read();
+	int peek();
+	uint16_t readBytes(uint8_t * buffer, uint16_t length);
+
+	void setAckPolicy(adb_ackPolicy policy);
+	void setWatermarks(uint16_t low, uint16_t high);
+	void addCredits(uint8_t count);
 };
 
 class ADB
@@ -118,28 +338,92 @@ class ADB
 
 private:
 	static void fireEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data);
+	static void dispatchEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data);
+	static void setStatus(Connection * connection, ConnectionStatus status);
+	static boolean queueEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data);
 	static int writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1);
 	static int writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data);
+	static int writeMessage_P(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, const uint8_t * data);
 	static int writeStringMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str);
+	static int writeMessageHeader(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint32_t checksum);
+	static int writeOpenMessage(Connection * connection);
+	static Connection * createConnection(const char * connectionString, boolean inFlash, boolean reconnect, adb_eventHandler * eventHandler);
 	static boolean pollMessage(adb_message * message, boolean poll);
 	static void openClosedConnections();
+	static void resetRetries();
 	static void handleOkay(Connection * connection, adb_message * message);
 	static void handleClose(Connection * connection);
-	static void handleWrite(Connection * connection, adb_message * message);
-	static void handleConnect(adb_message * message);
+	static void handleWriteData(Connection * connection, uint16_t length, uint8_t * data);
+	static void handleWrite(Connection * connection);
+	static void storeReceivedData(Connection * connection, uint16_t length, uint8_t * data);
+	static boolean canAcknowledge(Connection * connection);
+	static void acknowledge(Connection * connection);
+	static void sendPendingAcknowledgements();
+	static int writeMessagev(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, const adb_segment * segments);
+	static int queueWritev(Connection * connection, uint8_t count, const adb_segment * segments);
+	static uint16_t transmitReady(Connection * connection, boolean force);
+	static Connection * nextTransmit();
+	static int sendQueued(Connection * connection, boolean force);
+	static void flushTransmitQueues();
+	static void drainIsrQueues();
+	static void handleConnect(adb_message * message, uint16_t length, uint8_t * data);
+	static Connection * findConnection(uint32_t localID);
+	static void handleOpen(adb_message * message, uint16_t length, uint8_t * data);
+	static void handleAuth(adb_message * message, uint16_t length, uint8_t * data);
+	static void pollAuth(uint32_t start, uint16_t maxMicros);
+	static adb_service * createService(const char * name, boolean inFlash, adb_eventHandler * eventHandler);
+	static void dispatchMessage();
+	static uint8_t receiveStep();
+	static void pollHandshake();
+	static void resetHandshake();
 	static boolean isAdbInterface(usb_interfaceDescriptor * interface);
 
 public:
 	static void init();
 	static void poll();
+	static void poll(uint8_t maxMessages, uint16_t maxMicros);
 
 	static void setEventHandler(adb_eventHandler * handler);
+	static void setAuthKey(const uint8_t * key, uint8_t storage, PGM_P publicKey);
+	static adb_service * addService(const char * name, adb_eventHandler * eventHandler);
+	static adb_service * addService_P(PGM_P name, adb_eventHandler * eventHandler);
+	static boolean setEventQueue(uint8_t size, uint16_t dataSize);
+	static uint8_t dispatchEvents();
+	static uint16_t getEventOverflow();
+	static boolean select(adb_readySet * ready);
+	static Connection * getConnection(uint8_t index);
 	static Connection * addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
+	static Connection * addConnection_P(PGM_P connectionString, boolean reconnect, adb_eventHandler * eventHandler);
+	static Connection * addLocalConnection(const char * name, adb_socketNamespace space, boolean reconnect, adb_eventHandler * eventHandler);
+#if defined(ARDUINO) && ARDUINO >= 100
+	static Connection * addConnection(const __FlashStringHelper * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
+#endif
 	static int write(Connection * connection, uint16_t length, uint8_t * data);
+	static int writev(Connection * connection, uint8_t count, const adb_segment * segments);
 	static int writeString(Connection * connection, char * str);
+	static boolean setReceiveBuffer(Connection * connection, uint16_t size);
+	static boolean setTransmitBuffer(Connection * connection, uint16_t size);
+	static int availableForWrite(Connection * connection);
+	static void setCoalescing(Connection * connection, boolean enable, uint16_t latency);
+	static void flush(Connection * connection);
+	static void setPriority(Connection * connection, adb_priority priority, uint8_t weight);
+	static void setTransmitWindow(uint8_t writes);
+	static void setChunkSize(Connection * connection, uint16_t size);
+	static void setRateLimit(Connection * connection, uint16_t rate, uint16_t burst);
+	static boolean setIsrBuffer(Connection * connection, uint16_t size);
+	static boolean isrWrite(Connection * connection, uint8_t length, const uint8_t * data);
+	static uint16_t getIsrOverflow(Connection * connection);
+	static void retryConnection(Connection * connection);
+	static void close(Connection * connection);
+	static void setAckPolicy(Connection * connection, adb_ackPolicy policy);
+	static void setWatermarks(Connection * connection, uint16_t low, uint16_t high);
+	static void addCredits(Connection * connection, uint8_t count);
+
+	static uint16_t getMaxPayload();
 
 	static boolean isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle);
 	static void initUsb(usb_device * device, adb_usbConfiguration * handle);
+	static void releaseUsb();
 	static void closeAll();
 };
 
@@ -0,0 +1,268 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbBridge.h>
+
+/**
+ * Creates a bridge. Call begin() before use.
+ */
+AdbBridge::AdbBridge()
+{
+	this->connection = NULL;
+	this->serial = NULL;
+	this->batch = NULL;
+	this->batchSize = 0;
+	this->batchLength = 0;
+	this->batchThreshold = ADB_BRIDGE_BATCH_SIZE;
+	this->batchLatency = ADB_BRIDGE_BATCH_LATENCY;
+	this->batchStart = 0;
+	this->rtsPin = ADB_BRIDGE_NO_PIN;
+	this->ctsPin = ADB_BRIDGE_NO_PIN;
+	this->rtsRaised = false;
+	this->rtsMargin = ADB_BRIDGE_RTS_MARGIN;
+	this->resetStatistics();
+}
+
+/**
+ * Opens the serial port and sets up the buffers.
+ *
+ * @param connection ADB stream to bridge to. It gets a receive buffer of bufferSize bytes, with deferred
+ * acknowledgement. It needs no transmit queue; batches are written straight from the batch buffer.
+ * @param serial serial port to bridge, e.g. &Serial1.
+ * @param baud baud rate.
+ * @param bufferSize size of the batch buffer and of the receive buffer, in bytes.
+ * @return true on success, false if out of memory.
+ */
+boolean AdbBridge::begin(Connection * connection, HardwareSerial * serial, uint32_t baud, uint16_t bufferSize)
+{
+	this->batch = (uint8_t*)malloc(bufferSize);
+	if (this->batch == NULL) return false;
+
+	if (!connection->setReceiveBuffer(bufferSize))
+	{
+		free(this->batch);
+		this->batch = NULL;
+		return false;
+	}
+
+	// Acknowledge a write once the UART has taken at least half the buffer.
+	connection->setAckPolicy(ADB_ACK_DEFERRED);
+	connection->setWatermarks(bufferSize / 2, 0);
+
+	this->connection = connection;
+	this->serial = serial;
+	this->batchSize = bufferSize;
+	this->batchLength = 0;
+	this->rtsMargin = bufferSize / 4 < ADB_BRIDGE_RTS_MARGIN ? bufferSize / 4 : ADB_BRIDGE_RTS_MARGIN;
+	this->resetStatistics();
+
+	serial->begin(baud);
+
+	return true;
+}
+
+/**
+ * Sets when batched serial data is sent.
+ *
+ * @param size number of bytes after which a batch is sent. Use 1 to send whatever is there on each poll.
+ * @param latency time in microseconds after which a batch is sent, even if it is smaller.
+ */
+void AdbBridge::setBatching(uint16_t size, uint16_t latency)
+{
+	this->batchThreshold = size > 0 ? size : 1;
+	this->batchLatency = latency;
+}
+
+/**
+ * Enables hardware flow control.
+ *
+ * @param rtsPin output that is low while the bridge can take more serial data, or ADB_BRIDGE_NO_PIN.
+ * @param ctsPin input that the device holds low while it can take more data, or ADB_BRIDGE_NO_PIN.
+ */
+void AdbBridge::setFlowControl(uint8_t rtsPin, uint8_t ctsPin)
+{
+	this->rtsPin = rtsPin;
+	this->ctsPin = ctsPin;
+
+	if (rtsPin != ADB_BRIDGE_NO_PIN)
+	{
+		pinMode(rtsPin, OUTPUT);
+		this->setRts(true);
+	}
+
+	if (ctsPin != ADB_BRIDGE_NO_PIN)
+		pinMode(ctsPin, INPUT);
+}
+
+void AdbBridge::setRts(boolean raised)
+{
+	this->rtsRaised = raised;
+	if (this->rtsPin != ADB_BRIDGE_NO_PIN)
+		digitalWrite(this->rtsPin, raised ? LOW : HIGH);
+}
+
+/**
+ * Moves data in both directions. Call this from loop(), along with ADB::poll().
+ */
+void AdbBridge::poll()
+{
+	if (this->batch == NULL) return;
+
+	this->receiveSerial();
+	this->sendBatch();
+	this->updateRts();
+	this->transmitSerial();
+}
+
+/**
+ * Moves received serial data into the batch buffer.
+ */
+void AdbBridge::receiveSerial()
+{
+	int value;
+
+	while (this->batchLength < this->batchSize && (value = this->serial->read()) >= 0)
+	{
+		if (this->batchLength == 0)
+			this->batchStart = micros();
+		this->batch[this->batchLength++] = value;
+	}
+}
+
+/**
+ * Drops RTS when the batch buffer is nearly full, and raises it again once a write has made room.
+ */
+void AdbBridge::updateRts()
+{
+	uint16_t space = this->batchSize - this->batchLength;
+
+	if (this->rtsRaised && space < this->rtsMargin)
+		this->setRts(false);
+	else if (!this->rtsRaised && space >= 2 * this->rtsMargin)
+		this->setRts(true);
+}
+
+/**
+ * Sends the batch buffer as a single write if it is large or old enough and the connection is ready.
+ * Data is kept while the stream is closed, and flow control holds off the device in the meantime.
+ */
+void AdbBridge::sendBatch()
+{
+	uint32_t now, latency;
+	uint16_t count;
+
+	if (this->batchLength == 0 || this->connection->status != ADB_OPEN) return;
+
+	now = micros();
+	latency = now - this->batchStart;
+	if (this->batchLength < this->batchThreshold && latency < this->batchLatency) return;
+
+	count = this->batchLength < ADB::getMaxPayload() ? this->batchLength : ADB::getMaxPayload();
+	if (this->connection->write(count, this->batch)) return;
+
+	this->bytesToAdb += count;
+	this->writes++;
+	this->totalLatency += latency;
+	if (latency > this->maxLatency) this->maxLatency = latency;
+
+	// Keep what didn't fit in a single write for the next one.
+	this->batchLength -= count;
+	if (this->batchLength > 0)
+	{
+		memmove(this->batch, this->batch + count, this->batchLength);
+		this->batchStart = now;
+	}
+}
+
+/**
+ * Passes data received from ADB to the UART, unless the device holds CTS high.
+ */
+void AdbBridge::transmitSerial()
+{
+	uint8_t buffer[ADB_BRIDGE_UART_CHUNK];
+	uint16_t count;
+
+	if (this->ctsPin != ADB_BRIDGE_NO_PIN && digitalRead(this->ctsPin) == HIGH) return;
+
+	count = this->connection->readBytes(buffer, ADB_BRIDGE_UART_CHUNK);
+	if (count == 0) return;
+
+	this->serial->write(buffer, count);
+	this->bytesToSerial += count;
+}
+
+/**
+ * @return the number of bytes passed from the serial port to ADB.
+ */
+uint32_t AdbBridge::getBytesToAdb()
+{
+	return this->bytesToAdb;
+}
+
+/**
+ * @return the number of bytes passed from ADB to the serial port.
+ */
+uint32_t AdbBridge::getBytesToSerial()
+{
+	return this->bytesToSerial;
+}
+
+/**
+ * @return the number of writes sent to ADB. getBytesToAdb() / getWrites() is the average batch size.
+ */
+uint32_t AdbBridge::getWrites()
+{
+	return this->writes;
+}
+
+/**
+ * @return the average time in microseconds that serial data waited in the batch buffer before it was
+ * sent.
+ */
+uint32_t AdbBridge::getAverageLatency()
+{
+	return this->writes > 0 ? this->totalLatency / this->writes : 0;
+}
+
+/**
+ * @return the longest time in microseconds that serial data waited in the batch buffer.
+ */
+uint32_t AdbBridge::getMaxLatency()
+{
+	return this->maxLatency;
+}
+
+/**
+ * @return the time in milliseconds since the statistics were reset, for computing throughput.
+ */
+uint32_t AdbBridge::getElapsed()
+{
+	return millis() - this->statisticsStart;
+}
+
+/**
+ * Clears the byte counts and latencies.
+ */
+void AdbBridge::resetStatistics()
+{
+	this->bytesToAdb = 0;
+	this->bytesToSerial = 0;
+	this->writes = 0;
+	this->totalLatency = 0;
+	this->maxLatency = 0;
+	this->statisticsStart = millis();
+}
@@ -0,0 +1,118 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbbridge_h__
+#define __adbbridge_h__
+
+#include <Adb.h>
+#include <HardwareSerial.h>
+
+// Pin number for unused flow control lines.
+#define ADB_BRIDGE_NO_PIN 0xff
+
+// Defaults for batching serial data into writes: send once this many bytes are waiting, or once the
+// oldest byte has waited this many microseconds.
+#define ADB_BRIDGE_BATCH_SIZE 64
+#define ADB_BRIDGE_BATCH_LATENCY 2000
+
+// RTS is dropped when less than this much batch space is left, which covers the bytes that arrive before
+// the other side reacts, and raised again at twice this much. Buffers under four times this size use a
+// quarter of the buffer instead.
+#define ADB_BRIDGE_RTS_MARGIN 32
+
+// Maximum number of bytes passed to the UART per poll, which bounds the time spent waiting for its
+// transmit buffer.
+#define ADB_BRIDGE_UART_CHUNK 16
+
+/**
+ * Transparent bridge between a hardware serial port and an ADB stream, for devices that only speak
+ * serial. The serial port's interrupt-driven ring buffers take the data off the wire; poll() moves it
+ * between those and the ADB stream.
+ *
+ * Serial to ADB: received bytes are collected in a batch buffer, which is sent as a single WRTE once it
+ * holds the batch size, or once its oldest byte has waited the batch latency, so that a byte at a time
+ * doesn't turn into a message at a time. While the previous write has not been acknowledged the batch
+ * keeps growing, and when it is nearly full RTS is dropped so the device stops sending.
+ *
+ * ADB to serial: the connection gets a receive buffer with deferred acknowledgement, so the phone can't
+ * send the next write until the UART has drained the buffer to half. A write larger than the free space
+ * is read from USB as the buffer drains, so the buffer may be smaller than the maximum payload, at the
+ * cost of holding up other ADB traffic meanwhile. While the device holds CTS high nothing is passed to
+ * the UART, so its backpressure reaches the phone.
+ *
+ * Flow control lines are active low, as on common USB-serial adapters. At high baud rates use flow
+ * control and keep ADB::poll short with its time limit, since the serial port's receive buffer only
+ * covers well under a millisecond. Throughput at rates like 1 Mbaud has not been measured; use the
+ * statistics to check what a given board and phone achieve.
+ *
+ *   AdbBridge bridge;
+ *
+ *   bridge.begin(connection, &Serial1, 1000000, 512);
+ *   bridge.setFlowControl(8, 9);
+ *   ...
+ *   bridge.poll();
+ *   ADB::poll(1, 300);
+ */
+class AdbBridge
+{
+private:
+	Connection * connection;
+	HardwareSerial * serial;
+
+	// Serial data waiting to be sent.
+	uint8_t * batch;
+	uint16_t batchSize;
+	uint16_t batchLength;
+	uint16_t batchThreshold;
+	uint16_t batchLatency;
+	uint32_t batchStart;
+
+	uint8_t rtsPin, ctsPin;
+	boolean rtsRaised;
+	uint16_t rtsMargin;
+
+	// Statistics.
+	uint32_t bytesToAdb;
+	uint32_t bytesToSerial;
+	uint32_t writes;
+	uint32_t totalLatency;
+	uint32_t maxLatency;
+	uint32_t statisticsStart;
+
+	void receiveSerial();
+	void sendBatch();
+	void updateRts();
+	void transmitSerial();
+	void setRts(boolean raised);
+
+public:
+	AdbBridge();
+
+	boolean begin(Connection * connection, HardwareSerial * serial, uint32_t baud, uint16_t bufferSize);
+	void setBatching(uint16_t size, uint16_t latency);
+	void setFlowControl(uint8_t rtsPin, uint8_t ctsPin);
+	void poll();
+
+	uint32_t getBytesToAdb();
+	uint32_t getBytesToSerial();
+	uint32_t getWrites();
+	uint32_t getAverageLatency();
+	uint32_t getMaxLatency();
+	uint32_t getElapsed();
+	void resetStatistics();
+};
+
+#endif
@@ -0,0 +1,399 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbFile.h>
+
+/**
+ * Creates a file. Call begin() before use.
+ */
+AdbFile::AdbFile()
+{
+	this->path = NULL;
+	this->fileSize = 0;
+	this->timeout = ADB_FILE_TIMEOUT;
+	this->cache = NULL;
+	this->blockSize = 0;
+	this->blockCount = 0;
+	this->tags = NULL;
+	this->stamps = NULL;
+	this->clock = 0;
+	this->streaming = false;
+	this->streamOffset = 0;
+	this->fillSlot = -1;
+	this->lastBlock = ADB_FILE_NO_BLOCK;
+	this->readAhead = 1;
+	this->hits = 0;
+	this->misses = 0;
+}
+
+/**
+ * Sets up the block cache and opens a sync stream to the device.
+ *
+ * @param blocks number of cache slots.
+ * @param blockSize size of a cache block in bytes.
+ * @param memory blocks * blockSize bytes of memory for the cache, for instance in external RAM, or NULL to
+ * allocate it from the heap.
+ * @return true on success, false if out of memory.
+ */
+boolean AdbFile::begin(uint8_t blocks, uint16_t blockSize, uint8_t * memory)
+{
+	uint8_t i;
+
+	this->cache = memory != NULL ? memory : (uint8_t*)malloc((uint32_t)blocks * blockSize);
+	this->tags = (uint32_t*)malloc(blocks * sizeof(uint32_t));
+	this->stamps = (uint32_t*)malloc(blocks * sizeof(uint32_t));
+	if (this->cache == NULL || this->tags == NULL || this->stamps == NULL) return false;
+
+	this->blockCount = blocks;
+	this->blockSize = blockSize;
+	for (i = 0; i < blocks; i++)
+		this->tags[i] = ADB_FILE_NO_BLOCK;
+
+	// The stream only moves forward when we grant credits, so it can be paused between reads.
+	if (!this->sync.begin(0)) return false;
+	this->sync.getConnection()->setAckPolicy(ADB_ACK_CREDIT);
+
+	return true;
+}
+
+/**
+ * Waits for the sync stream to be opened.
+ *
+ * @param start time at which the current operation started.
+ * @return true if the stream is open, false on timeout.
+ */
+boolean AdbFile::waitOpen(uint32_t start)
+{
+	while (!this->sync.getConnection()->isOpen())
+	{
+		if (millis() - start > this->timeout) return false;
+		ADB::poll();
+	}
+
+	return true;
+}
+
+/**
+ * Opens a file on the device and retrieves its size. Blocks until the device has replied.
+ *
+ * @param path remote path.
+ * @return 0 on success, or a negative value if the file does not exist or the device could not be reached.
+ */
+int AdbFile::open(const char * path)
+{
+	Connection * connection = this->sync.getConnection();
+	uint32_t start = millis();
+
+	this->close();
+
+	this->path = strdup(path);
+	if (this->path == NULL) return -1;
+
+	if (!this->waitOpen(start) || this->sync.stat(path)) return -1;
+
+	while (this->sync.isBusy())
+	{
+		if (millis() - start > this->timeout)
+		{
+			this->sync.abort();
+			return -1;
+		}
+
+		if (connection->credits == 0) connection->addCredits(1);
+		ADB::poll();
+	}
+
+	if (this->sync.getResult() != ADB_SYNC_SUCCESS || this->sync.getMode() == 0) return -1;
+
+	this->fileSize = this->sync.getSize();
+
+	return 0;
+}
+
+/**
+ * Stops the transfer in progress. Credits granted to it are taken back, so that they don't let the next
+ * transfer run ahead of the reads.
+ */
+void AdbFile::stopStream()
+{
+	if (this->streaming || this->sync.isBusy())
+		this->sync.abort();
+	this->streaming = false;
+	this->fillSlot = -1;
+	if (this->sync.getConnection() != NULL)
+		this->sync.getConnection()->credits = 0;
+}
+
+/**
+ * Closes the file, stops the transfer in progress, and empties the cache.
+ */
+void AdbFile::close()
+{
+	uint8_t i;
+
+	this->stopStream();
+
+	free(this->path);
+	this->path = NULL;
+	this->fileSize = 0;
+	this->lastBlock = ADB_FILE_NO_BLOCK;
+
+	for (i = 0; i < this->blockCount; i++)
+		this->tags[i] = ADB_FILE_NO_BLOCK;
+}
+
+/**
+ * @return the size of the file in bytes.
+ */
+uint32_t AdbFile::size()
+{
+	return this->fileSize;
+}
+
+/**
+ * Finds the cache slot holding a block.
+ *
+ * @param block block number.
+ * @return slot index, or -1 if the block is not cached.
+ */
+int16_t AdbFile::findSlot(uint32_t block)
+{
+	uint8_t i;
+
+	for (i = 0; i < this->blockCount; i++)
+		if (this->tags[i] == block) return i;
+
+	return -1;
+}
+
+/**
+ * Picks a cache slot for a new block and empties it: an empty slot if there is one, or else the least
+ * recently used one. Blocks that are wanted by the current fetch are never evicted.
+ *
+ * @param ahead true for a block that streams past beyond the wanted ones. It must not push out the
+ * blocks that streamed past before it, which will be read sooner, so only slots holding blocks before
+ * the wanted ones are used.
+ * @return slot index, or -1 if there is no slot to spare.
+ */
+int16_t AdbFile::evictSlot(boolean ahead)
+{
+	uint8_t i;
+	int16_t slot = -1;
+
+	for (i = 0; i < this->blockCount; i++)
+	{
+		if (this->tags[i] == ADB_FILE_NO_BLOCK) return i;
+		if (this->tags[i] >= this->wantFirst && this->tags[i] <= this->wantLast) continue;
+		if (ahead && this->tags[i] > this->wantLast) continue;
+
+		if (slot < 0 || (int32_t)(this->stamps[i] - this->stamps[slot]) < 0)
+			slot = i;
+	}
+
+	if (slot >= 0)
+		this->tags[slot] = ADB_FILE_NO_BLOCK;
+
+	return slot;
+}
+
+/**
+ * Sync writer that stores the blocks that are wanted as they stream past. A write from the device can hold
+ * many more blocks than that, and blocks after the wanted ones are kept as well, as long as there are
+ * slots to spare, so that sequential reads find them instead of restarting the transfer. Blocks before the
+ * wanted ones are skipped.
+ */
+int AdbFile::receive(void * context, const uint8_t * data, uint16_t length)
+{
+	AdbFile * file = (AdbFile*)context;
+	uint32_t block;
+	uint16_t position, count;
+
+	while (length > 0)
+	{
+		block = file->streamOffset / file->blockSize;
+		position = file->streamOffset % file->blockSize;
+		count = file->blockSize - position < length ? file->blockSize - position : length;
+
+		// Start storing a block that isn't cached yet.
+		if (position == 0 && block >= file->wantFirst && file->findSlot(block) < 0)
+			file->fillSlot = file->evictSlot(block > file->wantLast);
+
+		if (file->fillSlot >= 0)
+		{
+			memcpy(file->cache + (uint32_t)file->fillSlot * file->blockSize + position, data, count);
+
+			// The block is complete at the end of the block or the end of the file.
+			if (position + count == file->blockSize || file->streamOffset + count == file->fileSize)
+			{
+				file->tags[file->fillSlot] = block;
+				file->stamps[file->fillSlot] = file->clock;
+				file->fillSlot = -1;
+			}
+		}
+
+		file->streamOffset += count;
+		data += count;
+		length -= count;
+	}
+
+	return 0;
+}
+
+/**
+ * Fetches a block from the device into the cache. Continues the current transfer if it hasn't passed the
+ * block yet, and restarts it otherwise. On sequential access, the read-ahead blocks are fetched as well.
+ *
+ * @param block block number.
+ * @return 0 on success, or -1 on failure.
+ */
+int AdbFile::fetch(uint32_t block)
+{
+	Connection * connection = this->sync.getConnection();
+	uint32_t start = millis();
+	boolean sequential = block == this->lastBlock + 1;
+	boolean filling = this->fillSlot >= 0 && block == this->streamOffset / this->blockSize;
+
+	// Restart the transfer if it has already passed the block, which isn't cached, unless the block is
+	// still coming in.
+	if (!this->streaming || (this->streamOffset > block * this->blockSize && !filling))
+	{
+		this->stopStream();
+
+		if (!this->waitOpen(start)) return -1;
+
+		this->streamOffset = 0;
+		if (this->sync.pull(this->path, AdbFile::receive, this)) return -1;
+		this->streaming = true;
+	}
+
+	this->wantFirst = block;
+	this->wantLast = block + (sequential ? this->readAhead : 0);
+	if (this->wantLast - this->wantFirst >= this->blockCount)
+		this->wantLast = this->wantFirst + this->blockCount - 1;
+
+	while (this->findSlot(block) < 0 || (sequential && this->wantLast * this->blockSize < this->fileSize && this->findSlot(this->wantLast) < 0))
+	{
+		// The transfer has ended.
+		if (!this->sync.isBusy())
+		{
+			this->streaming = false;
+			return this->findSlot(block) < 0 ? -1 : 0;
+		}
+
+		if (millis() - start > this->timeout) return -1;
+
+		// Let the next write through.
+		if (connection->credits == 0) connection->addCredits(1);
+		ADB::poll();
+	}
+
+	return 0;
+}
+
+/**
+ * Reads from the file. Cached blocks are served from the cache; others are fetched from the device, which
+ * blocks until the data has arrived or the timeout has passed.
+ *
+ * @param offset offset in the file.
+ * @param buffer target buffer.
+ * @param length number of bytes to read.
+ * @return number of bytes read, which is less than length at the end of the file, or -1 on failure.
+ */
+int AdbFile::read(uint32_t offset, uint8_t * buffer, uint16_t length)
+{
+	uint32_t block;
+	uint16_t position, count, total = 0;
+	int16_t slot;
+
+	if (this->path == NULL) return -1;
+
+	if (offset >= this->fileSize) return 0;
+	if (length > this->fileSize - offset) length = this->fileSize - offset;
+
+	while (total < length)
+	{
+		block = offset / this->blockSize;
+		position = offset % this->blockSize;
+		count = this->blockSize - position < length - total ? this->blockSize - position : length - total;
+
+		slot = this->findSlot(block);
+		if (slot >= 0)
+			this->hits++;
+		else
+		{
+			this->misses++;
+			if (this->fetch(block)) return -1;
+			slot = this->findSlot(block);
+		}
+
+		this->stamps[slot] = ++this->clock;
+		this->lastBlock = block;
+
+		memcpy(buffer + total, this->cache + (uint32_t)slot * this->blockSize + position, count);
+
+		offset += count;
+		total += count;
+	}
+
+	return total;
+}
+
+/**
+ * Sets the number of blocks that are fetched ahead of a sequential read. Limited by the number of cache
+ * slots.
+ *
+ * @param blocks number of blocks.
+ */
+void AdbFile::setReadAhead(uint8_t blocks)
+{
+	this->readAhead = blocks;
+}
+
+/**
+ * Sets the time a read may take before it fails.
+ *
+ * @param timeout timeout in milliseconds.
+ */
+void AdbFile::setTimeout(uint16_t timeout)
+{
+	this->timeout = timeout;
+}
+
+/**
+ * @return the number of block accesses served from the cache.
+ */
+uint32_t AdbFile::getHits()
+{
+	return this->hits;
+}
+
+/**
+ * @return the number of block accesses that had to be fetched from the device.
+ */
+uint32_t AdbFile::getMisses()
+{
+	return this->misses;
+}
+
+/**
+ * Resets the hit and miss counters.
+ */
+void AdbFile::resetCounters()
+{
+	this->hits = 0;
+	this->misses = 0;
+}
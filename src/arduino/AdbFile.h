@@ -0,0 +1,99 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbfile_h__
+#define __adbfile_h__
+
+#include <AdbSync.h>
+
+// Tag of an empty cache slot.
+#define ADB_FILE_NO_BLOCK 0xffffffff
+
+// Default time in milliseconds that a read may take before it fails.
+#define ADB_FILE_TIMEOUT 5000
+
+/**
+ * Read-only access to a file on the device, through a block cache. Blocks are fetched on demand with sync
+ * RECV requests and kept in a small LRU cache, so repeated reads of hot blocks never touch USB. RECV always
+ * streams a file from the start; the stream is paused between reads by withholding acknowledgements
+ * (ADB_ACK_CREDIT), so sequential reads continue where the previous one stopped, and only reads that go
+ * backwards to an uncached block restart the transfer. Sequential access triggers read-ahead of the
+ * following blocks, and blocks that stream past after those are kept as well, in free slots or in place
+ * of the least recently used blocks before the current read. A single write from the device holds up
+ * to 4096 bytes; with a smaller cache the rest of a write is dropped, and a sequential read restarts the
+ * transfer once it gets there, so for long sequential reads give the cache a few blocks more than that.
+ *
+ * Reads block until the data is available, calling ADB::poll in the meantime. They must not be made from
+ * ADB event handlers.
+ *
+ *   AdbFile table;
+ *
+ *   table.begin(4, 128, NULL);
+ *   table.open("/sdcard/table.bin");
+ *   table.read(offset, buffer, length);
+ */
+class AdbFile
+{
+private:
+	AdbSync sync;
+	char * path;
+	uint32_t fileSize;
+	uint16_t timeout;
+
+	// Cache slots, with the number of the block each holds and when it was last used.
+	uint8_t * cache;
+	uint16_t blockSize;
+	uint8_t blockCount;
+	uint32_t * tags;
+	uint32_t * stamps;
+	uint32_t clock;
+
+	// Receive stream state. Blocks between wantFirst and wantLast are stored as they stream past.
+	boolean streaming;
+	uint32_t streamOffset;
+	uint32_t wantFirst, wantLast;
+	int16_t fillSlot;
+	uint32_t lastBlock;
+	uint8_t readAhead;
+
+	uint32_t hits, misses;
+
+	static int receive(void * context, const uint8_t * data, uint16_t length);
+	int16_t findSlot(uint32_t block);
+	int16_t evictSlot(boolean ahead);
+	void stopStream();
+	boolean waitOpen(uint32_t start);
+	int fetch(uint32_t block);
+
+public:
+	AdbFile();
+
+	boolean begin(uint8_t blocks, uint16_t blockSize, uint8_t * memory);
+	int open(const char * path);
+	void close();
+
+	int read(uint32_t offset, uint8_t * buffer, uint16_t length);
+	uint32_t size();
+
+	void setReadAhead(uint8_t blocks);
+	void setTimeout(uint16_t timeout);
+
+	uint32_t getHits();
+	uint32_t getMisses();
+	void resetCounters();
+};
+
+#endif
@@ -0,0 +1,309 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbMux.h>
+
+/**
+ * Creates a multiplexer. Call begin() before use.
+ */
+AdbMux::AdbMux()
+{
+	this->connection = NULL;
+	this->channels = NULL;
+	this->channelCount = 0;
+	this->headerLength = 0;
+	this->payloadLeft = 0;
+	this->creditLength = 0;
+}
+
+/**
+ * Allocates the channel table and opens a persistent stream to the device. Frames are queued in the
+ * transmit buffer of the stream and coalesced into as few WRTE messages as possible.
+ *
+ * @param service connection string in program memory, for instance 'tcp:4567' or
+ * 'localabstract:microbridge'.
+ * @param channels number of channels, numbered from zero.
+ * @param bufferSize size of the transmit buffer in bytes.
+ * @return true on success, false if out of memory.
+ */
+boolean AdbMux::begin(PGM_P service, uint8_t channels, uint16_t bufferSize)
+{
+	this->channels = (adb_muxChannel*)malloc(channels * sizeof(adb_muxChannel));
+	if (this->channels == NULL) return false;
+	memset(this->channels, 0, channels * sizeof(adb_muxChannel));
+	this->channelCount = channels;
+
+	this->connection = ADB::addConnection_P(service, true, AdbMux::eventHandler);
+	if (this->connection == NULL) return false;
+	this->connection->userData = this;
+
+	if (!this->connection->setTransmitBuffer(bufferSize)) return false;
+	this->connection->setCoalescing(true, 0);
+
+	return true;
+}
+
+/**
+ * @return the ADB connection that carries the channels.
+ */
+Connection * AdbMux::getConnection()
+{
+	return this->connection;
+}
+
+/**
+ * Opens a channel for receiving. The receive window is granted to the peer as soon as the stream is open.
+ *
+ * @param channel channel number.
+ * @param window number of bytes the peer may send before it has to wait for more credits. Zero for a
+ * channel that is only written to.
+ * @param handler handler for received data.
+ * @param context passed to the handler.
+ * @return true on success, false if the channel number is out of range.
+ */
+boolean AdbMux::open(uint8_t channel, uint16_t window, adb_muxHandler * handler, void * context)
+{
+	adb_muxChannel * entry;
+
+	if (channel >= this->channelCount) return false;
+
+	entry = &this->channels[channel];
+	entry->handler = handler;
+	entry->context = context;
+	entry->rxWindow = window;
+
+	// Announce the window, now or when the stream opens.
+	entry->rxConsumed = window;
+	if (this->connection->isOpen())
+		this->flushCredits();
+
+	return true;
+}
+
+/**
+ * Event handler for the stream, passes events on to the multiplexer that owns the connection.
+ */
+void AdbMux::eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	AdbMux * mux = (AdbMux*)connection->userData;
+
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		mux->reset();
+		mux->flushCredits();
+		break;
+	case ADB_CONNECTION_RECEIVE:
+		mux->handleData(length, data);
+		mux->flushCredits();
+		break;
+	case ADB_CONNECTION_WRITE_COMPLETE:
+		// Retry grants that didn't fit in the transmit queue.
+		mux->flushCredits();
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Starts afresh on a new stream: no credits to send with, and the full receive windows to announce.
+ */
+void AdbMux::reset()
+{
+	uint8_t i;
+
+	this->headerLength = 0;
+	this->payloadLeft = 0;
+	this->creditLength = 0;
+
+	for (i = 0; i < this->channelCount; i++)
+	{
+		this->channels[i].txCredits = 0;
+		this->channels[i].rxConsumed = this->channels[i].rxWindow;
+	}
+}
+
+/**
+ * Queues a frame.
+ *
+ * @return 0 on success, or a negative value if it doesn't fit in the transmit queue.
+ */
+int AdbMux::sendFrame(uint8_t channel, uint8_t type, uint16_t length, const uint8_t * data)
+{
+	uint8_t header[ADB_MUX_HEADER_SIZE];
+	adb_segment segments[2];
+
+	header[0] = channel;
+	header[1] = type;
+	header[2] = length & 0xff;
+	header[3] = length >> 8;
+
+	segments[0].data = header;
+	segments[0].length = ADB_MUX_HEADER_SIZE;
+	segments[0].progmem = false;
+	segments[1].data = data;
+	segments[1].length = length;
+	segments[1].progmem = false;
+
+	return this->connection->writev(2, segments);
+}
+
+/**
+ * Grants the bytes consumed on each channel back to the peer, once they add up to half of the window.
+ * Grants that don't fit in the transmit queue are retried later.
+ */
+void AdbMux::flushCredits()
+{
+	adb_muxChannel * entry;
+	uint8_t i, credit[2];
+
+	if (!this->connection->isOpen() && this->connection->status != ADB_WRITING) return;
+
+	for (i = 0; i < this->channelCount; i++)
+	{
+		entry = &this->channels[i];
+		if (entry->rxConsumed == 0 || entry->rxConsumed < entry->rxWindow / 2) continue;
+
+		credit[0] = entry->rxConsumed & 0xff;
+		credit[1] = entry->rxConsumed >> 8;
+		if (this->sendFrame(i, ADB_MUX_CREDIT, 2, credit)) return;
+
+		entry->rxConsumed = 0;
+	}
+}
+
+/**
+ * Sends data on a channel. The data is sent as a single frame, so it must fit within the credits of the
+ * channel and within the maximum payload size of the stream.
+ *
+ * @param channel channel number.
+ * @param length number of bytes to send.
+ * @param data data to send.
+ * @return 0 on success, ADB_MUX_NOT_CONNECTED if the stream is not open, ADB_MUX_NO_CREDIT if the peer
+ * hasn't granted enough credits, ADB_MUX_QUEUE_FULL if the transmit queue is full, or
+ * ADB_MUX_INVALID_CHANNEL.
+ */
+int AdbMux::write(uint8_t channel, uint16_t length, const uint8_t * data)
+{
+	adb_muxChannel * entry;
+
+	if (channel >= this->channelCount) return ADB_MUX_INVALID_CHANNEL;
+	if (!this->connection->isOpen() && this->connection->status != ADB_WRITING) return ADB_MUX_NOT_CONNECTED;
+
+	entry = &this->channels[channel];
+	if (length > entry->txCredits) return ADB_MUX_NO_CREDIT;
+
+	if (this->sendFrame(channel, ADB_MUX_DATA, length, data)) return ADB_MUX_QUEUE_FULL;
+	entry->txCredits -= length;
+
+	return 0;
+}
+
+/**
+ * @param channel channel number.
+ * @return the number of bytes that may currently be sent on the channel.
+ */
+uint16_t AdbMux::getCredits(uint8_t channel)
+{
+	return channel < this->channelCount ? this->channels[channel].txCredits : 0;
+}
+
+/**
+ * Handles (a piece of) the payload of the current frame.
+ *
+ * @param length number of bytes.
+ * @param data payload bytes.
+ */
+void AdbMux::handlePayload(uint16_t length, uint8_t * data)
+{
+	adb_muxChannel * entry;
+	uint16_t credit;
+
+	// Frames for channels we don't know are dropped.
+	if (this->header[0] >= this->channelCount) return;
+	entry = &this->channels[this->header[0]];
+
+	if (this->header[1] == ADB_MUX_DATA)
+	{
+		if (length > 0 && entry->handler != NULL)
+			entry->handler(entry->context, this->header[0], length, data);
+		entry->rxConsumed += length;
+	} else if (this->header[1] == ADB_MUX_CREDIT)
+	{
+		while (length > 0 && this->creditLength < 2)
+		{
+			this->credit[this->creditLength++] = *data++;
+			length--;
+		}
+
+		if (this->creditLength == 2 && this->payloadLeft == 0)
+		{
+			credit = this->credit[0] | (this->credit[1] << 8);
+			entry->txCredits = credit > 0xffff - entry->txCredits ? 0xffff : entry->txCredits + credit;
+
+			if (entry->handler != NULL)
+				entry->handler(entry->context, this->header[0], 0, NULL);
+		}
+	}
+}
+
+/**
+ * Parses frames received from the peer. Frames can be split over any number of WRTE messages, and data is
+ * passed to the channel handlers as it comes in, without buffering.
+ *
+ * @param length number of bytes received.
+ * @param data received data.
+ */
+void AdbMux::handleData(uint16_t length, uint8_t * data)
+{
+	uint16_t count;
+
+	while (length > 0)
+	{
+		if (this->headerLength < ADB_MUX_HEADER_SIZE)
+		{
+			this->header[this->headerLength++] = *data++;
+			length--;
+
+			if (this->headerLength == ADB_MUX_HEADER_SIZE)
+			{
+				this->payloadLeft = this->header[2] | (this->header[3] << 8);
+				this->creditLength = 0;
+
+				// Empty frames are complete right away.
+				if (this->payloadLeft == 0)
+				{
+					this->handlePayload(0, data);
+					this->headerLength = 0;
+				}
+			}
+
+			continue;
+		}
+
+		count = length < this->payloadLeft ? length : this->payloadLeft;
+		this->payloadLeft -= count;
+		this->handlePayload(count, data);
+
+		data += count;
+		length -= count;
+
+		if (this->payloadLeft == 0)
+			this->headerLength = 0;
+	}
+}
@@ -0,0 +1,106 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbmux_h__
+#define __adbmux_h__
+
+#include <Adb.h>
+
+// Frame types. Every frame starts with a four-byte header: channel number, type, and payload length as a
+// little-endian word.
+#define ADB_MUX_DATA 0
+#define ADB_MUX_CREDIT 1
+
+#define ADB_MUX_HEADER_SIZE 4
+
+// Result codes of write.
+#define ADB_MUX_NOT_CONNECTED -1
+#define ADB_MUX_NO_CREDIT -2
+#define ADB_MUX_QUEUE_FULL -3
+#define ADB_MUX_INVALID_CHANNEL -4
+
+/**
+ * Handler for data received on a channel. A call without data means that the peer has granted more
+ * credits, so writes that failed with ADB_MUX_NO_CREDIT can be retried.
+ */
+typedef void(adb_muxHandler)(void * context, uint8_t channel, uint16_t length, uint8_t * data);
+
+typedef struct
+{
+	adb_muxHandler * handler;
+	void * context;
+
+	// Bytes we may still send on this channel.
+	uint16_t txCredits;
+
+	// Bytes the peer may send before we grant more, and bytes received since the last grant.
+	uint16_t rxWindow;
+	uint16_t rxConsumed;
+} adb_muxChannel;
+
+/**
+ * Carries many numbered channels over a single ADB stream, instead of opening a stream per channel. Each
+ * frame is prefixed with the channel number, a type, and its length. Flow control is per channel and
+ * credit based: a side may only send as many data bytes on a channel as the other side has granted, so a
+ * slow channel can't hold up the others. Received data is handed to the channel handler right away, and
+ * the bytes are granted back once half of the receive window has been used.
+ *
+ * Frames of all channels share the transmit queue of the stream, and small frames are coalesced into one
+ * WRTE, so a single OKAY acknowledges traffic of several channels. A channel costs ten bytes of SRAM.
+ *
+ * Both sides start with zero credits whenever the stream opens, and announce their receive windows.
+ * org.microbridge.server.Multiplexer is the Android counterpart.
+ *
+ *   AdbMux mux;
+ *
+ *   mux.begin(PSTR("tcp:4567"), 4, 256);
+ *   mux.open(0, 128, handleCommands, NULL);
+ *   ...
+ *   mux.write(1, sizeof(sample), (uint8_t*)&sample);
+ */
+class AdbMux
+{
+private:
+	Connection * connection;
+	adb_muxChannel * channels;
+	uint8_t channelCount;
+
+	// Frame parser.
+	uint8_t header[ADB_MUX_HEADER_SIZE];
+	uint8_t headerLength;
+	uint16_t payloadLeft;
+	uint8_t credit[2];
+	uint8_t creditLength;
+
+	static void eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
+	void handleData(uint16_t length, uint8_t * data);
+	void handlePayload(uint16_t length, uint8_t * data);
+	void reset();
+	int sendFrame(uint8_t channel, uint8_t type, uint16_t length, const uint8_t * data);
+	void flushCredits();
+
+public:
+	AdbMux();
+
+	boolean begin(PGM_P service, uint8_t channels, uint16_t bufferSize);
+	Connection * getConnection();
+
+	boolean open(uint8_t channel, uint16_t window, adb_muxHandler * handler, void * context);
+	int write(uint8_t channel, uint16_t length, const uint8_t * data);
+	uint16_t getCredits(uint8_t channel);
+};
+
+#endif
@@ -0,0 +1,543 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbRpc.h>
+
+/**
+ * Updates a CRC-16 (CCITT polynomial, reflected, as avr-libc's _crc_ccitt_update) with one byte.
+ */
+static uint16_t crcUpdate(uint16_t crc, uint8_t value)
+{
+	uint8_t i;
+
+	crc ^= value;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+
+	return crc;
+}
+
+/**
+ * @return the CRC-16 of a block of data.
+ */
+static uint16_t crc16(const uint8_t * data, uint16_t length)
+{
+	uint16_t crc = 0xffff;
+
+	while (length-- > 0)
+		crc = crcUpdate(crc, *data++);
+
+	return crc;
+}
+
+/**
+ * Creates a writer.
+ *
+ * @param buffer target buffer.
+ * @param size size of the buffer.
+ */
+RpcWriter::RpcWriter(uint8_t * buffer, uint16_t size)
+{
+	this->buffer = buffer;
+	this->size = size;
+	this->position = 0;
+	this->overflowed = false;
+}
+
+void RpcWriter::putByte(uint8_t value)
+{
+	if (this->position < this->size)
+		this->buffer[this->position++] = value;
+	else
+		this->overflowed = true;
+}
+
+/**
+ * Writes an unsigned value as a varint: seven bits per byte, least significant group first, with the top
+ * bit set on all bytes but the last.
+ */
+void RpcWriter::putVarint(uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		this->putByte(value | 0x80);
+		value >>= 7;
+	}
+	this->putByte(value);
+}
+
+/**
+ * Writes a signed value as a zigzag varint, which maps values of small magnitude to small codes: 0, -1, 1,
+ * -2, ... become 0, 1, 2, 3, ...
+ */
+void RpcWriter::putSigned(int32_t value)
+{
+	this->putVarint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+/**
+ * Writes a float as four bytes, in little-endian IEEE 754 format.
+ */
+void RpcWriter::putFloat(float value)
+{
+	uint8_t bytes[4];
+	uint8_t i;
+
+	memcpy(bytes, &value, 4);
+	for (i = 0; i < 4; i++)
+		this->putByte(bytes[i]);
+}
+
+/**
+ * Writes a block of bytes, prefixed with its length.
+ */
+void RpcWriter::putBytes(const uint8_t * data, uint16_t length)
+{
+	this->putVarint(length);
+	while (length-- > 0)
+		this->putByte(*data++);
+}
+
+/**
+ * @return the number of bytes written.
+ */
+uint16_t RpcWriter::length()
+{
+	return this->position;
+}
+
+/**
+ * @return true if a write didn't fit in the buffer.
+ */
+boolean RpcWriter::overflow()
+{
+	return this->overflowed;
+}
+
+/**
+ * Creates a reader.
+ *
+ * @param buffer source buffer.
+ * @param size number of bytes in the buffer.
+ */
+RpcReader::RpcReader(const uint8_t * buffer, uint16_t size)
+{
+	this->buffer = buffer;
+	this->size = size;
+	this->position = 0;
+	this->failed = false;
+}
+
+uint8_t RpcReader::getByte()
+{
+	if (this->position < this->size)
+		return this->buffer[this->position++];
+
+	this->failed = true;
+	return 0;
+}
+
+uint32_t RpcReader::getVarint()
+{
+	uint32_t value = 0;
+	uint8_t shift, c;
+
+	for (shift = 0; shift < 35; shift += 7)
+	{
+		c = this->getByte();
+		value |= (uint32_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) break;
+	}
+
+	return value;
+}
+
+int32_t RpcReader::getSigned()
+{
+	uint32_t value = this->getVarint();
+
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+float RpcReader::getFloat()
+{
+	uint8_t bytes[4];
+	uint8_t i;
+	float value;
+
+	for (i = 0; i < 4; i++)
+		bytes[i] = this->getByte();
+	memcpy(&value, bytes, 4);
+
+	return value;
+}
+
+/**
+ * Reads a block of bytes. Bytes that don't fit in the target are skipped.
+ *
+ * @param target target buffer.
+ * @param capacity size of the target buffer.
+ * @return number of bytes stored.
+ */
+uint16_t RpcReader::getBytes(uint8_t * target, uint16_t capacity)
+{
+	uint16_t length = this->getVarint();
+	uint16_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		if (i < capacity)
+			target[i] = this->getByte();
+		else
+			this->getByte();
+	}
+
+	return length < capacity ? length : capacity;
+}
+
+/**
+ * @return true if a read went past the end of the buffer.
+ */
+boolean RpcReader::error()
+{
+	return this->failed;
+}
+
+/**
+ * Creates an RPC endpoint. Call begin() before use.
+ */
+AdbRpc::AdbRpc()
+{
+	this->connection = NULL;
+	this->crc = false;
+	this->rxBuffer = NULL;
+	this->txBuffer = NULL;
+	this->frameSize = 0;
+	this->frameLength = 0;
+	this->received = 0;
+	this->lengthShift = 0;
+	this->lengthDone = false;
+	this->handlerCount = 0;
+	this->nextId = 1;
+	memset(this->pending, 0, sizeof(this->pending));
+}
+
+/**
+ * Allocates the frame buffers and opens a persistent stream to the device.
+ *
+ * @param service connection string in program memory, for instance 'tcp:4567' or
+ * 'localabstract:microbridge'.
+ * @param frameSize largest frame that can be sent or received. Larger incoming frames are dropped.
+ * @param bufferSize size of the transmit queue of the stream, which holds frames until the device has
+ * acknowledged the previous write.
+ * @return true on success, false if out of memory.
+ */
+boolean AdbRpc::begin(PGM_P service, uint16_t frameSize, uint16_t bufferSize)
+{
+	this->rxBuffer = (uint8_t*)malloc(frameSize);
+	this->txBuffer = (uint8_t*)malloc(ADB_RPC_PREFIX_SIZE + frameSize);
+	if (this->rxBuffer == NULL || this->txBuffer == NULL) return false;
+	this->frameSize = frameSize;
+
+	this->connection = ADB::addConnection_P(service, true, AdbRpc::eventHandler);
+	if (this->connection == NULL) return false;
+	this->connection->userData = this;
+
+	return this->connection->setTransmitBuffer(bufferSize);
+}
+
+/**
+ * @return the ADB connection used by this endpoint.
+ */
+Connection * AdbRpc::getConnection()
+{
+	return this->connection;
+}
+
+/**
+ * Enables or disables the CRC on outgoing frames. Incoming frames are checked if they carry one.
+ *
+ * @param enable true to append a CRC-16 to every frame.
+ */
+void AdbRpc::setCrc(boolean enable)
+{
+	this->crc = enable;
+}
+
+/**
+ * Registers a message or request handler.
+ *
+ * @return true on success, false if the handler table is full.
+ */
+boolean AdbRpc::addHandler(uint16_t method, adb_rpcInvoker * invoker, adb_rpcFunction handler)
+{
+	adb_rpcHandler * entry;
+	uint8_t i;
+
+	// Replace the existing handler for the method, if any.
+	for (i = 0; i < this->handlerCount; i++)
+		if (this->handlers[i].method == method) break;
+
+	if (i == ADB_RPC_MAX_HANDLERS) return false;
+	if (i == this->handlerCount) this->handlerCount++;
+
+	entry = &this->handlers[i];
+	entry->method = method;
+	entry->invoker = invoker;
+	entry->handler = handler;
+
+	return true;
+}
+
+/**
+ * Writes the start of a frame: kind, request id, and method id.
+ */
+void AdbRpc::startFrame(RpcWriter & writer, uint8_t kind, uint16_t id, uint16_t method)
+{
+	writer.putByte(kind | (this->crc ? ADB_RPC_FLAG_CRC : 0));
+	writer.putVarint(id);
+	writer.putVarint(method);
+}
+
+/**
+ * Completes a frame in the transmit buffer with its CRC and length prefix, and queues it.
+ *
+ * @return 0 on success, or a negative result code.
+ */
+int AdbRpc::sendFrame(RpcWriter & writer)
+{
+	uint8_t * frame = this->txBuffer + ADB_RPC_PREFIX_SIZE;
+	uint8_t * start;
+	uint16_t length, crc;
+
+	if (this->crc)
+	{
+		crc = crc16(frame, writer.length());
+		writer.putByte(crc & 0xff);
+		writer.putByte(crc >> 8);
+	}
+
+	if (writer.overflow()) return ADB_RPC_OVERFLOW;
+	if (!this->connection->isOpen() && this->connection->status != ADB_WRITING) return ADB_RPC_NOT_CONNECTED;
+
+	// Put the varint length right in front of the frame.
+	length = writer.length();
+	start = frame - (length < 0x80 ? 1 : length < 0x4000 ? 2 : 3);
+	RpcWriter prefix(start, frame - start);
+	prefix.putVarint(length);
+
+	if (this->connection->write(frame - start + length, start)) return ADB_RPC_QUEUE_FULL;
+
+	return 0;
+}
+
+/**
+ * Sends a request and registers the handler for its response.
+ *
+ * @return 0 on success, or a negative result code.
+ */
+int AdbRpc::sendCall(RpcWriter & writer, adb_rpcInvoker * invoker, adb_rpcFunction handler)
+{
+	adb_rpcPending * entry = NULL;
+	uint8_t i;
+	int ret;
+
+	for (i = 0; i < ADB_RPC_MAX_PENDING && entry == NULL; i++)
+		if (this->pending[i].invoker == NULL)
+			entry = &this->pending[i];
+
+	if (entry == NULL) return ADB_RPC_TOO_MANY;
+
+	ret = this->sendFrame(writer);
+	if (ret) return ret;
+
+	entry->id = this->nextId;
+	entry->invoker = invoker;
+	entry->handler = handler;
+
+	// Skip id zero, which marks one-way messages.
+	if (++this->nextId == 0) this->nextId = 1;
+
+	return 0;
+}
+
+/**
+ * Fails all calls that are waiting for a response.
+ */
+void AdbRpc::abortPending()
+{
+	adb_rpcInvoker * invoker;
+	uint8_t i;
+
+	for (i = 0; i < ADB_RPC_MAX_PENDING; i++)
+	{
+		invoker = this->pending[i].invoker;
+		if (invoker == NULL) continue;
+
+		this->pending[i].invoker = NULL;
+		invoker(this, NULL, this->pending[i].id, this->pending[i].handler);
+	}
+}
+
+/**
+ * Event handler for the stream, passes events on to the endpoint that owns the connection.
+ */
+void AdbRpc::eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	AdbRpc * rpc = (AdbRpc*)connection->userData;
+
+	switch (event)
+	{
+	case ADB_CONNECTION_RECEIVE:
+		rpc->handleData(length, data);
+		break;
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		// Start parsing afresh on the next stream.
+		rpc->frameLength = 0;
+		rpc->lengthShift = 0;
+		rpc->lengthDone = false;
+		rpc->abortPending();
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Reassembles frames from the stream. Frames can be split over any number of WRTE messages.
+ *
+ * @param length number of bytes received.
+ * @param data received data.
+ */
+void AdbRpc::handleData(uint16_t length, uint8_t * data)
+{
+	uint16_t count;
+
+	while (length > 0)
+	{
+		// Decode the length prefix.
+		if (!this->lengthDone)
+		{
+			// A length needs at most three bytes and 16 bits. Drop a longer prefix and start over at the
+			// next byte, since the stream is out of step anyway.
+			if (this->lengthShift == 7 * (ADB_RPC_PREFIX_SIZE - 1) && *data > 0x03)
+			{
+				this->frameLength = 0;
+				this->lengthShift = 0;
+
+				data++;
+				length--;
+				continue;
+			}
+
+			this->frameLength |= (uint16_t)(*data & 0x7f) << this->lengthShift;
+			this->lengthShift += 7;
+			this->lengthDone = (*data & 0x80) == 0;
+			this->received = 0;
+
+			data++;
+			length--;
+
+			// Ignore empty frames.
+			if (this->lengthDone && this->frameLength == 0)
+			{
+				this->lengthShift = 0;
+				this->lengthDone = false;
+			}
+
+			continue;
+		}
+
+		// Collect the frame. Frames that don't fit are skipped.
+		count = this->frameLength - this->received < length ? this->frameLength - this->received : length;
+		if (this->frameLength <= this->frameSize)
+			memcpy(this->rxBuffer + this->received, data, count);
+		this->received += count;
+		data += count;
+		length -= count;
+
+		if (this->received == this->frameLength)
+		{
+			if (this->frameLength <= this->frameSize)
+				this->handleFrame(this->rxBuffer, this->frameLength);
+
+			this->frameLength = 0;
+			this->lengthShift = 0;
+			this->lengthDone = false;
+		}
+	}
+}
+
+/**
+ * Handles a complete frame.
+ *
+ * @param frame frame data, without the length prefix.
+ * @param length length of the frame.
+ */
+void AdbRpc::handleFrame(uint8_t * frame, uint16_t length)
+{
+	uint8_t kind = frame[0];
+	uint16_t id, method;
+	uint8_t i;
+
+	// Check and strip the CRC.
+	if (kind & ADB_RPC_FLAG_CRC)
+	{
+		if (length < 3) return;
+		length -= 2;
+		if (crc16(frame, length) != (frame[length] | (frame[length + 1] << 8))) return;
+	}
+
+	RpcReader reader(frame + 1, length - 1);
+	id = reader.getVarint();
+	method = reader.getVarint();
+	if (reader.error()) return;
+
+	switch (kind & ADB_RPC_KIND_MASK)
+	{
+	case ADB_RPC_MESSAGE:
+	case ADB_RPC_REQUEST:
+		for (i = 0; i < this->handlerCount; i++)
+			if (this->handlers[i].method == method) break;
+
+		if (i < this->handlerCount && this->handlers[i].invoker(this, &reader, id, this->handlers[i].handler))
+			break;
+
+		// Unknown method or malformed request, let the caller know.
+		if ((kind & ADB_RPC_KIND_MASK) == ADB_RPC_REQUEST)
+		{
+			RpcWriter writer(this->txBuffer + ADB_RPC_PREFIX_SIZE, this->frameSize);
+			this->startFrame(writer, ADB_RPC_ERROR, id, method);
+			this->sendFrame(writer);
+		}
+		break;
+
+	case ADB_RPC_RESPONSE:
+	case ADB_RPC_ERROR:
+		for (i = 0; i < ADB_RPC_MAX_PENDING; i++)
+		{
+			if (this->pending[i].invoker == NULL || this->pending[i].id != id) continue;
+
+			adb_rpcInvoker * invoker = this->pending[i].invoker;
+			this->pending[i].invoker = NULL;
+			invoker(this, (kind & ADB_RPC_KIND_MASK) == ADB_RPC_RESPONSE ? &reader : NULL, id, this->pending[i].handler);
+			break;
+		}
+		break;
+	}
+}
@@ -0,0 +1,266 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbrpc_h__
+#define __adbrpc_h__
+
+#include <Adb.h>
+
+// Frame kinds, in the low bits of the first byte of a frame.
+#define ADB_RPC_MESSAGE 0
+#define ADB_RPC_REQUEST 1
+#define ADB_RPC_RESPONSE 2
+#define ADB_RPC_ERROR 3
+#define ADB_RPC_KIND_MASK 0x03
+
+// Set in the first byte of a frame that ends with a CRC.
+#define ADB_RPC_FLAG_CRC 0x04
+
+// Room reserved in front of an outgoing frame for its length prefix.
+#define ADB_RPC_PREFIX_SIZE 3
+
+#define ADB_RPC_MAX_HANDLERS 8
+#define ADB_RPC_MAX_PENDING 4
+
+// Result codes.
+#define ADB_RPC_NOT_CONNECTED -1
+#define ADB_RPC_OVERFLOW -2
+#define ADB_RPC_QUEUE_FULL -3
+#define ADB_RPC_TOO_MANY -4
+
+/**
+ * Encodes message fields into a buffer. Unsigned integers are written as varints, signed integers as
+ * zigzag varints, so small values take a single byte whatever their type. Writes past the end of the
+ * buffer are dropped and flagged.
+ */
+class RpcWriter
+{
+private:
+	uint8_t * buffer;
+	uint16_t size;
+	uint16_t position;
+	boolean overflowed;
+
+public:
+	RpcWriter(uint8_t * buffer, uint16_t size);
+
+	void putByte(uint8_t value);
+	void putVarint(uint32_t value);
+	void putSigned(int32_t value);
+	void putFloat(float value);
+	void putBytes(const uint8_t * data, uint16_t length);
+
+	uint16_t length();
+	boolean overflow();
+};
+
+/**
+ * Decodes message fields from a buffer. Reads past the end return zero and are flagged.
+ */
+class RpcReader
+{
+private:
+	const uint8_t * buffer;
+	uint16_t size;
+	uint16_t position;
+	boolean failed;
+
+public:
+	RpcReader(const uint8_t * buffer, uint16_t size);
+
+	uint8_t getByte();
+	uint32_t getVarint();
+	int32_t getSigned();
+	float getFloat();
+	uint16_t getBytes(uint8_t * target, uint16_t capacity);
+
+	boolean error();
+};
+
+class AdbRpc;
+
+typedef void (*adb_rpcFunction)();
+
+/**
+ * Decodes a message and calls the handler with it. Requests are answered with a response carrying the same
+ * id. The reader is NULL for calls that failed.
+ */
+typedef boolean (adb_rpcInvoker)(AdbRpc * rpc, RpcReader * reader, uint16_t id, adb_rpcFunction handler);
+
+typedef struct
+{
+	uint16_t method;
+	adb_rpcInvoker * invoker;
+	adb_rpcFunction handler;
+} adb_rpcHandler;
+
+typedef struct
+{
+	uint16_t id;
+	adb_rpcInvoker * invoker;
+	adb_rpcFunction handler;
+} adb_rpcPending;
+
+/**
+ * Typed messages and remote calls over an ADB stream. The message types are plain structs generated from
+ * a small interface description by tools/rpcgen.py, which also generates the Java classes for
+ * org.microbridge.server.Rpc on the phone.
+ *
+ * Every frame is prefixed with its length as a varint, and holds the frame kind, a request id, the method
+ * id, the message fields, and optionally a CRC-16. Messages are decoded into a struct on the stack and
+ * passed to the handler registered for their type, so neither sending nor receiving allocates memory.
+ *
+ *   AdbRpc rpc;
+ *
+ *   void setServos(const SetServos & message) { ... }
+ *   void readAnalog(const ReadAnalog & request, ReadAnalogResponse & response) { ... }
+ *
+ *   rpc.begin(PSTR("tcp:4567"), 64, 128);
+ *   rpc.on(setServos);
+ *   rpc.on(readAnalog);
+ */
+class AdbRpc
+{
+private:
+	Connection * connection;
+	boolean crc;
+
+	// Frame buffers.
+	uint8_t * rxBuffer;
+	uint8_t * txBuffer;
+	uint16_t frameSize;
+
+	// Frame parser.
+	uint16_t frameLength;
+	uint16_t received;
+	uint8_t lengthShift;
+	boolean lengthDone;
+
+	adb_rpcHandler handlers[ADB_RPC_MAX_HANDLERS];
+	uint8_t handlerCount;
+
+	adb_rpcPending pending[ADB_RPC_MAX_PENDING];
+	uint16_t nextId;
+
+	static void eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
+	void handleData(uint16_t length, uint8_t * data);
+	void handleFrame(uint8_t * frame, uint16_t length);
+	void abortPending();
+
+	boolean addHandler(uint16_t method, adb_rpcInvoker * invoker, adb_rpcFunction handler);
+	void startFrame(RpcWriter & writer, uint8_t kind, uint16_t id, uint16_t method);
+	int sendFrame(RpcWriter & writer);
+
+	template<class T> static boolean invokeMessage(AdbRpc * rpc, RpcReader * reader, uint16_t id, adb_rpcFunction handler)
+	{
+		T message;
+
+		message.decode(*reader);
+		if (reader->error()) return false;
+
+		((void (*)(const T &))handler)(message);
+		return true;
+	}
+
+	template<class T> static boolean invokeRequest(AdbRpc * rpc, RpcReader * reader, uint16_t id, adb_rpcFunction handler)
+	{
+		T request;
+		typename T::Response response;
+
+		request.decode(*reader);
+		if (reader->error()) return false;
+
+		((void (*)(const T &, typename T::Response &))handler)(request, response);
+
+		// The response is encoded only now, as the handler may have sent messages of its own.
+		RpcWriter writer(rpc->txBuffer + ADB_RPC_PREFIX_SIZE, rpc->frameSize);
+		rpc->startFrame(writer, ADB_RPC_RESPONSE, id, T::METHOD);
+		response.encode(writer);
+		rpc->sendFrame(writer);
+		return true;
+	}
+
+	template<class T> static boolean invokeResponse(AdbRpc * rpc, RpcReader * reader, uint16_t id, adb_rpcFunction handler)
+	{
+		typename T::Response response;
+
+		if (reader != NULL)
+		{
+			response.decode(*reader);
+			if (reader->error()) reader = NULL;
+		}
+
+		((void (*)(const typename T::Response *))handler)(reader != NULL ? &response : NULL);
+		return true;
+	}
+
+	int sendCall(RpcWriter & writer, adb_rpcInvoker * invoker, adb_rpcFunction handler);
+
+public:
+	AdbRpc();
+
+	boolean begin(PGM_P service, uint16_t frameSize, uint16_t bufferSize);
+	Connection * getConnection();
+	void setCrc(boolean enable);
+
+	/**
+	 * Registers the handler for a message type.
+	 */
+	template<class T> boolean on(void (*handler)(const T & message))
+	{
+		return this->addHandler(T::METHOD, AdbRpc::invokeMessage<T>, (adb_rpcFunction)handler);
+	}
+
+	/**
+	 * Registers the handler for calls from the phone. The handler fills in the response, which is sent back
+	 * when it returns.
+	 */
+	template<class T> boolean on(void (*handler)(const T & request, typename T::Response & response))
+	{
+		return this->addHandler(T::METHOD, AdbRpc::invokeRequest<T>, (adb_rpcFunction)handler);
+	}
+
+	/**
+	 * Sends a message that doesn't expect a response.
+	 *
+	 * @return 0 on success, or a negative result code.
+	 */
+	template<class T> int send(const T & message)
+	{
+		RpcWriter writer(this->txBuffer + ADB_RPC_PREFIX_SIZE, this->frameSize);
+
+		this->startFrame(writer, ADB_RPC_MESSAGE, 0, T::METHOD);
+		message.encode(writer);
+		return this->sendFrame(writer);
+	}
+
+	/**
+	 * Calls a method on the phone. The handler receives the response, or NULL if the call failed or the
+	 * stream was closed before the response arrived.
+	 *
+	 * @return 0 on success, or a negative result code.
+	 */
+	template<class T> int call(const T & request, void (*handler)(const typename T::Response * response))
+	{
+		RpcWriter writer(this->txBuffer + ADB_RPC_PREFIX_SIZE, this->frameSize);
+
+		this->startFrame(writer, ADB_RPC_REQUEST, this->nextId, T::METHOD);
+		request.encode(writer);
+		return this->sendCall(writer, AdbRpc::invokeResponse<T>, (adb_rpcFunction)handler);
+	}
+};
+
+#endif
@@ -0,0 +1,396 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <avr/interrupt.h>
+#include <AdbSampler.h>
+
+#define HEADER_WORDS (ADB_SAMPLER_HEADER_SIZE / 2)
+
+// A conversion takes 13 ADC clock cycles.
+#define ADC_CYCLES 13
+
+AdbSampler * AdbSampler::active = NULL;
+
+// Timer 2 clock prescalers, indexed by clock select value minus one.
+static const uint16_t timerPrescalers[] = { 1, 8, 32, 64, 128, 256, 1024 };
+
+/**
+ * Creates a sampler. Call begin() before use.
+ */
+AdbSampler::AdbSampler()
+{
+	this->connection = NULL;
+	this->channels = 0;
+	this->buffers[0] = NULL;
+	this->buffers[1] = NULL;
+	this->rowsPerBuffer = 0;
+	this->bufferSize = 0;
+	this->full[0] = false;
+	this->full[1] = false;
+	this->sending = 0;
+	this->sequence = 0;
+	this->filling = 0;
+	this->position = NULL;
+	this->row = 0;
+	this->channel = 0;
+	this->scanning = false;
+	this->timerPrescaler = 0;
+	this->timerCompare = 0;
+	this->adcPrescaler = 0;
+	this->running = false;
+	this->savedTccr2a = 0;
+	this->savedTccr2b = 0;
+	this->savedOcr2a = 0;
+	this->savedTimsk2 = 0;
+	this->overruns = 0;
+	this->droppedBuffers = 0;
+	this->sentBuffers = 0;
+}
+
+/**
+ * Configures the channels and the sampling rate, and allocates the buffers. Sampling starts with start().
+ *
+ * The ADC clock is set as slow as the rate allows, since slower conversions are more accurate; a scan of
+ * all channels may take up to three quarters of the sampling period.
+ *
+ * @param connection ADB connection the buffers are written to. It should not have a transmit queue.
+ * @param pins analog inputs to sample, as A0, A1, ... or 0, 1, ...
+ * @param channels number of inputs, at most ADB_SAMPLER_MAX_CHANNELS.
+ * @param rate number of scans per second, at least 61 (with a 16MHz clock).
+ * @param rows number of scans per buffer. A buffer takes ADB_SAMPLER_HEADER_SIZE + rows * (channels + 1)
+ * * 2 bytes, which must not exceed the maximum payload size of the connection.
+ * @return true on success, false if the rate can't be reached or if out of memory.
+ */
+boolean AdbSampler::begin(Connection * connection, const uint8_t * pins, uint8_t channels, uint16_t rate, uint16_t rows)
+{
+	uint32_t period, ticks, size;
+	uint16_t prescaler;
+	uint8_t i, pin;
+
+	if (channels == 0 || channels > ADB_SAMPLER_MAX_CHANNELS || rate == 0 || rows == 0) return false;
+
+	// Find the smallest timer prescaler that fits the period in 8 bits.
+	this->timerPrescaler = 0;
+	for (i = 0; i < sizeof(timerPrescalers) / sizeof(timerPrescalers[0]); i++)
+	{
+		ticks = F_CPU / ((uint32_t)timerPrescalers[i] * rate);
+		if (ticks >= 1 && ticks <= 256)
+		{
+			this->timerPrescaler = i + 1;
+			this->timerCompare = ticks - 1;
+			break;
+		}
+	}
+	if (this->timerPrescaler == 0) return false;
+
+	// Find the largest ADC prescaler (from 128 down to 16) that finishes the scan in time.
+	period = F_CPU / rate;
+	for (prescaler = 128, this->adcPrescaler = 7; prescaler >= 16; prescaler >>= 1, this->adcPrescaler--)
+		if ((uint32_t)ADC_CYCLES * prescaler * channels <= period * 3 / 4)
+			break;
+	if (prescaler < 16) return false;
+
+	size = ADB_SAMPLER_HEADER_SIZE + (uint32_t)rows * (channels + 1) * 2;
+	if (size > 0xffff) return false;
+
+	this->buffers[0] = (uint16_t*)malloc(size);
+	this->buffers[1] = (uint16_t*)malloc(size);
+	if (this->buffers[0] == NULL || this->buffers[1] == NULL)
+	{
+		free(this->buffers[0]);
+		free(this->buffers[1]);
+		this->buffers[0] = this->buffers[1] = NULL;
+		return false;
+	}
+
+	for (i = 0; i < channels; i++)
+	{
+		// Map pin names to ADC channels, like analogRead does.
+		pin = pins[i];
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+		if (pin >= 54) pin -= 54;
+#else
+		if (pin >= 14) pin -= 14;
+#endif
+		this->pins[i] = pin;
+	}
+
+	this->connection = connection;
+	this->channels = channels;
+	this->rowsPerBuffer = rows;
+	this->bufferSize = size;
+
+	return true;
+}
+
+/**
+ * Starts sampling. Typically called when the connection opens.
+ */
+void AdbSampler::start()
+{
+	uint8_t oldSREG = SREG;
+
+	if (this->buffers[0] == NULL) return;
+
+	cli();
+
+	AdbSampler::active = this;
+
+	this->full[0] = false;
+	this->full[1] = false;
+	this->sending = 0;
+	this->filling = 0;
+	this->position = this->buffers[0] + HEADER_WORDS;
+	this->row = 0;
+	this->channel = 0;
+	this->scanning = false;
+
+	// ADC on, interrupt on completion.
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | this->adcPrescaler;
+	this->selectChannel(0);
+
+	// Keep the core's timer 2 settings (PWM on pins 3 and 11) for stop().
+	if (!this->running)
+	{
+		this->savedTccr2a = TCCR2A;
+		this->savedTccr2b = TCCR2B;
+		this->savedOcr2a = OCR2A;
+		this->savedTimsk2 = TIMSK2;
+		this->running = true;
+	}
+
+	// Timer 2 in CTC mode, interrupt on compare match.
+	TCCR2A = _BV(WGM21);
+	TCCR2B = this->timerPrescaler;
+	OCR2A = this->timerCompare;
+	TCNT2 = 0;
+	TIMSK2 = _BV(OCIE2A);
+
+	SREG = oldSREG;
+}
+
+/**
+ * Stops sampling. Buffers that are full are still sent by poll(); a partially filled one is discarded.
+ * The ADC is left in the state analogRead expects, and timer 2 as it was before start().
+ */
+void AdbSampler::stop()
+{
+	uint8_t oldSREG = SREG;
+
+	cli();
+
+	TIMSK2 = 0;
+	TCCR2B = 0;
+	if (this->running)
+	{
+		TCCR2A = this->savedTccr2a;
+		OCR2A = this->savedOcr2a;
+		TCNT2 = 0;
+		TCCR2B = this->savedTccr2b;
+		TIMSK2 = this->savedTimsk2;
+		this->running = false;
+	}
+	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+	this->scanning = false;
+
+	SREG = oldSREG;
+}
+
+/**
+ * Sends the oldest full buffer, if the connection is ready for it. Call this from loop(), along with
+ * ADB::poll(). Full buffers are discarded while the connection is not open.
+ */
+void AdbSampler::poll()
+{
+	uint8_t oldSREG;
+	uint8_t index = this->sending;
+
+	if (!this->full[index]) return;
+
+	switch (this->connection->status)
+	{
+	case ADB_OPEN:
+		// The buffer goes into the USB FIFO directly, so it can be reused as soon as the write returns.
+		if (this->connection->write(this->bufferSize, (uint8_t*)this->buffers[index])) return;
+		this->sentBuffers++;
+		break;
+
+	case ADB_WRITING:
+		// Waiting for the OKAY of the previous buffer.
+		return;
+
+	default:
+		oldSREG = SREG;
+		cli();
+		this->droppedBuffers++;
+		SREG = oldSREG;
+		break;
+	}
+
+	this->full[index] = false;
+	this->sending = index ^ 1;
+}
+
+/**
+ * Points the ADC multiplexer at a channel, with AVcc as reference.
+ */
+void AdbSampler::selectChannel(uint8_t index)
+{
+	uint8_t pin = this->pins[index];
+
+#if defined(MUX5)
+	ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((pin >> 3) & 1) << MUX5);
+#endif
+	ADMUX = _BV(REFS0) | (pin & 7);
+}
+
+/**
+ * Timer interrupt: timestamps a new row and starts the scan.
+ */
+void AdbSampler::tick()
+{
+	uint32_t now;
+	uint16_t * buffer;
+
+	// The previous scan is still running, skip this tick.
+	if (this->scanning)
+	{
+		this->overruns++;
+		return;
+	}
+
+	now = micros();
+
+	if (this->row == 0)
+	{
+		buffer = this->buffers[this->filling];
+		buffer[2] = now & 0xffff;
+		buffer[3] = now >> 16;
+	}
+
+	*this->position++ = now;
+
+	this->scanning = true;
+	ADCSRA |= _BV(ADSC);
+}
+
+/**
+ * ADC interrupt: stores the result and starts the next conversion. At the end of the last row of a buffer,
+ * switches to the other buffer if it has been sent, or starts over if it hasn't.
+ */
+void AdbSampler::convert()
+{
+	uint16_t * buffer;
+	uint8_t other;
+
+	*this->position++ = ADC;
+
+	if (++this->channel < this->channels)
+	{
+		this->selectChannel(this->channel);
+		ADCSRA |= _BV(ADSC);
+		return;
+	}
+
+	// Row complete, get ready for the next one.
+	this->channel = 0;
+	this->selectChannel(0);
+	this->scanning = false;
+
+	if (++this->row < this->rowsPerBuffer) return;
+
+	buffer = this->buffers[this->filling];
+	buffer[0] = this->sequence++ | ((uint16_t)this->channels << 8);
+	buffer[1] = this->row;
+
+	other = this->filling ^ 1;
+	if (this->full[other])
+		this->droppedBuffers++;
+	else
+	{
+		this->full[this->filling] = true;
+		this->filling = other;
+	}
+
+	this->row = 0;
+	this->position = this->buffers[this->filling] + HEADER_WORDS;
+}
+
+/**
+ * Timer 2 compare match handler. Call this from ISR(TIMER2_COMPA_vect) in the sketch.
+ */
+void AdbSampler::timerInterrupt()
+{
+	if (AdbSampler::active != NULL)
+		AdbSampler::active->tick();
+}
+
+/**
+ * ADC conversion complete handler. Call this from ISR(ADC_vect) in the sketch.
+ */
+void AdbSampler::adcInterrupt()
+{
+	if (AdbSampler::active != NULL)
+		AdbSampler::active->convert();
+}
+
+/**
+ * Reads a counter that is updated from interrupt context.
+ */
+uint32_t AdbSampler::readCounter(volatile uint32_t * counter)
+{
+	uint32_t value;
+	uint8_t oldSREG = SREG;
+
+	cli();
+	value = *counter;
+	SREG = oldSREG;
+
+	return value;
+}
+
+/**
+ * @return the size of a buffer in bytes, which is the payload size of each write.
+ */
+uint16_t AdbSampler::getBufferSize()
+{
+	return this->bufferSize;
+}
+
+/**
+ * @return the number of timer ticks that were skipped because the previous scan hadn't finished.
+ */
+uint32_t AdbSampler::getOverruns()
+{
+	return this->readCounter(&this->overruns);
+}
+
+/**
+ * @return the number of full buffers that were discarded, because the connection couldn't keep up or
+ * wasn't open.
+ */
+uint32_t AdbSampler::getDroppedBuffers()
+{
+	return this->readCounter(&this->droppedBuffers);
+}
+
+/**
+ * @return the number of buffers sent.
+ */
+uint32_t AdbSampler::getSentBuffers()
+{
+	return this->sentBuffers;
+}
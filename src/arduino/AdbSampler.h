@@ -0,0 +1,121 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbsampler_h__
+#define __adbsampler_h__
+
+#include <Adb.h>
+
+// Buffer header: sequence number, channel count, row count (16 bits), and the time of the first row in
+// microseconds (32 bits). Multi-byte fields are little-endian.
+#define ADB_SAMPLER_HEADER_SIZE 8
+
+// Maximum number of channels in a row.
+#define ADB_SAMPLER_MAX_CHANNELS 8
+
+/**
+ * Timer-driven analog sampling. Timer 2 fires at the sampling rate; its interrupt handler starts a scan of
+ * all channels, and the ADC interrupt handler stores each result and starts the conversion of the next
+ * channel, so loop() never waits for the ADC. Timer 1 is left alone, so the Servo library keeps working, but
+ * tone() and PWM on the pins of timer 2 (3 and 11 on the Uno) are not available while sampling. stop() puts
+ * timer 2 back the way start() found it, so PWM on those pins resumes where it was.
+ *
+ * Rows of samples go into one of two buffers while the other one is sent. Each row holds the low 16 bits
+ * of micros() at the start of the scan, followed by one 10-bit value per channel. A full buffer is written
+ * by poll() as a single WRTE, straight from the buffer, so the connection should not have a transmit queue
+ * (which would copy the data). If both buffers are full when the next one completes, the new buffer is
+ * discarded and counted; if the scan for a tick has not finished when the next tick arrives, the tick is
+ * skipped and counted as an overrun. The sequence numbers and timestamps show the receiver where data is
+ * missing.
+ *
+ * There can be only one sampler, and analogRead() must not be used while it is running.
+ *
+ * The library doesn't define the interrupt vectors: the core's Tone.cpp defines the one of timer 2 as
+ * well, so any sketch that calls tone() would fail to link. A sketch that uses the sampler forwards them
+ * itself:
+ *
+ *   ISR(TIMER2_COMPA_vect) { AdbSampler::timerInterrupt(); }
+ *   ISR(ADC_vect) { AdbSampler::adcInterrupt(); }
+ *
+ *   const uint8_t pins[] = { A0, A1, A2 };
+ *   AdbSampler sampler;
+ *
+ *   sampler.begin(connection, pins, 3, 2000, 32);
+ *   sampler.start();
+ *   ...
+ *   sampler.poll();
+ *   ADB::poll();
+ */
+class AdbSampler
+{
+private:
+	static AdbSampler * active;
+
+	Connection * connection;
+	uint8_t pins[ADB_SAMPLER_MAX_CHANNELS];
+	uint8_t channels;
+
+	// Ping-pong buffers, in 16-bit words.
+	uint16_t * buffers[2];
+	uint16_t rowsPerBuffer;
+	uint16_t bufferSize;
+	volatile boolean full[2];
+	uint8_t sending;
+	uint8_t sequence;
+
+	// Position of the interrupt handlers.
+	volatile uint8_t filling;
+	volatile uint16_t * position;
+	volatile uint16_t row;
+	volatile uint8_t channel;
+	volatile boolean scanning;
+
+	// Timer and ADC settings for the requested rate.
+	uint8_t timerPrescaler;
+	uint8_t timerCompare;
+	uint8_t adcPrescaler;
+
+	// Timer 2 settings from before start(), restored by stop().
+	boolean running;
+	uint8_t savedTccr2a, savedTccr2b, savedOcr2a, savedTimsk2;
+
+	volatile uint32_t overruns;
+	volatile uint32_t droppedBuffers;
+	uint32_t sentBuffers;
+
+	void selectChannel(uint8_t index);
+	void tick();
+	void convert();
+	uint32_t readCounter(volatile uint32_t * counter);
+
+public:
+	AdbSampler();
+
+	boolean begin(Connection * connection, const uint8_t * pins, uint8_t channels, uint16_t rate, uint16_t rows);
+	void start();
+	void stop();
+	void poll();
+
+	uint16_t getBufferSize();
+	uint32_t getOverruns();
+	uint32_t getDroppedBuffers();
+	uint32_t getSentBuffers();
+
+	static void timerInterrupt();
+	static void adcInterrupt();
+};
+
+#endif
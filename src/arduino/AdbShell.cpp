@@ -0,0 +1,330 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbShell.h>
+
+// Sentinel printed before and after each command, followed by 'S' or 'E' and the command id. The commands
+// that print it spell it with an empty string in the middle, so that echoed input never matches. All its
+// characters differ, so after a mismatch the parser never has to look back further than the current byte.
+static const char sentinel[] = "=MB_";
+#define SENTINEL_LENGTH 4
+
+static const char disableEcho[] PROGMEM = "stty -echo 2>/dev/null\n";
+static const char startPrefix[] PROGMEM = "echo =M\"\"B_S";
+static const char endPrefix[] PROGMEM = "\necho =M\"\"B_E";
+static const char endSuffix[] PROGMEM = ":$?\n";
+
+// Size of the staging buffer for output that is passed to handlers.
+#define OUTPUT_CHUNK 32
+
+/**
+ * Creates a shell. Call begin() before use.
+ */
+AdbShell::AdbShell()
+{
+	this->connection = NULL;
+	this->interactive = false;
+	this->queueHead = 0;
+	this->queueCount = 0;
+	this->nextId = 0;
+	this->parseState = ADB_SHELL_TEXT;
+	this->matched = 0;
+	this->inside = false;
+}
+
+/**
+ * Opens a persistent shell stream to the device. Commands are queued in the transmit buffer of the
+ * connection, so the buffer must be large enough to hold all commands that are in flight at once, plus
+ * about 40 bytes of framing per command.
+ *
+ * @param service connection string in program memory, 'shell:' for an interactive shell, or for
+ * instance 'exec:sh' for a raw stream on devices that support it.
+ * @param bufferSize size of the transmit buffer in bytes.
+ * @return true on success, false if out of memory.
+ */
+boolean AdbShell::begin(PGM_P service, uint16_t bufferSize)
+{
+	this->interactive = strcmp_P("shell:", service) == 0;
+
+	this->connection = ADB::addConnection_P(service, true, AdbShell::eventHandler);
+	if (this->connection == NULL) return false;
+	this->connection->userData = this;
+
+	return this->connection->setTransmitBuffer(bufferSize);
+}
+
+/**
+ * @return the ADB connection used by this shell.
+ */
+Connection * AdbShell::getConnection()
+{
+	return this->connection;
+}
+
+/**
+ * Event handler for the shell stream, passes events on to the shell that owns the connection.
+ */
+void AdbShell::eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	AdbShell * shell = (AdbShell*)connection->userData;
+	adb_segment segment;
+
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		// Keep typed-ahead commands out of the output of the running one.
+		if (shell->interactive)
+		{
+			segment.data = (const uint8_t*)disableEcho;
+			segment.length = strlen_P(disableEcho);
+			segment.progmem = true;
+			connection->writev(1, &segment);
+		}
+		break;
+	case ADB_CONNECTION_RECEIVE:
+		shell->handleData(length, data);
+		break;
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		shell->abortAll();
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Queues a command. The command is written to the shell right away, without waiting for the commands
+ * before it to finish.
+ *
+ * @param command shell command line. Must not contain newlines.
+ * @param handler handler that receives the output and exit code of the command.
+ * @param context passed to the handler.
+ * @return 0 on success, ADB_SHELL_NOT_CONNECTED if the shell is not open, or ADB_SHELL_QUEUE_FULL if there
+ * are too many commands in flight or they don't fit in the transmit buffer.
+ */
+int AdbShell::run(const char * command, adb_shellHandler * handler, void * context)
+{
+	adb_shellCommand * entry;
+	adb_segment segments[6];
+	char start[5], end[4];
+	uint8_t slot, value, i = 0;
+
+	if (this->connection == NULL) return ADB_SHELL_NOT_CONNECTED;
+	if (this->connection->status != ADB_OPEN && this->connection->status != ADB_WRITING) return ADB_SHELL_NOT_CONNECTED;
+	if (this->queueCount == ADB_SHELL_QUEUE_SIZE) return ADB_SHELL_QUEUE_FULL;
+
+	// Command id in decimal.
+	value = this->nextId;
+	if (value >= 100) end[i++] = '0' + value / 100;
+	if (value >= 10) end[i++] = '0' + value / 10 % 10;
+	end[i++] = '0' + value % 10;
+	end[i] = 0;
+	strcpy(start, end);
+	strcat(start, "\n");
+
+	segments[0].data = (const uint8_t*)startPrefix;
+	segments[0].length = strlen_P(startPrefix);
+	segments[0].progmem = true;
+	segments[1].data = (const uint8_t*)start;
+	segments[1].length = strlen(start);
+	segments[1].progmem = false;
+	segments[2].data = (const uint8_t*)command;
+	segments[2].length = strlen(command);
+	segments[2].progmem = false;
+	segments[3].data = (const uint8_t*)endPrefix;
+	segments[3].length = strlen_P(endPrefix);
+	segments[3].progmem = true;
+	segments[4].data = (const uint8_t*)end;
+	segments[4].length = strlen(end);
+	segments[4].progmem = false;
+	segments[5].data = (const uint8_t*)endSuffix;
+	segments[5].length = strlen_P(endSuffix);
+	segments[5].progmem = true;
+
+	// The whole command goes out in one write, or not at all.
+	if (this->connection->writev(6, segments)) return ADB_SHELL_QUEUE_FULL;
+
+	slot = (this->queueHead + this->queueCount) % ADB_SHELL_QUEUE_SIZE;
+	entry = &this->queue[slot];
+	entry->id = this->nextId++;
+	entry->handler = handler;
+	entry->context = context;
+	this->queueCount++;
+
+	return 0;
+}
+
+/**
+ * @return the number of commands that have been queued but have not finished yet.
+ */
+uint8_t AdbShell::pending()
+{
+	return this->queueCount;
+}
+
+/**
+ * Finishes the oldest command in flight.
+ *
+ * @param status exit code, or ADB_SHELL_ABORTED.
+ */
+void AdbShell::complete(int status)
+{
+	adb_shellCommand * entry = &this->queue[this->queueHead];
+
+	this->queueHead = (this->queueHead + 1) % ADB_SHELL_QUEUE_SIZE;
+	this->queueCount--;
+	this->inside = false;
+
+	if (entry->handler != NULL)
+		entry->handler(entry->context, status, 0, NULL);
+}
+
+/**
+ * Aborts all commands in flight when the shell stream goes away, and resets the output parser.
+ */
+void AdbShell::abortAll()
+{
+	this->parseState = ADB_SHELL_TEXT;
+	this->matched = 0;
+
+	while (this->queueCount > 0)
+		this->complete(ADB_SHELL_ABORTED);
+}
+
+/**
+ * Passes output to the handler of the oldest command in flight.
+ */
+void AdbShell::deliver(uint8_t length, uint8_t * data)
+{
+	adb_shellCommand * head = &this->queue[this->queueHead];
+
+	if (length > 0 && this->queueCount > 0 && head->handler != NULL)
+		head->handler(head->context, ADB_SHELL_OUTPUT, length, data);
+}
+
+/**
+ * Parses output from the shell. Output between the start and end sentinels of the oldest command is passed
+ * to its handler in pieces of up to OUTPUT_CHUNK bytes; bytes that might be the start of a sentinel are
+ * held back until it is clear whether they are.
+ *
+ * @param length number of bytes received.
+ * @param data received data.
+ */
+void AdbShell::handleData(uint16_t length, uint8_t * data)
+{
+	uint8_t output[OUTPUT_CHUNK];
+	uint8_t outputLength = 0;
+	uint8_t i, c;
+
+	while (length > 0)
+	{
+		c = *data;
+
+		switch (this->parseState)
+		{
+		case ADB_SHELL_TEXT:
+			if (this->matched < SENTINEL_LENGTH && c == sentinel[this->matched])
+			{
+				if (++this->matched == SENTINEL_LENGTH)
+				{
+					this->parseState = ADB_SHELL_KIND;
+					this->matched = 0;
+				}
+				break;
+			}
+
+			// Not a sentinel after all, release the bytes that were held back and look at this one again.
+			if (this->matched > 0)
+			{
+				for (i = 0; i < this->matched && this->inside; i++)
+				{
+					output[outputLength++] = sentinel[i];
+					if (outputLength == OUTPUT_CHUNK)
+					{
+						this->deliver(outputLength, output);
+						outputLength = 0;
+					}
+				}
+				this->matched = 0;
+				continue;
+			}
+
+			if (this->inside)
+			{
+				output[outputLength++] = c;
+				if (outputLength == OUTPUT_CHUNK)
+				{
+					this->deliver(outputLength, output);
+					outputLength = 0;
+				}
+			}
+			break;
+
+		case ADB_SHELL_KIND:
+			if (c == 'S' || c == 'E')
+			{
+				this->kind = c;
+				this->id = 0;
+				this->status = 0;
+				this->parseState = ADB_SHELL_ID;
+				break;
+			}
+
+			// Release the sentinel as ordinary output, and look at this byte again.
+			this->parseState = ADB_SHELL_TEXT;
+			this->matched = SENTINEL_LENGTH;
+			continue;
+
+		case ADB_SHELL_ID:
+		case ADB_SHELL_STATUS:
+			if (c >= '0' && c <= '9')
+			{
+				if (this->parseState == ADB_SHELL_ID)
+					this->id = this->id * 10 + c - '0';
+				else
+					this->status = this->status * 10 + c - '0';
+			} else if (c == ':' && this->parseState == ADB_SHELL_ID && this->kind == 'E')
+				this->parseState = ADB_SHELL_STATUS;
+			else if (c == '\n')
+			{
+				this->parseState = ADB_SHELL_TEXT;
+
+				// Sentinels that don't belong to the oldest command are stray, and are ignored.
+				if (this->queueCount > 0 && this->id == this->queue[this->queueHead].id)
+				{
+					if (this->kind == 'S')
+						this->inside = true;
+					else
+					{
+						// Hand over the rest of the output before the exit code.
+						this->deliver(outputLength, output);
+						outputLength = 0;
+						this->complete(this->status);
+					}
+				}
+			}
+			// Anything else, like the carriage return a pty adds, is skipped.
+			break;
+		}
+
+		data++;
+		length--;
+	}
+
+	this->deliver(outputLength, output);
+}
@@ -0,0 +1,105 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbshell_h__
+#define __adbshell_h__
+
+#include <Adb.h>
+
+// Maximum number of commands in flight.
+#define ADB_SHELL_QUEUE_SIZE 8
+
+// Status passed to the handler along with output data, and when a command is aborted because the shell
+// stream was closed. Exit codes of completed commands are 0..255.
+#define ADB_SHELL_OUTPUT -1
+#define ADB_SHELL_ABORTED -2
+
+// Result codes of run.
+#define ADB_SHELL_NOT_CONNECTED -1
+#define ADB_SHELL_QUEUE_FULL -2
+
+/**
+ * Handler for the output and completion of a shell command. Called with status ADB_SHELL_OUTPUT for every
+ * piece of output, and once more with the exit code of the command (or ADB_SHELL_ABORTED) and no data.
+ */
+typedef void(adb_shellHandler)(void * context, int status, uint16_t length, uint8_t * data);
+
+typedef enum
+{
+	ADB_SHELL_TEXT = 0,
+	ADB_SHELL_KIND,
+	ADB_SHELL_ID,
+	ADB_SHELL_STATUS
+} adb_shellParseState;
+
+typedef struct
+{
+	uint8_t id;
+	adb_shellHandler * handler;
+	void * context;
+} adb_shellCommand;
+
+/**
+ * Runs commands in a single, persistent shell on the device, instead of opening a new 'shell:' stream for
+ * every command. Commands are written to the shell right away, so several can be in flight; the shell runs
+ * them in order. Each command is wrapped in echo statements that print unique sentinels before and after
+ * it, which the output parser uses to deliver each command's output and exit code to its own handler.
+ *
+ * On an interactive 'shell:' stream local echo is switched off when the stream opens, so that commands
+ * that are typed ahead don't show up in the output of the one that is running. Prompts and other output
+ * outside the sentinels is discarded.
+ *
+ *   AdbShell shell;
+ *
+ *   shell.begin(PSTR("shell:"), 256);
+ *   ...
+ *   shell.run("getprop ro.product.model", printOutput, NULL);
+ */
+class AdbShell
+{
+private:
+	Connection * connection;
+	boolean interactive;
+
+	adb_shellCommand queue[ADB_SHELL_QUEUE_SIZE];
+	uint8_t queueHead, queueCount;
+	uint8_t nextId;
+
+	// Output parser.
+	adb_shellParseState parseState;
+	uint8_t matched;
+	boolean inside;
+	char kind;
+	uint8_t id;
+	uint8_t status;
+
+	static void eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
+	void handleData(uint16_t length, uint8_t * data);
+	void deliver(uint8_t length, uint8_t * data);
+	void complete(int status);
+	void abortAll();
+
+public:
+	AdbShell();
+
+	boolean begin(PGM_P service, uint16_t bufferSize);
+	Connection * getConnection();
+
+	int run(const char * command, adb_shellHandler * handler, void * context);
+	uint8_t pending();
+};
+
+#endif
@@ -0,0 +1,126 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <AdbStream.h>
+
+/**
+ * Creates an unbound stream. Call begin() before use.
+ */
+AdbStream::AdbStream()
+{
+	this->connection = NULL;
+}
+
+/**
+ * Creates a stream for an ADB connection.
+ * @param connection ADB connection.
+ */
+AdbStream::AdbStream(Connection * connection)
+{
+	this->connection = connection;
+}
+
+/**
+ * Binds the stream to an ADB connection.
+ * @param connection ADB connection.
+ */
+void AdbStream::begin(Connection * connection)
+{
+	this->connection = connection;
+}
+
+/**
+ * @return the ADB connection this stream is bound to.
+ */
+Connection * AdbStream::getConnection()
+{
+	return this->connection;
+}
+
+/**
+ * @return the number of bytes waiting in the receive buffer of the connection.
+ */
+int AdbStream::available()
+{
+	if (this->connection == NULL) return 0;
+	return this->connection->available();
+}
+
+/**
+ * @return the next byte from the receive buffer, or -1 if there is none.
+ */
+int AdbStream::read()
+{
+	if (this->connection == NULL) return -1;
+	return this->connection->read();
+}
+
+/**
+ * @return the next byte from the receive buffer without removing it, or -1 if there is none.
+ */
+int AdbStream::peek()
+{
+	if (this->connection == NULL) return -1;
+	return this->connection->peek();
+}
+
+/**
+ * Sends coalesced data on the connection immediately.
+ */
+void AdbStream::flush()
+{
+	if (this->connection != NULL)
+		this->connection->flush();
+}
+
+#if defined(ARDUINO) && ARDUINO >= 100
+
+/**
+ * Writes a single byte to the connection.
+ * @param value byte to write.
+ * @return 1 on success, 0 on failure.
+ */
+size_t AdbStream::write(uint8_t value)
+{
+	if (this->connection == NULL) return 0;
+	return this->connection->write(1, &value) == 0 ? 1 : 0;
+}
+
+/**
+ * Writes a buffer to the connection as a single ADB message.
+ * @param buffer data to write.
+ * @param size number of bytes to write.
+ * @return number of bytes written.
+ */
+size_t AdbStream::write(const uint8_t * buffer, size_t size)
+{
+	if (this->connection == NULL) return 0;
+	return this->connection->write(size, (uint8_t*)buffer) == 0 ? size : 0;
+}
+
+#else
+
+/**
+ * Writes a single byte to the connection.
+ * @param value byte to write.
+ */
+void AdbStream::write(uint8_t value)
+{
+	if (this->connection != NULL)
+		this->connection->write(1, &value);
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbstream_h__
+#define __adbstream_h__
+
+#include "Stream.h"
+#include <Adb.h>
+
+/**
+ * Arduino Stream wrapper around an ADB connection, so that existing Arduino parsers and printing code
+ * can be used on ADB connections. The connection should have a receive buffer (see
+ * Connection::setReceiveBuffer), otherwise there is never any data available for reading.
+ *
+ * Connection records are allocated with malloc and have no virtual methods, which is why this is a
+ * separate object rather than a Connection base class. Declare it statically in the sketch:
+ *
+ *   Connection * connection;
+ *   AdbStream stream;
+ *
+ *   connection = ADB::addConnection_P(PSTR("tcp:4567"), true, NULL);
+ *   connection->setReceiveBuffer(64);
+ *   stream.begin(connection);
+ */
+class AdbStream : public Stream
+{
+private:
+	Connection * connection;
+
+public:
+	AdbStream();
+	AdbStream(Connection * connection);
+
+	void begin(Connection * connection);
+	Connection * getConnection();
+
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual void flush();
+
+#if defined(ARDUINO) && ARDUINO >= 100
+	virtual size_t write(uint8_t value);
+	virtual size_t write(const uint8_t * buffer, size_t size);
+#else
+	virtual void write(uint8_t value);
+#endif
+};
+
+#endif
@@ -0,0 +1,447 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbSync.h>
+
+/**
+ * Stores a 32-bit value in little-endian byte order.
+ */
+static void putWord(uint8_t * target, uint32_t value)
+{
+	target[0] = value;
+	target[1] = value >> 8;
+	target[2] = value >> 16;
+	target[3] = value >> 24;
+}
+
+/**
+ * Reads a 32-bit value in little-endian byte order.
+ */
+static uint32_t getWord(const uint8_t * source)
+{
+	return source[0] | ((uint32_t)source[1] << 8) | ((uint32_t)source[2] << 16) | ((uint32_t)source[3] << 24);
+}
+
+/**
+ * Creates a sync client. Call begin() before use.
+ */
+AdbSync::AdbSync()
+{
+	this->connection = NULL;
+	this->buffer = NULL;
+	this->bufferSize = 0;
+	this->pending = 0;
+	this->state = ADB_SYNC_IDLE;
+	this->result = ADB_SYNC_SUCCESS;
+	this->transferred = 0;
+	this->headerLength = 0;
+	this->payloadLeft = 0;
+	this->messageLength = 0;
+	this->message[0] = 0;
+}
+
+/**
+ * Allocates the chunk buffer and opens a persistent 'sync:' stream to the device.
+ *
+ * @param chunkSize maximum number of bytes sent per DATA packet by push. Larger chunks mean fewer round
+ * trips and higher throughput. Limited to the maximum payload size negotiated with the device.
+ * @return true on success, false if out of memory.
+ */
+boolean AdbSync::begin(uint16_t chunkSize)
+{
+	this->buffer = (uint8_t*)malloc(ADB_SYNC_HEADER_SIZE + chunkSize);
+	if (this->buffer == NULL) return false;
+	this->bufferSize = ADB_SYNC_HEADER_SIZE + chunkSize;
+
+	this->connection = ADB::addConnection_P(PSTR("sync:"), true, AdbSync::eventHandler);
+	if (this->connection == NULL) return false;
+	this->connection->userData = this;
+
+	return true;
+}
+
+/**
+ * @return the ADB connection used by this client.
+ */
+Connection * AdbSync::getConnection()
+{
+	return this->connection;
+}
+
+/**
+ * Event handler for the sync stream, passes events on to the client that owns the connection.
+ */
+void AdbSync::eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	AdbSync * sync = (AdbSync*)connection->userData;
+
+	switch (event)
+	{
+	case ADB_CONNECTION_RECEIVE:
+		sync->handleData(length, data);
+		break;
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		// Start parsing afresh on the next stream.
+		sync->headerLength = 0;
+		sync->payloadLeft = 0;
+		sync->pending = 0;
+		if (sync->state != ADB_SYNC_IDLE)
+			sync->finish(ADB_SYNC_CLOSED);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Ends the current operation.
+ * @param result result code.
+ */
+void AdbSync::finish(int result)
+{
+	this->state = ADB_SYNC_IDLE;
+	this->result = result;
+	this->pending = 0;
+}
+
+/**
+ * Parses reply data from the device. Replies can be split over any number of WRTE messages, and DATA
+ * payloads are passed to the writer as they come in, without buffering.
+ *
+ * @param length number of bytes received.
+ * @param data received data.
+ */
+void AdbSync::handleData(uint16_t length, uint8_t * data)
+{
+	uint16_t count;
+	uint8_t headerSize;
+
+	while (length > 0)
+	{
+		if (this->payloadLeft == 0)
+		{
+			// Collect the reply header. STAT replies have no length field, but a fixed size.
+			headerSize = this->headerLength >= 4 && getWord(this->header) == ADB_SYNC_STAT ? ADB_SYNC_STAT_SIZE : ADB_SYNC_HEADER_SIZE;
+
+			this->header[this->headerLength++] = *data++;
+			length--;
+
+			if (this->headerLength == headerSize)
+				this->handleHeader();
+
+			continue;
+		}
+
+		count = length < this->payloadLeft ? length : this->payloadLeft;
+
+		if (getWord(this->header) == ADB_SYNC_DATA)
+		{
+			// Keep consuming the data after a local failure, the device will send it anyway.
+			if (this->writer != NULL && this->result == ADB_SYNC_SUCCESS)
+				if (this->writer(this->context, data, count) < 0)
+					this->result = ADB_SYNC_LOCAL_ERROR;
+
+			this->transferred += count;
+		} else
+		{
+			// Keep the start of the error message.
+			while (count > 0 && this->messageLength < ADB_SYNC_MESSAGE_SIZE - 1)
+			{
+				this->message[this->messageLength++] = *data++;
+				this->payloadLeft--;
+				length--;
+				count--;
+			}
+			this->message[this->messageLength] = 0;
+		}
+
+		data += count;
+		length -= count;
+		this->payloadLeft -= count;
+
+		if (this->payloadLeft == 0)
+		{
+			this->headerLength = 0;
+			if (getWord(this->header) == ADB_SYNC_FAIL)
+				this->finish(ADB_SYNC_REMOTE_ERROR);
+		}
+	}
+}
+
+/**
+ * Handles a complete reply header.
+ */
+void AdbSync::handleHeader()
+{
+	uint32_t id = getWord(this->header);
+
+	this->payloadLeft = 0;
+
+	if (id == ADB_SYNC_STAT)
+	{
+		// A mode of zero means the file doesn't exist.
+		this->statMode = getWord(this->header + 4);
+		this->statSize = getWord(this->header + 8);
+		this->statTime = getWord(this->header + 12);
+		this->headerLength = 0;
+		if (this->state == ADB_SYNC_STATTING)
+			this->finish(ADB_SYNC_SUCCESS);
+		return;
+	}
+
+	this->payloadLeft = getWord(this->header + 4);
+
+	// Replies that end the operation. DONE ends a pull, OKAY acknowledges a push.
+	if (id == ADB_SYNC_DONE || id == ADB_SYNC_OKAY)
+	{
+		this->payloadLeft = 0;
+		this->headerLength = 0;
+		if (this->state == ADB_SYNC_RECEIVING || this->state == ADB_SYNC_FINISHING)
+			this->finish(this->result);
+	} else if (id == ADB_SYNC_FAIL)
+	{
+		this->messageLength = 0;
+		this->message[0] = 0;
+		if (this->payloadLeft == 0)
+		{
+			this->headerLength = 0;
+			this->finish(ADB_SYNC_REMOTE_ERROR);
+		}
+	} else if (this->payloadLeft == 0)
+		this->headerLength = 0;
+}
+
+/**
+ * Sends a request, consisting of an id and a path with an optional suffix.
+ *
+ * @param id request id.
+ * @param path remote path.
+ * @param suffix appended to the path, or NULL.
+ * @param state state to enter once the request has been sent.
+ * @return 0 on success, or a negative result code.
+ */
+int AdbSync::request(uint32_t id, const char * path, const char * suffix, adb_syncState state)
+{
+	adb_segment segments[3];
+	uint8_t header[ADB_SYNC_HEADER_SIZE];
+
+	if (this->connection == NULL || !this->connection->isOpen()) return ADB_SYNC_NOT_CONNECTED;
+	if (this->state != ADB_SYNC_IDLE) return ADB_SYNC_BUSY;
+
+	segments[0].data = header;
+	segments[0].length = ADB_SYNC_HEADER_SIZE;
+	segments[0].progmem = false;
+	segments[1].data = (const uint8_t*)path;
+	segments[1].length = strlen(path);
+	segments[1].progmem = false;
+	segments[2].data = (const uint8_t*)suffix;
+	segments[2].length = suffix != NULL ? strlen(suffix) : 0;
+	segments[2].progmem = false;
+
+	putWord(header, id);
+	putWord(header + 4, segments[1].length + segments[2].length);
+
+	if (ADB::writev(this->connection, 3, segments)) return ADB_SYNC_NOT_CONNECTED;
+
+	this->state = state;
+	this->result = ADB_SYNC_SUCCESS;
+	this->transferred = 0;
+	this->messageLength = 0;
+	this->message[0] = 0;
+
+	return ADB_SYNC_SUCCESS;
+}
+
+/**
+ * Requests the mode, size, and modification time of a remote file. Once done, these are available from
+ * getMode, getSize, and getTime. A mode of zero means the file does not exist.
+ *
+ * @param path remote path.
+ * @return 0 if the request was sent, or a negative result code.
+ */
+int AdbSync::stat(const char * path)
+{
+	return this->request(ADB_SYNC_STAT, path, NULL, ADB_SYNC_STATTING);
+}
+
+/**
+ * Starts receiving a remote file. The contents are passed to the writer as they arrive.
+ *
+ * @param path remote path.
+ * @param writer receives the file contents.
+ * @param context passed to the writer.
+ * @return 0 if the request was sent, or a negative result code.
+ */
+int AdbSync::pull(const char * path, adb_syncWriter * writer, void * context)
+{
+	if (this->state != ADB_SYNC_IDLE) return ADB_SYNC_BUSY;
+
+	this->writer = writer;
+	this->context = context;
+
+	return this->request(ADB_SYNC_RECV, path, NULL, ADB_SYNC_RECEIVING);
+}
+
+/**
+ * Starts sending a file to the device. The contents are read from the reader one chunk at a time by poll,
+ * as the device acknowledges the previous chunk. If the reader fails the file is ended early, and the
+ * operation reports ADB_SYNC_LOCAL_ERROR.
+ *
+ * @param path remote path.
+ * @param mode file permissions, for instance 0644.
+ * @param modificationTime modification time in seconds since 1970.
+ * @param reader provides the file contents.
+ * @param context passed to the reader.
+ * @return 0 if the request was sent, or a negative result code.
+ */
+int AdbSync::push(const char * path, uint16_t mode, uint32_t modificationTime, adb_syncReader * reader, void * context)
+{
+	char suffix[8];
+	uint32_t value = 0100000 | mode;
+	uint8_t i = sizeof(suffix);
+
+	if (this->state != ADB_SYNC_IDLE) return ADB_SYNC_BUSY;
+
+	// Format ",mode" with the mode of a regular file, in decimal.
+	suffix[--i] = 0;
+	do
+	{
+		suffix[--i] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	suffix[--i] = ',';
+
+	this->reader = reader;
+	this->context = context;
+	this->modificationTime = modificationTime;
+
+	return this->request(ADB_SYNC_SEND, path, suffix + i, ADB_SYNC_SENDING);
+}
+
+/**
+ * Advances a push. Sends the next chunk of the file whenever the device has acknowledged the previous one,
+ * and ends the file with DONE once the reader reports the end of the file. Should be called from the main
+ * loop after ADB::poll.
+ */
+void AdbSync::poll()
+{
+	int count;
+	uint16_t chunkSize;
+
+	if (this->state != ADB_SYNC_SENDING || !this->connection->isOpen()) return;
+
+	if (this->pending == 0)
+	{
+		chunkSize = this->bufferSize - ADB_SYNC_HEADER_SIZE;
+		if (chunkSize > ADB::getMaxPayload() - ADB_SYNC_HEADER_SIZE)
+			chunkSize = ADB::getMaxPayload() - ADB_SYNC_HEADER_SIZE;
+
+		count = this->reader(this->context, this->buffer + ADB_SYNC_HEADER_SIZE, chunkSize);
+
+		if (count > 0)
+		{
+			putWord(this->buffer, ADB_SYNC_DATA);
+			putWord(this->buffer + 4, count);
+			this->pending = ADB_SYNC_HEADER_SIZE + count;
+			this->transferred += count;
+		} else
+		{
+			if (count < 0) this->result = ADB_SYNC_LOCAL_ERROR;
+
+			putWord(this->buffer, ADB_SYNC_DONE);
+			putWord(this->buffer + 4, this->modificationTime);
+			this->pending = ADB_SYNC_HEADER_SIZE;
+		}
+	}
+
+	// Try again on the next call if the write fails.
+	if (ADB::write(this->connection, this->pending, this->buffer)) return;
+
+	if (getWord(this->buffer) == ADB_SYNC_DONE)
+		this->state = ADB_SYNC_FINISHING;
+
+	this->pending = 0;
+}
+
+/**
+ * Aborts the current operation. The sync protocol has no way to cancel a transfer, so the stream is closed
+ * and a new one is opened. The operation ends with ADB_SYNC_CLOSED.
+ */
+void AdbSync::abort()
+{
+	if (this->connection != NULL)
+		ADB::close(this->connection);
+}
+
+/**
+ * @return true iff an operation is in progress.
+ */
+boolean AdbSync::isBusy()
+{
+	return this->state != ADB_SYNC_IDLE;
+}
+
+/**
+ * @return the result of the last operation: ADB_SYNC_SUCCESS, ADB_SYNC_REMOTE_ERROR if the device
+ * reported an error (see getMessage), ADB_SYNC_LOCAL_ERROR if the reader or writer failed, or
+ * ADB_SYNC_CLOSED if the stream was closed.
+ */
+int AdbSync::getResult()
+{
+	return this->result;
+}
+
+/**
+ * @return the number of file bytes sent or received by the last operation.
+ */
+uint32_t AdbSync::getTransferred()
+{
+	return this->transferred;
+}
+
+/**
+ * @return the (possibly truncated) error message sent by the device, or an empty string.
+ */
+const char * AdbSync::getMessage()
+{
+	return this->message;
+}
+
+/**
+ * @return the mode of the file of the last stat, or zero if it doesn't exist.
+ */
+uint32_t AdbSync::getMode()
+{
+	return this->statMode;
+}
+
+/**
+ * @return the size of the file of the last stat.
+ */
+uint32_t AdbSync::getSize()
+{
+	return this->statSize;
+}
+
+/**
+ * @return the modification time of the file of the last stat, in seconds since 1970.
+ */
+uint32_t AdbSync::getTime()
+{
+	return this->statTime;
+}
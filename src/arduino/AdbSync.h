@@ -0,0 +1,136 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbsync_h__
+#define __adbsync_h__
+
+#include <Adb.h>
+
+// Sync protocol request and reply ids, as little-endian words.
+#define ADB_SYNC_STAT 0x54415453
+#define ADB_SYNC_SEND 0x444e4553
+#define ADB_SYNC_RECV 0x56434552
+#define ADB_SYNC_DATA 0x41544144
+#define ADB_SYNC_DONE 0x454e4f44
+#define ADB_SYNC_OKAY 0x59414b4f
+#define ADB_SYNC_FAIL 0x4c494146
+
+// Size of the request header (id and length).
+#define ADB_SYNC_HEADER_SIZE 8
+
+// Size of a STAT reply (id, mode, size, and modification time).
+#define ADB_SYNC_STAT_SIZE 16
+
+// Maximum length of the error message of a FAIL reply that is kept.
+#define ADB_SYNC_MESSAGE_SIZE 32
+
+// Result codes.
+#define ADB_SYNC_SUCCESS 0
+#define ADB_SYNC_NOT_CONNECTED -1
+#define ADB_SYNC_BUSY -2
+#define ADB_SYNC_REMOTE_ERROR -3
+#define ADB_SYNC_LOCAL_ERROR -4
+#define ADB_SYNC_CLOSED -5
+
+typedef enum
+{
+	ADB_SYNC_IDLE = 0,
+	ADB_SYNC_STATTING,
+	ADB_SYNC_RECEIVING,
+	ADB_SYNC_SENDING,
+	ADB_SYNC_FINISHING
+} adb_syncState;
+
+/**
+ * Source of the file contents for push. Fills the buffer with up to length bytes and returns the number of
+ * bytes read, 0 at the end of the file, or a negative value on failure.
+ */
+typedef int(adb_syncReader)(void * context, uint8_t * buffer, uint16_t length);
+
+/**
+ * Sink for the file contents received by pull. Returns 0 on success, or a negative value on failure.
+ */
+typedef int(adb_syncWriter)(void * context, const uint8_t * data, uint16_t length);
+
+/**
+ * Client for the ADB sync protocol, the protocol behind 'adb push' and 'adb pull'. Files are streamed
+ * between the device and a local reader or writer (for instance an SD card file) one chunk at a time, so
+ * the amount of SRAM used is bounded by the chunk size, whatever the size of the file.
+ *
+ * Operations are asynchronous. Start one with stat, pull, or push, and call poll from the main loop (after
+ * ADB::poll) until isBusy returns false; getResult then reports the outcome. One operation can be in
+ * progress at a time.
+ *
+ *   AdbSync adbSync;
+ *
+ *   adbSync.begin(512);
+ *   ...
+ *   adbSync.push("/sdcard/log.txt", 0644, 0, readFile, &file);
+ */
+class AdbSync
+{
+private:
+	Connection * connection;
+	uint8_t * buffer;
+	uint16_t bufferSize;
+	uint16_t pending;
+
+	adb_syncState state;
+	int result;
+	uint32_t transferred;
+
+	adb_syncReader * reader;
+	adb_syncWriter * writer;
+	void * context;
+	uint32_t modificationTime;
+
+	// Reply parser.
+	uint8_t header[ADB_SYNC_STAT_SIZE];
+	uint8_t headerLength;
+	uint32_t payloadLeft;
+	uint32_t statMode, statSize, statTime;
+	char message[ADB_SYNC_MESSAGE_SIZE];
+	uint8_t messageLength;
+
+	static void eventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
+	void handleData(uint16_t length, uint8_t * data);
+	void handleHeader();
+	void finish(int result);
+	int request(uint32_t id, const char * path, const char * suffix, adb_syncState state);
+
+public:
+	AdbSync();
+
+	boolean begin(uint16_t chunkSize);
+	Connection * getConnection();
+
+	int stat(const char * path);
+	int pull(const char * path, adb_syncWriter * writer, void * context);
+	int push(const char * path, uint16_t mode, uint32_t modificationTime, adb_syncReader * reader, void * context);
+	void poll();
+	void abort();
+
+	boolean isBusy();
+	int getResult();
+	uint32_t getTransferred();
+	const char * getMessage();
+
+	uint32_t getMode();
+	uint32_t getSize();
+	uint32_t getTime();
+};
+
+#endif
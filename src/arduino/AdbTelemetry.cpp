@@ -0,0 +1,284 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#include <string.h>
+#include <AdbTelemetry.h>
+
+// Size in bits of an escaped value in packed blocks: zigzag differences of 16-bit samples fit in 17 bits.
+#define ESCAPE_BITS 17
+
+/**
+ * Creates an encoder. Call begin() before use.
+ */
+AdbTelemetry::AdbTelemetry()
+{
+	this->connection = NULL;
+	this->channels = 0;
+	this->block = NULL;
+	this->blockSize = 0;
+	this->sequence = 0;
+	this->bitWidth = 0;
+	this->previous = NULL;
+	this->keyframeInterval = ADB_TELEMETRY_KEYFRAME_INTERVAL;
+	this->sinceKeyframe = 0;
+	this->needKeyframe = true;
+	this->samples = 0;
+	this->encodedBytes = 0;
+	this->droppedBlocks = 0;
+}
+
+/**
+ * Allocates the block buffer and the channel state.
+ *
+ * @param connection ADB connection the blocks are written to. Give it a transmit queue, so that blocks
+ * can be queued while the previous one is in flight.
+ * @param channels number of values per row.
+ * @param blockSize maximum size of a block in bytes, at most the maximum payload size of the connection.
+ * It must hold the header and at least one row: 3 bytes per channel with varints, and more with wide
+ * bit-packed values (see setBitWidth).
+ * @return true on success, false if the block is too small for a row or if out of memory.
+ */
+boolean AdbTelemetry::begin(Connection * connection, uint8_t channels, uint16_t blockSize)
+{
+	// A block must hold at least one row, or add() would write past its end.
+	this->channels = channels;
+	if (blockSize < ADB_TELEMETRY_HEADER_SIZE + this->rowSize(this->bitWidth)) return false;
+
+	this->block = (uint8_t*)malloc(blockSize);
+	this->previous = (int16_t*)malloc(channels * sizeof(int16_t));
+	if (this->block == NULL || this->previous == NULL)
+	{
+		free(this->block);
+		free(this->previous);
+		this->block = NULL;
+		this->previous = NULL;
+		return false;
+	}
+
+	this->connection = connection;
+	this->blockSize = blockSize;
+	this->startBlock();
+
+	return true;
+}
+
+/**
+ * Sets the number of blocks from one keyframe to the next. A decoder that joins the stream, or has
+ * missed a block, resumes at the next keyframe.
+ *
+ * @param blocks keyframe interval, 1 to make every block a keyframe.
+ */
+void AdbTelemetry::setKeyframeInterval(uint8_t blocks)
+{
+	this->keyframeInterval = blocks;
+}
+
+/**
+ * Switches between varint and bit-packed encoding. With bit packing, differences whose zigzag code is
+ * below 2^bits - 1 take exactly that many bits, and larger ones take an escape code plus 17 bits. Flushes
+ * the current block.
+ *
+ * A packed row takes up to ((bits + 17) * channels + 7) / 8 + 1 bytes, which must fit in a block along
+ * with the header.
+ *
+ * @param bits bits per value, 1 to 15, or 0 for varints.
+ * @return true on success, false if a row would not fit in a block or begin() hasn't been called. The
+ * encoding is left unchanged.
+ */
+boolean AdbTelemetry::setBitWidth(uint8_t bits)
+{
+	if (bits > 15) bits = 15;
+	if (this->blockSize < ADB_TELEMETRY_HEADER_SIZE + this->rowSize(bits)) return false;
+
+	this->flush();
+	this->bitWidth = bits;
+
+	// The new block is still empty, only its encoding changes.
+	this->flags &= ADB_TELEMETRY_KEYFRAME;
+	if (this->bitWidth > 0)
+		this->flags |= ADB_TELEMETRY_PACKED | (this->bitWidth << 4);
+
+	return true;
+}
+
+/**
+ * Starts a new block, which is a keyframe if the interval has passed or the previous block was lost.
+ */
+void AdbTelemetry::startBlock()
+{
+	this->flags = this->bitWidth > 0 ? ADB_TELEMETRY_PACKED | (this->bitWidth << 4) : 0;
+
+	if (this->needKeyframe || this->sinceKeyframe + 1 >= this->keyframeInterval)
+	{
+		// Values in a keyframe are differences to zero.
+		memset(this->previous, 0, this->channels * sizeof(int16_t));
+		this->flags |= ADB_TELEMETRY_KEYFRAME;
+		this->sinceKeyframe = 0;
+		this->needKeyframe = false;
+	} else
+		this->sinceKeyframe++;
+
+	this->position = ADB_TELEMETRY_HEADER_SIZE;
+	this->rows = 0;
+	this->bits = 0;
+	this->bitCount = 0;
+}
+
+/**
+ * @param width bits per value, or 0 for varints.
+ * @return the largest number of bytes a row can take.
+ */
+uint16_t AdbTelemetry::rowSize(uint8_t width)
+{
+	if (width == 0)
+		return 3 * this->channels;
+
+	return ((width + ESCAPE_BITS) * this->channels + 7) / 8 + 1;
+}
+
+/**
+ * Appends bits to a packed block, least significant bit first.
+ */
+void AdbTelemetry::putBits(uint32_t value, uint8_t count)
+{
+	this->bits |= value << this->bitCount;
+	this->bitCount += count;
+
+	while (this->bitCount >= 8)
+	{
+		this->block[this->position++] = this->bits;
+		this->bits >>= 8;
+		this->bitCount -= 8;
+	}
+}
+
+/**
+ * Appends the zigzag code of a difference.
+ */
+void AdbTelemetry::putValue(uint32_t code)
+{
+	uint16_t escape;
+
+	if (this->bitWidth == 0)
+	{
+		while (code >= 0x80)
+		{
+			this->block[this->position++] = code | 0x80;
+			code >>= 7;
+		}
+		this->block[this->position++] = code;
+		return;
+	}
+
+	escape = (1 << this->bitWidth) - 1;
+	if (code < escape)
+		this->putBits(code, this->bitWidth);
+	else
+	{
+		this->putBits(escape, this->bitWidth);
+		this->putBits(code, ESCAPE_BITS);
+	}
+}
+
+/**
+ * Adds a row of samples. The current block is sent when the row doesn't fit anymore.
+ *
+ * @param values one value per channel.
+ * @return 0 on success, or ADB_TELEMETRY_DROPPED if a full block could not be sent and was discarded.
+ */
+int AdbTelemetry::add(const int16_t * values)
+{
+	int ret = 0;
+	int32_t delta;
+	uint8_t i;
+
+	if (this->position + this->rowSize(this->bitWidth) > this->blockSize)
+		ret = this->flush();
+
+	for (i = 0; i < this->channels; i++)
+	{
+		delta = (int32_t)values[i] - this->previous[i];
+		this->putValue(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+		this->previous[i] = values[i];
+	}
+
+	this->rows++;
+	this->samples += this->channels;
+
+	return ret;
+}
+
+/**
+ * Sends the current block, if it holds any rows, as a single write.
+ *
+ * @return 0 on success, or ADB_TELEMETRY_DROPPED if the block could not be sent and was discarded. The
+ * next block is then a keyframe.
+ */
+int AdbTelemetry::flush()
+{
+	int ret = 0;
+
+	if (this->rows == 0) return 0;
+
+	// Pad the last byte of a packed block.
+	if (this->bitCount > 0)
+		this->putBits(0, 8 - this->bitCount);
+
+	this->block[0] = this->position & 0xff;
+	this->block[1] = this->position >> 8;
+	this->block[2] = this->flags;
+	this->block[3] = this->sequence++;
+	this->block[4] = this->channels;
+	this->block[5] = this->rows & 0xff;
+	this->block[6] = this->rows >> 8;
+
+	if (this->connection->write(this->position, this->block))
+	{
+		this->droppedBlocks++;
+		this->needKeyframe = true;
+		ret = ADB_TELEMETRY_DROPPED;
+	} else
+		this->encodedBytes += this->position;
+
+	this->startBlock();
+
+	return ret;
+}
+
+/**
+ * @return the number of values added.
+ */
+uint32_t AdbTelemetry::getSamples()
+{
+	return this->samples;
+}
+
+/**
+ * @return the number of bytes sent, including block headers. Compare to twice the number of samples for
+ * the compression ratio.
+ */
+uint32_t AdbTelemetry::getEncodedBytes()
+{
+	return this->encodedBytes;
+}
+
+/**
+ * @return the number of blocks that could not be sent.
+ */
+uint32_t AdbTelemetry::getDroppedBlocks()
+{
+	return this->droppedBlocks;
+}
@@ -0,0 +1,101 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbtelemetry_h__
+#define __adbtelemetry_h__
+
+#include <Adb.h>
+
+// Block header: total block length (16 bits), flags, sequence number, channel count, and row count (16
+// bits). Multi-byte fields are little-endian.
+#define ADB_TELEMETRY_HEADER_SIZE 7
+
+// Block flags.
+#define ADB_TELEMETRY_KEYFRAME 0x01
+#define ADB_TELEMETRY_PACKED 0x02
+
+// Default number of blocks from one keyframe to the next.
+#define ADB_TELEMETRY_KEYFRAME_INTERVAL 16
+
+// Result codes.
+#define ADB_TELEMETRY_DROPPED -1
+
+/**
+ * Compact encoding for streams of 16-bit sensor samples. Samples are added a row at a time (one value per
+ * channel) and collected into blocks, each of which is sent as a single WRTE. Within a block every value is
+ * stored as the difference to the previous value of its channel, zigzag encoded so that small negative
+ * differences stay small, and then written either as a varint or, with a bit width set, bit-packed with an
+ * escape code for larger differences. Slowly changing signals shrink to a byte or less per value.
+ *
+ * Keyframe blocks start with the absolute values, so that a decoder can pick up the stream there; they
+ * are sent periodically, and after a block could not be sent. Every block carries a sequence number, so
+ * the decoder can detect gaps. org.microbridge.server.TelemetryDecoder is the Java counterpart.
+ *
+ *   AdbTelemetry telemetry;
+ *
+ *   telemetry.begin(connection, 3, 128);
+ *   ...
+ *   telemetry.add(values);
+ */
+class AdbTelemetry
+{
+private:
+	Connection * connection;
+	uint8_t channels;
+
+	// Block being filled.
+	uint8_t * block;
+	uint16_t blockSize;
+	uint16_t position;
+	uint16_t rows;
+	uint8_t flags;
+	uint8_t sequence;
+
+	// Bit packer.
+	uint8_t bitWidth;
+	uint32_t bits;
+	uint8_t bitCount;
+
+	int16_t * previous;
+	uint8_t keyframeInterval;
+	uint8_t sinceKeyframe;
+	boolean needKeyframe;
+
+	uint32_t samples;
+	uint32_t encodedBytes;
+	uint32_t droppedBlocks;
+
+	void startBlock();
+	uint16_t rowSize(uint8_t width);
+	void putBits(uint32_t value, uint8_t count);
+	void putValue(uint32_t code);
+
+public:
+	AdbTelemetry();
+
+	boolean begin(Connection * connection, uint8_t channels, uint16_t blockSize);
+	void setKeyframeInterval(uint8_t blocks);
+	boolean setBitWidth(uint8_t bits);
+
+	int add(const int16_t * values);
+	int flush();
+
+	uint32_t getSamples();
+	uint32_t getEncodedBytes();
+	uint32_t getDroppedBlocks();
+};
+
+#endif
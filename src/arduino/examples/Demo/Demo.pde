@@ -42,7 +42,10 @@ void setup()
   ADB::init();
 
   // Open an ADB stream to the phone's shell. Auto-reconnect
-  connection = ADB::addConnection("tcp:4567", true, adbEventHandler);  
+  connection = ADB::addConnection_P(PSTR("tcp:4567"), true, adbEventHandler);  
+
+  // Queue samples while a previous write is waiting to be acknowledged.
+  connection->setTransmitBuffer(64);
 }
 
 void loop()
@@ -21,13 +21,19 @@ void setup()
   // Initialise the ADB subsystem.  
   ADB::init();
 
+  // Queue events so that printing to the serial port doesn't hold up the USB bus.
+  ADB::setEventQueue(8, 256);
+
   // Open an ADB stream to the phone's shell. Auto-reconnect
-  ADB::addConnection("shell:exec logcat", true, adbEventHandler);  
+  ADB::addConnection_P(PSTR("shell:exec logcat"), true, adbEventHandler);  
 }
 
 void loop()
 {
   // Poll the ADB subsystem.
   ADB::poll();
+
+  // Handle the events that were queued while polling.
+  ADB::dispatchEvents();
 }
 
@@ -14,7 +14,7 @@ void setup()
   ADB::init();
 
   // Open an ADB stream to the phone's shell. Auto-reconnect
-  shell = ADB::addConnection("shell:", true, NULL);  
+  shell = ADB::addConnection_P(PSTR("shell:"), true, NULL);  
 }
 
 void loop()
@@ -0,0 +1,71 @@
+#include <SPI.h>
+#include <Adb.h>
+#include <AdbRpc.h>
+#include <Servo.h>
+
+// Message types, generated from ServoRpc.idl with: tools/rpcgen.py ServoRpc.idl > ServoRpc.h
+#include "ServoRpc.h"
+
+// Servo control with typed messages instead of raw bytes. The phone sets the servo positions and can read
+// analog inputs; the sketch reports its status once per second.
+
+// Hardware servos
+Servo servos[2];
+
+AdbRpc rpc;
+
+// Elapsed time for status reports
+long lastTime;
+
+// Handler for servo positions from the phone.
+void setServos(const SetServos & message)
+{
+  servos[0].write(message.left);
+  servos[1].write(message.right);
+}
+
+// Handler for analog reads from the phone.
+void readAnalog(const ReadAnalog & request, ReadAnalogResponse & response)
+{
+  response.value = analogRead(request.pin);
+}
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Note start time
+  lastTime = millis();
+
+  // Attach servos
+  servos[0].attach(2);
+  servos[1].attach(3);
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Open the RPC stream to the phone, with frames of up to 32 bytes.
+  rpc.begin(PSTR("tcp:4567"), 32, 64);
+  rpc.setCrc(true);
+  rpc.on(setServos);
+  rpc.on(readAnalog);
+}
+
+void loop()
+{
+  Status status;
+
+  if ((millis() - lastTime) > 1000)
+  {
+    status.uptime = millis();
+    status.temperature = analogRead(A1) - 512;
+    status.moving = false;
+    rpc.send(status);
+    lastTime = millis();
+  }
+
+  // Poll the ADB subsystem.
+  ADB::poll();
+}
@@ -0,0 +1,86 @@
+// Generated by rpcgen.py from ServoRpc.idl, do not edit.
+
+#ifndef __servorpc_h__
+#define __servorpc_h__
+
+#include <AdbRpc.h>
+
+struct SetServos
+{
+	enum { METHOD = 1 };
+
+	uint8_t left;
+	uint8_t right;
+
+	void encode(RpcWriter & writer) const
+	{
+		writer.putVarint(left);
+		writer.putVarint(right);
+	}
+
+	void decode(RpcReader & reader)
+	{
+		left = reader.getVarint();
+		right = reader.getVarint();
+	}
+};
+
+struct ReadAnalogResponse
+{
+	enum { METHOD = 2 };
+
+	uint16_t value;
+
+	void encode(RpcWriter & writer) const
+	{
+		writer.putVarint(value);
+	}
+
+	void decode(RpcReader & reader)
+	{
+		value = reader.getVarint();
+	}
+};
+
+struct ReadAnalog
+{
+	enum { METHOD = 2 };
+	typedef ReadAnalogResponse Response;
+
+	uint8_t pin;
+
+	void encode(RpcWriter & writer) const
+	{
+		writer.putVarint(pin);
+	}
+
+	void decode(RpcReader & reader)
+	{
+		pin = reader.getVarint();
+	}
+};
+
+struct Status
+{
+	enum { METHOD = 3 };
+
+	uint32_t uptime;
+	int16_t temperature;
+	boolean moving;
+
+	void encode(RpcWriter & writer) const
+	{
+		writer.putVarint(uptime);
+		writer.putSigned(temperature);
+		writer.putByte(moving);
+	}
+
+	void decode(RpcReader & reader)
+	{
+		uptime = reader.getVarint();
+		temperature = reader.getSigned();
+		moving = reader.getByte();
+	}
+};
+
+#endif
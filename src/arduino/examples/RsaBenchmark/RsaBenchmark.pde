@@ -0,0 +1,128 @@
+#include <SPI.h>
+#include <Adb.h>
+#include <rsa.h>
+
+// Measures the time it takes to sign an ADB AUTH token, and the longest single step of the signature. The
+// library signs a step at a time from ADB::poll, so the total is added to the handshake time of every
+// connection to a phone that requires authentication, and the longest step to the time of a poll.
+
+// Test key generated with tools/adbkey.py. It is public, so never use it to authenticate to a real phone.
+
+static const uint8_t adbPrivateKey[] PROGMEM = {
+	0x59, 0x33, 0x76, 0x89, 0xdc, 0x1f, 0xc7, 0x5c, 0x41, 0x6a, 0xc3, 0x5d, 0xea, 0x9b, 0xa2, 0xfc,
+	0x7e, 0xe3, 0x55, 0x07, 0x8e, 0x63, 0x7c, 0x3e, 0x46, 0xd3, 0xd3, 0x62, 0x6c, 0x75, 0x57, 0x93,
+	0x1c, 0x80, 0xf5, 0xb0, 0xf8, 0x22, 0xf4, 0x05, 0x68, 0x3d, 0x13, 0xd1, 0x05, 0xa0, 0x5a, 0xa0,
+	0x34, 0xb6, 0xdf, 0x99, 0x91, 0x4c, 0x47, 0x46, 0xbb, 0x13, 0x80, 0x9a, 0xf0, 0x0c, 0x07, 0xd7,
+	0x27, 0xf6, 0x91, 0x0c, 0xa0, 0xf9, 0xac, 0xd8, 0x32, 0xb5, 0xbd, 0x1e, 0xf4, 0x40, 0x94, 0x93,
+	0xcb, 0xf6, 0x39, 0xe7, 0xe6, 0x03, 0x87, 0x63, 0x41, 0x98, 0xfe, 0x8e, 0x9b, 0x0b, 0x67, 0x99,
+	0x76, 0xae, 0x4c, 0x0c, 0xe7, 0xfd, 0x5c, 0x8a, 0x29, 0x05, 0x08, 0xe9, 0xba, 0xc9, 0x90, 0xb7,
+	0xa0, 0x4e, 0xf7, 0xb4, 0xea, 0x2d, 0xfd, 0xaf, 0x0d, 0x95, 0xaa, 0x33, 0xc7, 0xe3, 0x0a, 0xd7,
+	0xc1, 0x70, 0x32, 0x12, 0x36, 0x6b, 0xdc, 0x02, 0xe0, 0xa3, 0x5c, 0x01, 0x20, 0x2a, 0x0b, 0x08,
+	0x61, 0x09, 0x98, 0xb6, 0xb2, 0x1f, 0x6a, 0x27, 0x8d, 0x06, 0xe6, 0x2e, 0xb8, 0x39, 0xb6, 0xa6,
+	0xe7, 0x70, 0xc2, 0x8e, 0x92, 0x86, 0x52, 0xf9, 0x81, 0x18, 0x83, 0x69, 0xed, 0x46, 0xae, 0xc3,
+	0xa1, 0x6b, 0x5c, 0x0b, 0xfd, 0x30, 0x9d, 0xfd, 0x95, 0xc3, 0xc2, 0x12, 0xb9, 0x64, 0xaf, 0xe3,
+	0xd5, 0x02, 0xfa, 0x79, 0x6d, 0xfb, 0x92, 0x43, 0xa4, 0x7b, 0xa5, 0xa7, 0xb3, 0xf5, 0x28, 0xe2,
+	0x8a, 0x4c, 0xd4, 0x15, 0xf5, 0xcf, 0x22, 0xf0, 0x75, 0x20, 0xa5, 0xc2, 0xcc, 0xed, 0xd4, 0x65,
+	0xd4, 0x3e, 0x34, 0xf7, 0x13, 0x33, 0x59, 0x71, 0x6f, 0x75, 0x18, 0x37, 0x4f, 0xbe, 0xbf, 0x4d,
+	0x1f, 0x28, 0xb5, 0xa6, 0x74, 0xd6, 0x8f, 0x57, 0x08, 0x81, 0x4e, 0x11, 0xbc, 0x1f, 0xb6, 0xc3,
+	0x61, 0x36, 0xa3, 0xf5, 0xed, 0x8a, 0xaf, 0x25, 0x7a, 0x87, 0xa5, 0x66, 0xd6, 0xd3, 0xcb, 0x09,
+	0xc5, 0x03, 0xfc, 0x5a, 0xc2, 0x5c, 0x8d, 0x6e, 0x2b, 0xc6, 0xc5, 0x32, 0x10, 0x1e, 0x56, 0x6d,
+	0x4b, 0x6f, 0x23, 0x73, 0x9d, 0xf4, 0x8a, 0xb5, 0xed, 0x60, 0x89, 0x3a, 0x41, 0x13, 0x87, 0x87,
+	0x83, 0xe2, 0x19, 0x42, 0x42, 0x95, 0x38, 0xdf, 0x9e, 0xa0, 0x7f, 0x3f, 0x2a, 0x0e, 0x95, 0x1d,
+	0x56, 0x55, 0xa4, 0x9e, 0xc1, 0x47, 0xd8, 0xbc, 0xe1, 0xbb, 0x23, 0xd1, 0xb4, 0xe3, 0x3f, 0x82,
+	0xd0, 0xb7, 0xfc, 0x7d, 0x90, 0x49, 0x61, 0x41, 0xe0, 0x65, 0x8f, 0x06, 0x55, 0x83, 0x80, 0x35,
+	0x2a, 0x8a, 0xa0, 0xed, 0x6b, 0x8d, 0x41, 0x31, 0xab, 0xa4, 0x0e, 0xdc, 0xdd, 0x9e, 0xf1, 0xc3,
+	0x7b, 0x8b, 0x62, 0x76, 0x24, 0xe7, 0xec, 0xf8, 0xba, 0x79, 0xe6, 0x58, 0xdb, 0x19, 0xb0, 0x42,
+	0x41, 0xdc, 0x47, 0xc4, 0xc7, 0x31, 0x71, 0xd6, 0x6f, 0x1e, 0x51, 0xd6, 0x2d, 0xaf, 0x98, 0x26,
+	0xf9, 0x09, 0xe4, 0x67, 0x58, 0x1b, 0xe6, 0xcd, 0x98, 0x1c, 0xfe, 0xe9, 0x93, 0x13, 0x7e, 0x5c,
+	0x0c, 0x05, 0xb0, 0xf8, 0xa2, 0xec, 0x35, 0x4a, 0x28, 0xc8, 0xb5, 0x8e, 0xc7, 0xa7, 0x9e, 0x42,
+	0x5c, 0x43, 0x66, 0xfa, 0x6a, 0x8d, 0x9d, 0x36, 0xbe, 0x8b, 0x55, 0xe5, 0x77, 0x95, 0x4e, 0xce,
+	0x7f, 0xa5, 0x5e, 0xf0, 0x14, 0x21, 0xe4, 0xdc, 0xe7, 0x91, 0x99, 0x1c, 0x0a, 0xce, 0xfe, 0xea,
+	0xe3, 0xed, 0xc3, 0x42, 0x23, 0xb5, 0x29, 0xb2, 0x9f, 0x26, 0xc9, 0x38, 0x83, 0x14, 0x76, 0x9a,
+	0x70, 0x8b, 0x1f, 0x85, 0xb4, 0x81, 0xd7, 0xf4, 0x4d, 0x67, 0xa7, 0xf1, 0xf1, 0xe0, 0x78, 0x64,
+	0x13, 0x9b, 0xb3, 0xbc, 0xd5, 0xf0, 0xa9, 0x61, 0xf4, 0x96, 0x7a, 0xcc, 0x62, 0x8b, 0x60, 0x11,
+	0x04, 0x3e, 0x5d, 0x41, 0x1b, 0x4f, 0xba, 0xb5, 0x7c, 0x83, 0xeb, 0xd2, 0xc3, 0x75, 0x84, 0xac,
+	0x47, 0x10, 0x48, 0x22, 0x1d, 0x39, 0x5c, 0x04, 0x6e, 0x02, 0x9f, 0x89, 0x8d, 0xbc, 0xd6, 0xc7,
+	0x6b, 0xd3, 0x4e, 0x20, 0xab, 0x30, 0x19, 0xd0, 0x68, 0xbc, 0xf4, 0x3d, 0x4f, 0xa3, 0xab, 0xc6,
+	0x7f, 0x9f, 0xb3, 0x95, 0x2d, 0xec, 0x7d, 0x46, 0x47, 0xf6, 0x4f, 0x59, 0x33, 0x34, 0xf2, 0x9d,
+	0x98, 0x17, 0xcf, 0xf4, 0x6b, 0x9c, 0x2d, 0xb5, 0x7a, 0xdf, 0x7c, 0x56, 0xab, 0xee, 0x2c, 0x6f,
+	0xa1, 0x30, 0x72, 0x0c, 0x83, 0xd5, 0x5c, 0x4f, 0x44, 0x87, 0x63, 0x66, 0x2f, 0xf2, 0x84, 0x7c,
+	0x18, 0x69, 0x2c, 0xf3, 0x7f, 0x7a, 0xfb, 0xdc, 0xa8, 0x7e, 0x0f, 0xc2, 0x68, 0xa8, 0x12, 0x87,
+	0xff, 0x9e, 0xd4, 0x72, 0xfd, 0xa6, 0xde, 0xb5, 0x87, 0x36, 0x19, 0xf7, 0xd6, 0xf2, 0x1e, 0x62,
+	0x50, 0xd7, 0xa2, 0x09, 0x93, 0xbe, 0xf3, 0x9d, 0x9e, 0xc6, 0x16, 0x34, 0x23, 0x94, 0xf2, 0xab,
+	0x4c, 0xad, 0xa9, 0x4a, 0x72, 0x9b, 0x03, 0x4c, 0xba, 0xe6, 0xb8, 0x88, 0x2f, 0x62, 0xad, 0x1e,
+	0x76, 0x53, 0x77, 0xca, 0x92, 0xe0, 0x9c, 0xb4, 0x39, 0xaa, 0x27, 0x01, 0x9c, 0xd6, 0xe7, 0x73,
+	0x05, 0x24, 0xa1, 0xbe, 0x10, 0x34, 0x3c, 0xda, 0x20, 0x2c, 0xea, 0x04, 0x28, 0xb2, 0x28, 0x1c,
+	0xc6, 0x06, 0x32, 0x64, 0x26, 0x73, 0xda, 0xba, 0xf1, 0xd3, 0xd8, 0xe3, 0x8f, 0x8a, 0x2c, 0x45,
+	0x9c, 0xa6, 0x6a, 0x2d, 0x44, 0x79, 0x01, 0xac, 0x0f, 0xf3, 0x16, 0xbb, 0x2e, 0x4f, 0x25, 0x7a,
+	0xe4, 0x46, 0xcb, 0x2d, 0xa7, 0x9f, 0x80, 0xf2, 0x01, 0x36, 0x28, 0xb5, 0x5e, 0xee, 0x39, 0x62,
+	0x5e, 0x74, 0x44, 0x5c, 0x0b, 0xc2, 0xec, 0x4f, 0x3b, 0xa4, 0x00, 0xc7, 0xda, 0x80, 0x1a, 0x36,
+	0xaf, 0xdb, 0x06, 0x32, 0x4e, 0x10, 0xf8, 0x57, 0xa2, 0x86, 0xb4, 0x26, 0xe4, 0x35, 0xa0, 0x49,
+	0x4f, 0xaa, 0x47, 0x5b, 0x42, 0x63, 0x00, 0xa9, 0x3b, 0x1f, 0xc9, 0xdc, 0xd5, 0x08, 0x0c, 0x7e,
+	0x71, 0x30, 0x17, 0xae, 0x14, 0x98, 0x57, 0x62, 0x84, 0xc6, 0xe0, 0x73, 0x76, 0x19, 0x9f, 0x49,
+	0x73, 0x56, 0x96, 0x2f, 0x26, 0x98, 0x9f, 0x11, 0x3d, 0x12, 0xe1, 0x20, 0xc3, 0x2e, 0x40, 0x45,
+	0x1c, 0x54, 0x08, 0xae, 0x3f, 0x70, 0x33, 0x71, 0x79, 0x22, 0xb6, 0xdc, 0x08, 0x41, 0xe7, 0xfe,
+	0x1d, 0x08, 0x79, 0xa9, 0x23, 0x1f, 0xb8, 0x81, 0x3f, 0xba, 0x01, 0x93, 0x6b, 0x6d, 0x49, 0x40,
+	0xf5, 0xd5, 0x7e, 0x43, 0x90, 0x14, 0x38, 0xac, 0x76, 0x5a, 0x66, 0xd4, 0x51, 0x57, 0xc1, 0x3a,
+	0xaf, 0x48, 0x96, 0x3d, 0xc7, 0x4b, 0x10, 0x81, 0x4d, 0xdc, 0xb3, 0x11, 0x6c, 0x08, 0x19, 0x2a,
+	0x17, 0xbf,
+};
+
+static const char adbPublicKey[] PROGMEM =
+	"QAAAANepwwMZpvWh37GtA9RfH8aVVQmo2tpG+7djG2dMFB/VZhrAKKlwIaFKgdI6tBw8hfs7wADKHju4XBLE+QCJ3/cPptqd"
+	"SKvGgoyxyaNYaUUzlS2gYhqsM5ZZUTqrehsJyV+XQIgwGNO0Vi81Gc2QHHD3HE6xwY1FDCMCY6OWYx/Bft+obf+RSslN2M3g"
+	"uyrzfbI/rbLm5sm8h1+4ip9P/g3vo2FzWW+KQl/llqyvp5wXKqvtD8Tsa/dBUohqten9UBdW9hBZfaz79Z9vV0z+hUeKgR+o"
+	"FIqTSuK8xIXjNxnz8/Nt5qSp7jbb9FZnGlr2fD/ItvPI9rM+Gi7nHTC7F/jmR2akJNqE028EqyPzrQqRmGJHksaY+Sfz1l7+"
+	"62MEkN6hHNKJLnj0UtYQJDMVWvYQM5pNdFKkpnN/5j1AnzgUmUnhiUCYHWlXkapw83QNVzOY3P8WcP1CMmQXcelSq0vrsyDL"
+	"ulKjK+O9TfGBfhRjHk/F3fJdy9F8vSsPngjLisUMdp1nsZ8jkswsFVNfmo7EEVoTr6RFpBVu/Q5BjKwPzrF+F172ADfhelug"
+	"0rP/reYM6uUqyVjGWFGBkPMlDdvIGSzzXmUo41CZE/uO3OPKNjvkUGTGgVtWIyATrAMw+M8FYInNYaSOU6XILi0WdSO5wGt8"
+	"6uxCRJU7BPcKQlzibDahEAEAAQA= benchmark@microbridge";
+
+// Signature state, too large for the stack.
+static rsa_context context;
+
+void setup()
+{
+  uint8_t token[RSA_DIGEST_SIZE];
+  rsa_key key = { adbPrivateKey, RSA_STORAGE_FLASH };
+  unsigned long start, stepStart, step, longest = 0, steps = 0, elapsed;
+  int i;
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  for (i = 0; i < RSA_DIGEST_SIZE; i++)
+    token[i] = i;
+
+  start = millis();
+  rsa_signBegin(&context, &key, token);
+  do
+  {
+    stepStart = micros();
+    i = rsa_signStep(&context);
+    step = micros() - stepStart;
+    if (step > longest) longest = step;
+    steps++;
+  } while (i == RSA_BUSY);
+  elapsed = millis() - start;
+
+  Serial.print("RSA-2048 signature in ");
+  Serial.print(elapsed);
+  Serial.print(" ms, ");
+  Serial.print(steps);
+  Serial.print(" steps, longest step ");
+  Serial.print(longest);
+  Serial.println(" us");
+
+  // Print the signature, so it can be checked against a reference implementation.
+  for (i = 0; i < RSA_MODULUS_SIZE; i++)
+  {
+    if (context.signature[i] < 0x10) Serial.print('0');
+    Serial.print(context.signature[i], HEX);
+  }
+  Serial.println();
+}
+
+void loop()
+{
+}
@@ -0,0 +1,75 @@
+#include <SPI.h>
+#include <Adb.h>
+#include <AdbSampler.h>
+
+// Samples three analog inputs at 2kHz in the background and streams them to the phone in buffers of 32
+// rows. The serial port shows how many buffers were sent and lost, so the rate can be matched to the link.
+
+const uint8_t pins[] = { A0, A1, A2 };
+
+AdbSampler sampler;
+
+// The sampler runs off these interrupts; the library leaves the vectors to the sketch.
+ISR(TIMER2_COMPA_vect)
+{
+  AdbSampler::timerInterrupt();
+}
+
+ISR(ADC_vect)
+{
+  AdbSampler::adcInterrupt();
+}
+
+// Adb connection.
+Connection * connection;
+
+// Elapsed time for statistics
+long lastTime;
+
+// Event handler for the sample stream. Sample only while someone is listening.
+void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+  if (event == ADB_CONNECTION_OPEN)
+    sampler.start();
+  else if (event == ADB_CONNECTION_CLOSE || event == ADB_CONNECTION_FAILED)
+    sampler.stop();
+}
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Note start time
+  lastTime = millis();
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Open an ADB stream to the phone. Auto-reconnect. No transmit queue: buffers are sent in place.
+  connection = ADB::addConnection_P(PSTR("tcp:4569"), true, adbEventHandler);
+
+  // 3 channels at 2kHz, 32 rows (264 bytes) per write.
+  if (!sampler.begin(connection, pins, 3, 2000, 32))
+    Serial.println("sampler setup failed");
+}
+
+void loop()
+{
+
+  if ((millis() - lastTime) > 1000)
+  {
+    Serial.print("sent: ");
+    Serial.print(sampler.getSentBuffers());
+    Serial.print(" dropped: ");
+    Serial.print(sampler.getDroppedBuffers());
+    Serial.print(" overruns: ");
+    Serial.println(sampler.getOverruns());
+    lastTime = millis();
+  }
+
+  // Hand full buffers to ADB, then poll the ADB subsystem.
+  sampler.poll();
+  ADB::poll();
+}
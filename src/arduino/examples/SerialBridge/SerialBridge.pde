@@ -0,0 +1,66 @@
+#include <SPI.h>
+#include <Adb.h>
+#include <AdbBridge.h>
+
+// Connects a serial device on Serial1 (Mega ADK) at 1 Mbaud to a TCP port on the phone, with RTS on pin 8
+// and CTS on pin 9. Throughput and the latency added by batching are printed on the serial monitor.
+
+AdbBridge bridge;
+
+// Adb connection.
+Connection * connection;
+
+// Elapsed time for statistics
+long lastTime;
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Note start time
+  lastTime = millis();
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Open an ADB stream to the phone. Auto-reconnect
+  connection = ADB::addConnection_P(PSTR("tcp:4570"), true, NULL);
+
+  // Bridge Serial1 with 512 bytes of buffering in each direction.
+  bridge.begin(connection, &Serial1, 1000000, 512);
+  bridge.setFlowControl(8, 9);
+
+  // Send 128 bytes at a time, or whatever arrived within a millisecond.
+  bridge.setBatching(128, 1000);
+}
+
+void loop()
+{
+  uint32_t elapsed;
+
+  if ((millis() - lastTime) > 5000)
+  {
+    elapsed = bridge.getElapsed();
+
+    Serial.print("to phone: ");
+    Serial.print(bridge.getBytesToAdb() * 1000 / elapsed);
+    Serial.print(" B/s in ");
+    Serial.print(bridge.getWrites());
+    Serial.print(" writes, to device: ");
+    Serial.print(bridge.getBytesToSerial() * 1000 / elapsed);
+    Serial.print(" B/s, latency avg/max: ");
+    Serial.print(bridge.getAverageLatency());
+    Serial.print("/");
+    Serial.print(bridge.getMaxLatency());
+    Serial.println(" us");
+
+    bridge.resetStatistics();
+    lastTime = millis();
+  }
+
+  // Move serial data, then poll the ADB subsystem for at most 300us so the serial buffers don't overflow.
+  bridge.poll();
+  ADB::poll(1, 300);
+}
@@ -24,7 +24,7 @@ void setup()
   ADB::init();
 
   // Open an ADB stream to the phone's shell. Auto-reconnect
-  shell = ADB::addConnection("shell:", true, adbEventHandler);  
+  shell = ADB::addConnection_P(PSTR("shell:"), true, adbEventHandler);  
 }
 
 void loop()
@@ -0,0 +1,54 @@
+#include <SPI.h>
+#include <Adb.h>
+#include <AdbShell.h>
+
+// Runs a few commands in one persistent shell on the phone. All commands are sent at once, and the output of
+// each one is printed as it comes in, followed by its exit code.
+
+AdbShell shell;
+boolean started = false;
+
+// Handler for the output of a command. The context is the command line.
+void printOutput(void * context, int status, uint16_t length, uint8_t * data)
+{
+  int i;
+
+  if (status == ADB_SHELL_OUTPUT)
+  {
+    for (i=0; i<length; i++)
+      Serial.print(data[i]);
+  } else
+  {
+    Serial.print((char*)context);
+    Serial.print(" exited with ");
+    Serial.println(status);
+  }
+}
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Open a persistent shell, with room for a few commands in flight.
+  shell.begin(PSTR("shell:"), 256);
+}
+
+void loop()
+{
+  // Poll the ADB subsystem.
+  ADB::poll();
+
+  // Queue the commands once the shell is open, without waiting for each other.
+  if (!started && shell.getConnection()->isOpen())
+  {
+    shell.run("getprop ro.product.model", printOutput, (void*)"getprop");
+    shell.run("uptime", printOutput, (void*)"uptime");
+    shell.run("ls /sdcard", printOutput, (void*)"ls");
+    started = true;
+  }
+}
@@ -0,0 +1,62 @@
+#include <SPI.h>
+#include <SD.h>
+#include <Adb.h>
+#include <AdbSync.h>
+
+// Copies a log file from the SD card to the phone using the ADB sync protocol, the same protocol 'adb push'
+// uses. The file is streamed in 512-byte chunks, so it can be much larger than the available SRAM.
+
+AdbSync adbSync;
+File logFile;
+boolean done = false;
+
+// Reads the next chunk of the log file.
+int readLog(void * context, uint8_t * buffer, uint16_t length)
+{
+  return ((File*)context)->read(buffer, length);
+}
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Initialise the SD card. The chip select pin depends on the shield.
+  SD.begin(4);
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Open a sync stream to the phone.
+  adbSync.begin(512);
+}
+
+void loop()
+{
+  // Poll the ADB subsystem.
+  ADB::poll();
+
+  // Send the next chunk of the file.
+  adbSync.poll();
+
+  // Start the transfer once the sync stream is open.
+  if (!done && !logFile && adbSync.getConnection()->isOpen())
+  {
+    logFile = SD.open("LOG.TXT");
+    if (logFile && adbSync.push("/sdcard/log.txt", 0644, 0, readLog, &logFile) != ADB_SYNC_SUCCESS)
+      logFile.close();
+  }
+
+  // Report the result once the transfer is done.
+  if (!done && logFile && !adbSync.isBusy())
+  {
+    logFile.close();
+    done = true;
+
+    Serial.print("Sent ");
+    Serial.print(adbSync.getTransferred());
+    Serial.print(" bytes, result ");
+    Serial.println(adbSync.getResult());
+  }
+}
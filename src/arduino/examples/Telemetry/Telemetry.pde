@@ -0,0 +1,77 @@
+#include <SPI.h>
+#include <Adb.h>
+#include <AdbTelemetry.h>
+
+// Streams three analog inputs to the phone with delta encoding, and reports the compression ratio and the
+// encoding cost over the serial port. Decode on the phone with org.microbridge.server.TelemetryDecoder.
+
+#define CHANNELS 3
+#define SAMPLE_INTERVAL 2
+
+Connection * connection;
+AdbTelemetry telemetry;
+
+// Time of the last sample and the last report
+unsigned long lastSample, lastReport;
+
+// Time spent encoding since the last report
+unsigned long encodeTime, encodeRows;
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Open an ADB stream to the phone. Auto-reconnect
+  connection = ADB::addConnection("tcp:4568", true, NULL);
+
+  // Queue blocks while the previous one is in flight.
+  connection->setTransmitBuffer(512);
+
+  // Blocks of up to 128 bytes, 4 bits per value.
+  telemetry.begin(connection, CHANNELS, 128);
+  telemetry.setBitWidth(4);
+
+  lastSample = lastReport = millis();
+}
+
+void loop()
+{
+  int16_t values[CHANNELS];
+  unsigned long start;
+
+  if (millis() - lastSample >= SAMPLE_INTERVAL && connection->isOpen())
+  {
+    lastSample += SAMPLE_INTERVAL;
+
+    values[0] = analogRead(A0);
+    values[1] = analogRead(A1);
+    values[2] = analogRead(A2);
+
+    start = micros();
+    telemetry.add(values);
+    encodeTime += micros() - start;
+    encodeRows++;
+  }
+
+  if (millis() - lastReport > 5000 && telemetry.getEncodedBytes() > 0)
+  {
+    // Raw samples take two bytes each.
+    Serial.print("ratio x100: ");
+    Serial.print(200 * telemetry.getSamples() / telemetry.getEncodedBytes());
+    Serial.print(" cycles/sample: ");
+    Serial.print(encodeRows ? encodeTime * (F_CPU / 1000000) / (encodeRows * CHANNELS) : 0);
+    Serial.print(" dropped: ");
+    Serial.println(telemetry.getDroppedBlocks());
+
+    encodeTime = encodeRows = 0;
+    lastReport = millis();
+  }
+
+  // Poll the ADB subsystem.
+  ADB::poll();
+}
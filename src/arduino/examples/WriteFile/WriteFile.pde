@@ -12,7 +12,7 @@ void setup()
 
   // Execute the UNIX shell command 'echo "hello world" > /sdcard/hello', which creates a
   // new text file on the sd card called 'hello', containing the text 'hello world'.
-  ADB::addConnection("shell:echo \"hello world\" > /sdcard/hello", false, NULL);
+  ADB::addConnection_P(PSTR("shell:echo \"hello world\" > /sdcard/hello"), false, NULL);
 }
 
 void loop()
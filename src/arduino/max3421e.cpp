@@ -197,6 +197,40 @@ uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values)
 	return (values);
 }
 
+/**
+ * Writes multiple bytes stored in program memory (flash) to a register. This allows constant data such
+ * as ADB connection strings to be streamed into the FIFO without first copying them into SRAM.
+ *
+ * @param reg register address.
+ * @param count number of bytes to write.
+ * @param values input values, in program memory.
+ * @return a pointer to values, incremented by the number of bytes written (values + length).
+ */
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values)
+{
+	// Pull slave select low to indicate start of transfer.
+	MAX_SS(0);
+
+	// Transfer command byte, 0x02 indicates write.
+	SPDR = (reg | 0x02);
+	while (!(SPSR & (1 << SPIF)));
+
+	// Transfer values.
+	while (count--)
+	{
+		// Send next value byte.
+		SPDR = pgm_read_byte(values);
+		while (!(SPSR & (1 << SPIF)));
+
+		values++;
+	}
+
+	// Pull slave select high to indicate end of transfer.
+	MAX_SS(1);
+
+	return (values);
+}
+
 /**
  * Reads a single register.
  *
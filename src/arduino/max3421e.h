@@ -31,6 +31,7 @@ limitations under the License.#include <string.h>
 
 #include "max3421e_constants.h"
 #include "pins_arduino.h"
+#include <avr/pgmspace.h>
 
 /**
  * Max3421e registers in host mode.
@@ -87,6 +88,7 @@ typedef enum
 void max3421e_init();
 void max3421e_write(uint8_t reg, uint8_t val);
 uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values);
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values);
 void max3421e_gpioWr(uint8_t val);
 uint8_t max3421e_read(uint8_t reg);
 uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values);
@@ -0,0 +1,526 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+/**
+ *
+ * RSA-2048 private key operation for ADB authentication. The signature is computed with the Chinese
+ * Remainder Theorem, so the expensive part is two 1024-bit modular exponentiations. These use Montgomery
+ * multiplication with 8-bit limbs, which maps directly onto the 8x8 bit hardware multiplier of the AVR,
+ * and sliding window exponentiation.
+ *
+ * The key is never copied into SRAM as a whole. Only the prime that is being worked with is, and exponent
+ * bits are read from program memory or EEPROM as they are needed.
+ *
+ * A signature takes tens of seconds, so it is computed a step at a time, at most one row of a Montgomery
+ * multiplication per step, and the caller decides how many steps to take between other work.
+ *
+ */
+
+#include <string.h>
+#include <avr/eeprom.h>
+#include <rsa.h>
+
+// PKCS#1 v1.5 DigestInfo prefix for SHA-1.
+static const uint8_t sha1DigestInfo[] PROGMEM = {
+	0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14
+};
+
+/**
+ * Reads a byte of a private key.
+ *
+ * @param key private key.
+ * @param offset offset into the key.
+ * @return the byte at the given offset.
+ */
+static uint8_t rsa_keyByte(const rsa_key * key, uint16_t offset)
+{
+	if (key->storage == RSA_STORAGE_EEPROM)
+		return eeprom_read_byte(key->data + offset);
+	else
+		return pgm_read_byte(key->data + offset);
+}
+
+/**
+ * Copies a number from a private key into SRAM.
+ *
+ * @param key private key.
+ * @param offset offset of the number in the key.
+ * @param target target buffer of RSA_LIMBS bytes.
+ */
+static void rsa_keyRead(const rsa_key * key, uint16_t offset, uint8_t * target)
+{
+	if (key->storage == RSA_STORAGE_EEPROM)
+		eeprom_read_block(target, key->data + offset, RSA_LIMBS);
+	else
+		memcpy_P(target, key->data + offset, RSA_LIMBS);
+}
+
+/**
+ * Subtracts b from a, in place.
+ *
+ * @return the borrow.
+ */
+static uint8_t rsa_sub(uint8_t * a, const uint8_t * b)
+{
+	uint16_t d;
+	uint8_t borrow = 0;
+	uint8_t i;
+
+	for (i = 0; i < RSA_LIMBS; i++)
+	{
+		d = (uint16_t)a[i] - b[i] - borrow;
+		a[i] = d;
+		borrow = (d >> 8) & 1;
+	}
+
+	return borrow;
+}
+
+/**
+ * Adds b to a, in place.
+ *
+ * @return the carry.
+ */
+static uint8_t rsa_add(uint8_t * a, const uint8_t * b)
+{
+	uint16_t s;
+	uint8_t carry = 0;
+	uint8_t i;
+
+	for (i = 0; i < RSA_LIMBS; i++)
+	{
+		s = (uint16_t)a[i] + b[i] + carry;
+		a[i] = s;
+		carry = s >> 8;
+	}
+
+	return carry;
+}
+
+/**
+ * Compares two numbers.
+ *
+ * @return true iff a >= b.
+ */
+static bool rsa_greaterOrEqual(const uint8_t * a, const uint8_t * b)
+{
+	uint8_t i = RSA_LIMBS;
+
+	while (i-- > 0)
+		if (a[i] != b[i]) return a[i] > b[i];
+
+	return true;
+}
+
+// Steps of the signature.
+#define RSA_STATE_PRIME 0
+#define RSA_STATE_REDUCE 1
+#define RSA_STATE_SQUARE_BASE 2
+#define RSA_STATE_TABLE 3
+#define RSA_STATE_SCAN 4
+#define RSA_STATE_WINDOW 5
+#define RSA_STATE_FINISH 6
+#define RSA_STATE_NEXT_PRIME 7
+#define RSA_STATE_COMBINE 8
+#define RSA_STATE_COMBINE_R2 9
+#define RSA_STATE_PRODUCT 10
+#define RSA_STATE_DONE 11
+
+/**
+ * One row of a Montgomery multiplication: t = (t + ai * b + u * m) / 256, with u chosen so that the division
+ * is exact. This is the finely integrated operand scanning (FIOS) variant, where the multiplication by a
+ * limb of a and the reduction step are done in the same pass over the operands. The two products are
+ * accumulated with separate carries so that everything stays within 16 bits.
+ *
+ * On the AVR the pass over the limbs is written out in assembly, 25 cycles per limb for the two 8x8
+ * multiplications. Y is borrowed to address t, since X and Z step through b and m.
+ *
+ * @param t accumulator, RSA_LIMBS + 1 bytes.
+ * @param ai limb of the first operand.
+ * @param b second operand.
+ * @param m modulus.
+ * @param mInv -m^-1 mod 256.
+ */
+static void rsa_montMulRow(uint8_t * t, uint8_t ai, const uint8_t * b, const uint8_t * m, uint8_t mInv)
+{
+	uint16_t s1, s2;
+	uint8_t u, c1, c2;
+
+	// Pick u so that the lowest limb becomes zero and can be shifted out.
+	s1 = t[0] + (uint16_t)ai * b[0];
+	u = (uint8_t)s1 * mInv;
+	s2 = (uint8_t)s1 + (uint16_t)u * m[0];
+	c1 = s1 >> 8;
+	c2 = s2 >> 8;
+
+#if defined(__AVR__)
+	const uint8_t * bp = b + 1;
+	const uint8_t * mp = m + 1;
+	uint8_t count = RSA_LIMBS - 1;
+	uint8_t limb, zero;
+
+	// s1 holds the carry of the first product in its high byte.
+	s1 = (uint16_t)c1 << 8;
+
+	asm volatile(
+		"push r28" "\n\t"
+		"push r29" "\n\t"
+		"movw r28, %[t]" "\n\t"
+		"clr %[zero]" "\n"
+		"1:" "\n\t"
+		// s1 = t[j] + ai * b[j] + c1
+		"ld %[limb], X+" "\n\t"
+		"mul %[ai], %[limb]" "\n\t"
+		"ldd %[limb], Y+1" "\n\t"
+		"add r0, %[limb]" "\n\t"
+		"adc r1, %[zero]" "\n\t"
+		"add r0, %B[s1]" "\n\t"
+		"adc r1, %[zero]" "\n\t"
+		"movw %A[s1], r0" "\n\t"
+		// s2 = (s1 & 0xff) + u * m[j] + c2, t[j - 1] = s2 & 0xff
+		"ld %[limb], Z+" "\n\t"
+		"mul %[u], %[limb]" "\n\t"
+		"add r0, %A[s1]" "\n\t"
+		"adc r1, %[zero]" "\n\t"
+		"add r0, %[c2]" "\n\t"
+		"adc r1, %[zero]" "\n\t"
+		"st Y+, r0" "\n\t"
+		"mov %[c2], r1" "\n\t"
+		"dec %[count]" "\n\t"
+		"brne 1b" "\n\t"
+		"clr r1" "\n\t"
+		"pop r29" "\n\t"
+		"pop r28" "\n\t"
+		: [s1] "+a" (s1), [c2] "+a" (c2), [count] "+a" (count), [limb] "=&a" (limb), [zero] "=&a" (zero),
+		  [bp] "+x" (bp), [mp] "+z" (mp)
+		: [t] "l" (t), [ai] "l" (ai), [u] "l" (u)
+		: "r0", "memory"
+	);
+
+	c1 = s1 >> 8;
+#else
+	uint8_t j;
+
+	for (j = 1; j < RSA_LIMBS; j++)
+	{
+		s1 = t[j] + (uint16_t)ai * b[j] + c1;
+		s2 = (uint8_t)s1 + (uint16_t)u * m[j] + c2;
+		t[j - 1] = s2;
+		c1 = s1 >> 8;
+		c2 = s2 >> 8;
+	}
+#endif
+
+	s1 = t[RSA_LIMBS] + c1 + c2;
+	t[RSA_LIMBS - 1] = s1;
+	t[RSA_LIMBS] = s1 >> 8;
+}
+
+/**
+ * Starts a Montgomery multiplication, r = a * b * R^-1 mod m with R = 2^1024, which rsa_signStep carries
+ * out a row at a time. The inputs must be smaller than m and must not change until it is done; the result
+ * may alias either of them.
+ *
+ * @param context signature state.
+ * @param r result.
+ * @param a first operand.
+ * @param b second operand.
+ * @param next state to continue with once the multiplication is done.
+ */
+static void rsa_montMul(rsa_context * context, uint8_t * r, const uint8_t * a, const uint8_t * b, uint8_t next)
+{
+	memset(context->t, 0, sizeof(context->t));
+	context->mulResult = r;
+	context->mulA = a;
+	context->mulB = b;
+	context->mulRow = 0;
+	context->multiplying = true;
+	context->state = next;
+}
+
+/**
+ * Reads a bit of an exponent in a private key.
+ *
+ * @param key private key.
+ * @param offset offset of the exponent in the key.
+ * @param bit bit index.
+ */
+static uint8_t rsa_exponentBit(const rsa_key * key, uint16_t offset, uint16_t bit)
+{
+	return (rsa_keyByte(key, offset + (bit >> 3)) >> (bit & 7)) & 1;
+}
+
+/**
+ * Loads the modulus and Montgomery constants of a prime.
+ *
+ * @return false if the key is invalid.
+ */
+static bool rsa_loadPrime(rsa_context * context, uint8_t prime)
+{
+	rsa_keyRead(&context->key, prime ? RSA_KEY_Q : RSA_KEY_P, context->m);
+	rsa_keyRead(&context->key, prime ? RSA_KEY_R2Q : RSA_KEY_R2P, context->r2);
+	context->mInv = rsa_keyByte(&context->key, prime ? RSA_KEY_QINV_MONT : RSA_KEY_PINV);
+
+	return (context->m[0] & 1) != 0 && (context->m[RSA_LIMBS - 1] & 0x80) != 0;
+}
+
+/**
+ * Copies half of the padded message, brought below m. Since the top bit of m is set, one subtraction is
+ * enough.
+ */
+static void rsa_loadHalf(rsa_context * context, uint8_t * target, uint8_t half)
+{
+	memcpy(target, context->signature + half * RSA_LIMBS, RSA_LIMBS);
+	if (rsa_greaterOrEqual(target, context->m)) rsa_sub(target, context->m);
+}
+
+/**
+ * Starts signing a SHA-1 digest with an RSA-2048 private key, using PKCS#1 v1.5 padding. This is the
+ * signature that adbd expects in reply to an AUTH token, which it treats as the digest. Call rsa_signStep
+ * until it returns RSA_DONE.
+ *
+ * @param context signature state, about 1.6k. It can't be reused until the signature is done.
+ * @param key private key. The key itself must stay available until the signature is done.
+ * @param digest digest to sign, RSA_DIGEST_SIZE bytes.
+ */
+void rsa_signBegin(rsa_context * context, const rsa_key * key, const uint8_t * digest)
+{
+	uint8_t * x = context->signature;
+	uint16_t i, j;
+
+	// Build the padded message, little-endian: 00 01 ff .. ff 00 DigestInfo digest.
+	for (i = 0; i < RSA_DIGEST_SIZE; i++)
+		x[i] = digest[RSA_DIGEST_SIZE - 1 - i];
+	for (j = 0; j < sizeof(sha1DigestInfo); j++)
+		x[i++] = pgm_read_byte(sha1DigestInfo + sizeof(sha1DigestInfo) - 1 - j);
+	x[i++] = 0x00;
+	while (i < RSA_MODULUS_SIZE - 2)
+		x[i++] = 0xff;
+	x[i++] = 0x01;
+	x[i++] = 0x00;
+
+	context->key = *key;
+	context->multiplying = false;
+	context->prime = 0;
+	context->state = RSA_STATE_PRIME;
+}
+
+/**
+ * Takes one step of a signature. The signature is computed with the Chinese Remainder Theorem: s1 = x^dp
+ * mod p and s2 = x^dq mod q, with sliding window exponentiation, and then combined. The two
+ * exponentiations take some 2,600 Montgomery multiplications of 128 rows each, and a step does at most
+ * one row, or the bookkeeping between two multiplications. On a 16MHz AVR a row takes about 3,300 cycles,
+ * around 0.2ms, and no step takes much longer than that.
+ *
+ * @param context signature state, set up by rsa_signBegin.
+ * @return RSA_BUSY if there is more to do, RSA_DONE when the big-endian signature is in
+ * context->signature, or RSA_INVALID_KEY.
+ */
+int rsa_signStep(rsa_context * context)
+{
+	uint8_t * x = context->signature;
+	uint8_t * s = context->s[context->prime];
+	uint16_t i, j, sum;
+	uint8_t length, value, k, carry, t;
+
+	if (context->multiplying)
+	{
+		if (context->mulRow < RSA_LIMBS)
+		{
+			rsa_montMulRow(context->t, context->mulA[context->mulRow], context->mulB, context->m, context->mInv);
+			context->mulRow++;
+			return RSA_BUSY;
+		}
+
+		// The result is smaller than 2m, one subtraction brings it in range.
+		if (context->t[RSA_LIMBS] != 0 || rsa_greaterOrEqual(context->t, context->m))
+			rsa_sub(context->t, context->m);
+
+		memcpy(context->mulResult, context->t, RSA_LIMBS);
+		context->multiplying = false;
+		return RSA_BUSY;
+	}
+
+	switch (context->state)
+	{
+	case RSA_STATE_PRIME:
+		// Reduce the 2048-bit message modulo the prime: (hi * R + lo) mod m = montMul(hi, R^2) + lo.
+		if (!rsa_loadPrime(context, context->prime)) return RSA_INVALID_KEY;
+		rsa_loadHalf(context, context->acc, 1);
+		rsa_montMul(context, s, context->acc, context->r2, RSA_STATE_REDUCE);
+		break;
+
+	case RSA_STATE_REDUCE:
+		rsa_loadHalf(context, context->acc, 0);
+		if (rsa_add(s, context->acc) || rsa_greaterOrEqual(s, context->m))
+			rsa_sub(s, context->m);
+
+		// Precompute the odd powers base^1, base^3, ... in Montgomery form.
+		rsa_montMul(context, context->table[0], s, context->r2, RSA_STATE_SQUARE_BASE);
+		break;
+
+	case RSA_STATE_SQUARE_BASE:
+		context->count = 1;
+		rsa_montMul(context, context->acc, context->table[0], context->table[0], RSA_STATE_TABLE);
+		break;
+
+	case RSA_STATE_TABLE:
+		if (context->count < RSA_TABLE_SIZE)
+		{
+			k = context->count++;
+			rsa_montMul(context, context->table[k], context->table[k - 1], context->acc, RSA_STATE_TABLE);
+			break;
+		}
+
+		context->bit = RSA_LIMBS * 8 - 1;
+		context->started = false;
+		context->state = RSA_STATE_SCAN;
+		break;
+
+	case RSA_STATE_SCAN:
+		i = context->prime ? RSA_KEY_DQ : RSA_KEY_DP;
+
+		if (context->bit < 0)
+		{
+			context->state = RSA_STATE_FINISH;
+			break;
+		}
+
+		if (!rsa_exponentBit(&context->key, i, context->bit))
+		{
+			context->bit--;
+			if (context->started)
+				rsa_montMul(context, context->acc, context->acc, context->acc, RSA_STATE_SCAN);
+			break;
+		}
+
+		// Find the longest window that ends in a one bit.
+		length = context->bit + 1 < RSA_WINDOW ? context->bit + 1 : RSA_WINDOW;
+		while (!rsa_exponentBit(&context->key, i, context->bit - length + 1)) length--;
+
+		value = 0;
+		for (k = 0; k < length; k++)
+			value = (value << 1) | rsa_exponentBit(&context->key, i, context->bit - k);
+
+		if (context->started)
+		{
+			context->window = length;
+			context->value = value;
+			context->count = length;
+			context->state = RSA_STATE_WINDOW;
+		} else
+		{
+			memcpy(context->acc, context->table[value >> 1], RSA_LIMBS);
+			context->started = true;
+			context->bit -= length;
+		}
+		break;
+
+	case RSA_STATE_WINDOW:
+		if (context->count > 0)
+		{
+			context->count--;
+			rsa_montMul(context, context->acc, context->acc, context->acc, RSA_STATE_WINDOW);
+			break;
+		}
+
+		context->bit -= context->window;
+		rsa_montMul(context, context->acc, context->acc, context->table[context->value >> 1], RSA_STATE_SCAN);
+		break;
+
+	case RSA_STATE_FINISH:
+		// Convert back from Montgomery form by multiplying with one.
+		memset(context->table[0], 0, RSA_LIMBS);
+		context->table[0][0] = 1;
+
+		if (context->started)
+			rsa_montMul(context, s, context->acc, context->table[0], RSA_STATE_NEXT_PRIME);
+		else
+		{
+			memcpy(s, context->table[0], RSA_LIMBS);
+			context->state = RSA_STATE_NEXT_PRIME;
+		}
+		break;
+
+	case RSA_STATE_NEXT_PRIME:
+		if (context->prime == 0)
+		{
+			context->prime = 1;
+			context->state = RSA_STATE_PRIME;
+		} else
+			context->state = RSA_STATE_COMBINE;
+		break;
+
+	case RSA_STATE_COMBINE:
+		// h = qinv * (s1 - s2) mod p. Two Montgomery multiplications, with qinv and with R^2, cancel out the
+		// factors R^-1. The message is no longer needed, so qinv goes in its place.
+		rsa_loadPrime(context, 0);
+
+		memcpy(context->acc, context->s[1], RSA_LIMBS);
+		if (rsa_greaterOrEqual(context->acc, context->m)) rsa_sub(context->acc, context->m);
+		if (rsa_sub(context->s[0], context->acc)) rsa_add(context->s[0], context->m);
+
+		rsa_keyRead(&context->key, RSA_KEY_QINV, x);
+		context->prime = 0;
+		rsa_montMul(context, context->s[0], context->s[0], x, RSA_STATE_COMBINE_R2);
+		break;
+
+	case RSA_STATE_COMBINE_R2:
+		rsa_montMul(context, context->s[0], context->s[0], context->r2, RSA_STATE_PRODUCT);
+		context->count = 0;
+		break;
+
+	case RSA_STATE_PRODUCT:
+		// signature = s2 + h * q, one row of the product per step.
+		if (context->count == 0)
+		{
+			rsa_keyRead(&context->key, RSA_KEY_Q, context->m);
+			memset(x, 0, RSA_MODULUS_SIZE);
+		}
+
+		i = context->count++;
+		carry = 0;
+		for (j = 0; j < RSA_LIMBS; j++)
+		{
+			sum = x[i + j] + (uint16_t)context->s[0][i] * context->m[j] + carry;
+			x[i + j] = sum;
+			carry = sum >> 8;
+		}
+		x[i + RSA_LIMBS] = carry;
+
+		if (context->count < RSA_LIMBS) break;
+
+		carry = rsa_add(x, context->s[1]);
+		for (i = RSA_LIMBS; carry && i < RSA_MODULUS_SIZE; i++)
+			carry = ++x[i] == 0;
+
+		// Convert to big-endian.
+		for (i = 0; i < RSA_MODULUS_SIZE / 2; i++)
+		{
+			t = x[i];
+			x[i] = x[RSA_MODULUS_SIZE - 1 - i];
+			x[RSA_MODULUS_SIZE - 1 - i] = t;
+		}
+
+		context->state = RSA_STATE_DONE;
+		return RSA_DONE;
+
+	case RSA_STATE_DONE:
+		return RSA_DONE;
+	}
+
+	return RSA_BUSY;
+}
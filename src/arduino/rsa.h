@@ -0,0 +1,112 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __rsa_h__
+#define __rsa_h__
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+// RSA-2048 with 1024-bit primes, in 8-bit limbs.
+#define RSA_MODULUS_SIZE 256
+#define RSA_LIMBS 128
+
+// Size of the SHA-1 digest that is signed.
+#define RSA_DIGEST_SIZE 20
+
+// Window size of the sliding window exponentiation. Every extra bit halves the number of multiplications
+// and doubles the table of precomputed powers, which takes 2^(RSA_WINDOW-1) * RSA_LIMBS bytes of stack.
+#ifndef RSA_WINDOW
+#define RSA_WINDOW 3
+#endif
+
+// Layout of a private key, as generated by tools/adbkey.py. All numbers are little-endian. The primes and
+// CRT parameters are followed by the Montgomery constants R^2 mod p, R^2 mod q (with R = 2^1024), and
+// -p^-1 mod 256, -q^-1 mod 256.
+#define RSA_KEY_P 0
+#define RSA_KEY_Q 128
+#define RSA_KEY_DP 256
+#define RSA_KEY_DQ 384
+#define RSA_KEY_QINV 512
+#define RSA_KEY_R2P 640
+#define RSA_KEY_R2Q 768
+#define RSA_KEY_PINV 896
+#define RSA_KEY_QINV_MONT 897
+#define RSA_KEY_SIZE 898
+
+// Key storage.
+#define RSA_STORAGE_FLASH 0
+#define RSA_STORAGE_EEPROM 1
+
+// Return values of rsa_signStep.
+#define RSA_DONE 0
+#define RSA_BUSY 1
+#define RSA_INVALID_KEY -1
+
+#define RSA_TABLE_SIZE (1 << (RSA_WINDOW - 1))
+
+/**
+ * Reference to a private key in program memory or EEPROM.
+ */
+typedef struct
+{
+	const uint8_t * data;
+	uint8_t storage;
+} rsa_key;
+
+/**
+ * State of a signature that is computed a step at a time. The numbers are kept here rather than on the
+ * stack, so the computation can be spread over many calls.
+ */
+typedef struct
+{
+	rsa_key key;
+
+	// Padded message, and the big-endian signature once rsa_signStep returns RSA_DONE.
+	uint8_t signature[RSA_MODULUS_SIZE];
+
+	// Modulus and Montgomery constants of the prime that is being worked with.
+	uint8_t m[RSA_LIMBS];
+	uint8_t r2[RSA_LIMBS];
+	uint8_t mInv;
+
+	// Results modulo p and q, the odd powers of the base, and the accumulator of the exponentiation.
+	uint8_t s[2][RSA_LIMBS];
+	uint8_t table[RSA_TABLE_SIZE][RSA_LIMBS];
+	uint8_t acc[RSA_LIMBS];
+
+	// Montgomery multiplication in progress, r = a * b * R^-1 mod m, one row of a at a time.
+	uint8_t t[RSA_LIMBS + 1];
+	uint8_t * mulResult;
+	const uint8_t * mulA;
+	const uint8_t * mulB;
+	uint8_t mulRow;
+	uint8_t multiplying;
+
+	// Position in the exponentiation.
+	uint8_t state;
+	uint8_t prime;
+	int16_t bit;
+	uint8_t window;
+	uint8_t value;
+	uint8_t count;
+	uint8_t started;
+} rsa_context;
+
+void rsa_signBegin(rsa_context * context, const rsa_key * key, const uint8_t * digest);
+int rsa_signStep(rsa_context * context);
+
+#endif
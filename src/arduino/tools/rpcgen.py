@@ -0,0 +1,243 @@
+#!/usr/bin/env python
+#
+# Generates message types for the AdbRpc class (C++) and org.microbridge.server.Rpc (Java) from an
+# interface description.
+#
+# Usage:
+#   rpcgen.py file.idl > Messages.h
+#   rpcgen.py -j package [-n Name] file.idl > Name.java
+#
+# The interface description lists messages (one-way) and calls (request and response), each with a method
+# id that is unique within the file, followed by its fields, one per line:
+#
+#   # Servo positions, from the phone.
+#   message SetServos 1
+#       u8 left
+#       u8 right
+#
+#   call ReadAnalog 2
+#       u8 pin
+#   returns
+#       u16 value
+#
+# Field types are u8, u16, u32 (varints), s8, s16, s32 (zigzag varints), bool, float, and bytes[N], a
+# block of at most N bytes. A call generates a request type with the name of the call, and a response type
+# with 'Response' appended.
+
+import getopt
+import os
+import sys
+
+# C++ type, writer call, reader call.
+CPP_TYPES = {
+    'u8': ('uint8_t', 'putVarint', 'getVarint'),
+    'u16': ('uint16_t', 'putVarint', 'getVarint'),
+    'u32': ('uint32_t', 'putVarint', 'getVarint'),
+    's8': ('int8_t', 'putSigned', 'getSigned'),
+    's16': ('int16_t', 'putSigned', 'getSigned'),
+    's32': ('int32_t', 'putSigned', 'getSigned'),
+    'bool': ('boolean', 'putByte', 'getByte'),
+    'float': ('float', 'putFloat', 'getFloat'),
+}
+
+# Java type, writer call, reader call.
+JAVA_TYPES = {
+    'u8': ('int', 'putVarint', '(int)reader.getVarint()'),
+    'u16': ('int', 'putVarint', '(int)reader.getVarint()'),
+    'u32': ('long', 'putVarint', 'reader.getVarint()'),
+    's8': ('int', 'putSigned', 'reader.getSigned()'),
+    's16': ('int', 'putSigned', 'reader.getSigned()'),
+    's32': ('int', 'putSigned', 'reader.getSigned()'),
+    'bool': ('boolean', 'putBoolean', 'reader.getByte() != 0'),
+    'float': ('float', 'putFloat', 'reader.getFloat()'),
+}
+
+class Message:
+    def __init__(self, name, method, kind):
+        self.name = name
+        self.method = method
+        self.kind = kind
+        self.fields = []
+        self.response = None
+
+def fail(filename, number, text):
+    sys.stderr.write('%s:%d: %s\n' % (filename, number, text))
+    sys.exit(1)
+
+def parse(filename):
+    messages = []
+    methods = set()
+    current = None
+
+    for number, line in enumerate(open(filename), 1):
+        words = line.split('#')[0].split()
+        if not words:
+            continue
+
+        if words[0] in ('message', 'call'):
+            if len(words) != 3 or not words[2].isdigit():
+                fail(filename, number, 'expected: %s <name> <method id>' % words[0])
+            if int(words[2]) in methods:
+                fail(filename, number, 'duplicate method id ' + words[2])
+            methods.add(int(words[2]))
+            current = Message(words[1], int(words[2]), words[0])
+            messages.append(current)
+        elif words[0] == 'returns':
+            if current is None or current.kind != 'call' or current.response is not None:
+                fail(filename, number, "'returns' outside a call")
+            current.response = Message(current.name + 'Response', current.method, 'response')
+            current = current.response
+        else:
+            if current is None or len(words) != 2:
+                fail(filename, number, 'expected: <type> <name>')
+            kind, name = words
+            if kind.startswith('bytes[') and kind.endswith(']') and kind[6:-1].isdigit():
+                current.fields.append((name, 'bytes', int(kind[6:-1])))
+            elif kind in CPP_TYPES:
+                current.fields.append((name, kind, 0))
+            else:
+                fail(filename, number, 'unknown type ' + kind)
+
+    # Calls without 'returns' have an empty response.
+    for message in messages:
+        if message.kind == 'call' and message.response is None:
+            message.response = Message(message.name + 'Response', message.method, 'response')
+
+    return messages
+
+def cpp_struct(out, message):
+    out.append('struct %s' % message.name)
+    out.append('{')
+    out.append('\tenum { METHOD = %d };' % message.method)
+    if message.kind == 'call':
+        out.append('\ttypedef %s Response;' % message.response.name)
+    out.append('')
+    for name, kind, size in message.fields:
+        if kind == 'bytes':
+            out.append('\tuint8_t %s[%d];' % (name, size))
+            out.append('\tuint16_t %sLength;' % name)
+        else:
+            out.append('\t%s %s;' % (CPP_TYPES[kind][0], name))
+    if message.fields:
+        out.append('')
+
+    out.append('\tvoid encode(RpcWriter & writer) const')
+    out.append('\t{')
+    for name, kind, size in message.fields:
+        if kind == 'bytes':
+            out.append('\t\twriter.putBytes(%s, %sLength);' % (name, name))
+        else:
+            out.append('\t\twriter.%s(%s);' % (CPP_TYPES[kind][1], name))
+    out.append('\t}')
+    out.append('')
+    out.append('\tvoid decode(RpcReader & reader)')
+    out.append('\t{')
+    for name, kind, size in message.fields:
+        if kind == 'bytes':
+            out.append('\t\t%sLength = reader.getBytes(%s, %d);' % (name, name, size))
+        else:
+            out.append('\t\t%s = reader.%s();' % (name, CPP_TYPES[kind][2]))
+    out.append('\t}')
+    out.append('};')
+    out.append('')
+
+def cpp(messages, source):
+    guard = '__%s_h__' % os.path.splitext(os.path.basename(source))[0].lower()
+    out = ['// Generated by rpcgen.py from %s, do not edit.' % os.path.basename(source), '',
+        '#ifndef ' + guard, '#define ' + guard, '', '#include <AdbRpc.h>', '']
+
+    # Responses first, requests refer to them.
+    for message in messages:
+        if message.response is not None:
+            cpp_struct(out, message.response)
+        cpp_struct(out, message)
+
+    out.append('#endif')
+    return '\n'.join(out) + '\n'
+
+def java_class(out, message):
+    interface = 'RpcCall' if message.kind == 'call' else 'RpcMessage'
+    out.append('\tpublic static class %s implements %s' % (message.name, interface))
+    out.append('\t{')
+    out.append('\t\tpublic static final int METHOD = %d;' % message.method)
+    out.append('')
+    for name, kind, size in message.fields:
+        if kind == 'bytes':
+            out.append('\t\tpublic final byte %s[] = new byte[%d];' % (name, size))
+            out.append('\t\tpublic int %sLength;' % name)
+        else:
+            out.append('\t\tpublic %s %s;' % (JAVA_TYPES[kind][0], name))
+    if message.kind == 'call':
+        out.append('\t\tpublic final %s response = new %s();' % (message.response.name, message.response.name))
+    if message.fields or message.kind == 'call':
+        out.append('')
+
+    out.append('\t\tpublic int getMethod()')
+    out.append('\t\t{')
+    out.append('\t\t\treturn METHOD;')
+    out.append('\t\t}')
+    out.append('')
+    if message.kind == 'call':
+        out.append('\t\tpublic RpcMessage getResponse()')
+        out.append('\t\t{')
+        out.append('\t\t\treturn response;')
+        out.append('\t\t}')
+        out.append('')
+    out.append('\t\tpublic void encode(RpcWriter writer)')
+    out.append('\t\t{')
+    for name, kind, size in message.fields:
+        if kind == 'bytes':
+            out.append('\t\t\twriter.putBytes(%s, %sLength);' % (name, name))
+        else:
+            out.append('\t\t\twriter.%s(%s);' % (JAVA_TYPES[kind][1], name))
+    out.append('\t\t}')
+    out.append('')
+    out.append('\t\tpublic void decode(RpcReader reader)')
+    out.append('\t\t{')
+    for name, kind, size in message.fields:
+        if kind == 'bytes':
+            out.append('\t\t\t%sLength = reader.getBytes(%s);' % (name, name))
+        else:
+            out.append('\t\t\t%s = %s;' % (name, JAVA_TYPES[kind][2]))
+    out.append('\t\t}')
+    out.append('\t}')
+    out.append('')
+
+def java(messages, source, package, name):
+    out = ['// Generated by rpcgen.py from %s, do not edit.' % os.path.basename(source), '',
+        'package %s;' % package, '']
+    if package != 'org.microbridge.server':
+        out += ['import org.microbridge.server.RpcCall;', 'import org.microbridge.server.RpcMessage;',
+            'import org.microbridge.server.RpcReader;', 'import org.microbridge.server.RpcWriter;', '']
+    out.append('public class %s' % name)
+    out.append('{')
+    out.append('')
+    for message in messages:
+        if message.response is not None:
+            java_class(out, message.response)
+        java_class(out, message)
+    out.append('}')
+    return '\n'.join(out) + '\n'
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'j:n:')
+    except getopt.GetoptError as e:
+        sys.stderr.write('%s\n' % e)
+        sys.exit(2)
+
+    if len(args) != 1:
+        sys.stderr.write('usage: rpcgen.py [-j package [-n name]] file.idl\n')
+        sys.exit(2)
+
+    opts = dict(opts)
+    messages = parse(args[0])
+
+    if '-j' in opts:
+        name = opts.get('-n', os.path.splitext(os.path.basename(args[0]))[0])
+        sys.stdout.write(java(messages, args[0], opts['-j'], name))
+    else:
+        sys.stdout.write(cpp(messages, args[0]))
+
+if __name__ == '__main__':
+    main()
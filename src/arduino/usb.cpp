@@ -492,27 +492,36 @@ int USB::bulkRead(usb_device * device, uint16_t length, uint8_t * data, boolean
 
 
 /**
- * Performs ab out transfer to a USB device on an arbitrary endpoint.
+ * Performs ab out transfer to a USB device on an arbitrary endpoint. The data is gathered from a list of
+ * segments, which are packed back-to-back into maxPacketSize packets as if they were a single buffer.
  *
  * @param device USB bulk device.
- * @param device length number of bytes to read.
- * @param data target buffer.
+ * @param endpoint target endpoint.
+ * @param count number of segments.
+ * @param segments data segments to send.
  * @return number of bytes written, or error code in case of failure.
  */
-int USB::write(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data)
+int USB::write(usb_device * device, usb_endpoint * endpoint, uint8_t count, const usb_segment * segments)
 {
 	uint8_t rcode = 0, retry_count;
+	uint8_t i, first = 0;
 
 	// Set device address.
 	max3421e_write(MAX_REG_PERADDR, device->address);
 
-	// Local copy of the data pointer.
-	uint8_t * data_p = data;
+	// Current position in the segment list.
+	uint8_t segment = 0;
+	uint16_t offset = 0;
+	uint16_t chunk, remaining;
+	const uint8_t * data_p;
 
 	unsigned int bytes_tosend, nak_count;
-	unsigned int bytes_left = length;
+	unsigned int bytes_left = 0;
 	unsigned int nak_limit = USB_NAK_LIMIT;
 
+	for (i = 0; i < count; i++)
+		bytes_left += segments[i].length;
+
 	uint32_t timeout = millis() + USB_XFER_TIMEOUT;
 
 	uint8_t maxPacketSize = endpoint->maxPacketSize;
@@ -529,8 +538,35 @@ int USB::write(usb_device * device, usb_endpoint * endpoint, uint16_t length, ui
 
 		bytes_tosend = (bytes_left >= maxPacketSize) ? maxPacketSize : bytes_left;
 
-		// Filling output FIFO
-		max3421e_writeMultiple(MAX_REG_SNDFIFO, bytes_tosend, data_p);
+		// Filling output FIFO. A packet may span several segments, which are simply appended to the FIFO
+		// one after another.
+		remaining = bytes_tosend;
+		while (remaining)
+		{
+			// Skip to the next segment with data left in it.
+			while (offset == segments[segment].length)
+			{
+				segment++;
+				offset = 0;
+			}
+
+			chunk = segments[segment].length - offset;
+			if (chunk > remaining) chunk = remaining;
+
+			data_p = segments[segment].data + offset;
+
+			// Remember the first byte of the packet for the NAK workaround below.
+			if (remaining == bytes_tosend)
+				first = segments[segment].progmem ? pgm_read_byte(data_p) : *data_p;
+
+			if (segments[segment].progmem)
+				max3421e_writeMultiple_P(MAX_REG_SNDFIFO, chunk, data_p);
+			else
+				max3421e_writeMultiple(MAX_REG_SNDFIFO, chunk, (uint8_t *)data_p);
+
+			offset += chunk;
+			remaining -= chunk;
+		}
 
 		// Set number of bytes to send.
 		max3421e_write(MAX_REG_SNDBC, bytes_tosend);
@@ -570,7 +606,7 @@ int USB::write(usb_device * device, usb_endpoint * endpoint, uint16_t length, ui
 
 			// Process NAK according to Host out NAK bug.
 			max3421e_write(MAX_REG_SNDBC, 0);
-			max3421e_write(MAX_REG_SNDFIFO, *data_p);
+			max3421e_write(MAX_REG_SNDFIFO, first);
 			max3421e_write(MAX_REG_SNDBC, bytes_tosend);
 			max3421e_write(MAX_REG_HXFR, (tokOUT | endpoint->address)); //dispatch packet
 
@@ -584,7 +620,6 @@ int USB::write(usb_device * device, usb_endpoint * endpoint, uint16_t length, ui
 		}
 
 		bytes_left -= bytes_tosend;
-		data_p += bytes_tosend;
 	}
 
 	endpoint->sendToggle = (max3421e_read(MAX_REG_HRSL) & bmSNDTOGRD) ? bmSNDTOG1 : bmSNDTOG0; //update toggle
@@ -603,7 +638,36 @@ int USB::write(usb_device * device, usb_endpoint * endpoint, uint16_t length, ui
  */
 int USB::bulkWrite(usb_device * device, uint16_t length, uint8_t * data)
 {
-	return USB::write(device, &(device->bulk_out) , length, data);
+	usb_segment segment = { data, length, false };
+	return USB::write(device, &(device->bulk_out), 1, &segment);
+}
+
+/**
+ * Performs a bulk out transfer to a USB device, reading the data directly from program memory.
+ *
+ * @param device USB bulk device.
+ * @param device length number of bytes to write.
+ * @param data source buffer in program memory (flash).
+ * @return 0 on success, or error code in case of failure.
+ */
+int USB::bulkWrite_P(usb_device * device, uint16_t length, const uint8_t * data)
+{
+	usb_segment segment = { data, length, true };
+	return USB::write(device, &(device->bulk_out), 1, &segment);
+}
+
+/**
+ * Performs a bulk out transfer to a USB device, gathering the data from several segments. The segments are
+ * sent as one contiguous transfer.
+ *
+ * @param device USB bulk device.
+ * @param count number of segments.
+ * @param segments data segments, in SRAM or program memory.
+ * @return 0 on success, or error code in case of failure.
+ */
+int USB::bulkWritev(usb_device * device, uint8_t count, const usb_segment * segments)
+{
+	return USB::write(device, &(device->bulk_out), count, segments);
 }
 
 /**
@@ -616,6 +680,8 @@ int USB::bulkWrite(usb_device * device, uint16_t length, uint8_t * data)
  */
 uint8_t USB::ctrlData(usb_device * device, boolean direction, uint16_t length, uint8_t * data)
 {
+	usb_segment segment = { data, length, false };
+
 	if (direction)
 	{
 		// IN transfer
@@ -626,7 +692,7 @@ uint8_t USB::ctrlData(usb_device * device, boolean direction, uint16_t length, u
 	{
 		// OUT transfer
 		device->control.sendToggle = bmSNDTOG1;
-		return USB::write(device, &(device->control), length, data);
+		return USB::write(device, &(device->control), 1, &segment);
 	}
 }
 
@@ -127,6 +127,16 @@ typedef struct
 
 } usb_device;
 
+/**
+ * A segment of data for gathering writes. Segments may reside either in SRAM or in program memory.
+ */
+typedef struct
+{
+	const uint8_t * data;
+	uint16_t length;
+	boolean progmem;
+} usb_segment;
+
 typedef enum
 {
 	USB_CONNECT,
@@ -189,7 +199,7 @@ private:
 	static int setAddress(usb_device * device, uint8_t address);
 	static int controlRequest(usb_device * device, uint8_t requestType, uint8_t request, uint8_t valueLow, uint8_t valueHigh, uint16_t index, uint16_t length, uint8_t * data);
 	static int read(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data, unsigned int nakLimit);
-	static int write(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data);
+	static int write(usb_device * device, usb_endpoint * endpoint, uint8_t count, const usb_segment * segments);
 	static uint8_t ctrlData(usb_device * device, boolean direction, uint16_t length, uint8_t * data);
 
 public:
@@ -210,6 +220,8 @@ public:
 
 	static int bulkRead(usb_device * device, uint16_t length, uint8_t * data, boolean poll);
 	static int bulkWrite(usb_device * device, uint16_t length, uint8_t * data);
+	static int bulkWrite_P(usb_device * device, uint16_t length, const uint8_t * data);
+	static int bulkWritev(usb_device * device, uint8_t count, const usb_segment * segments);
 
 };
 
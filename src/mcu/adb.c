@@ -29,6 +29,13 @@ static adb_connection * firstConnection;
 static boolean connected;
 static int connectionLocalId = 1;
 
+// Write message whose payload is still being received, the connection it is for, and the rest of the
+// payload.
+static adb_message payloadMessage;
+static adb_connection * payloadConnection;
+static adb_connectionStatus payloadStatus;
+static uint32_t payloadLeft;
+
 // Event handler callback function.
 adb_eventHandler * eventHandler;
 
@@ -99,6 +106,7 @@ adb_connection * adb_addConnection(const char * connectionString, boolean reconn
 	connection->lastConnectionAttempt = 0;
 	connection->reconnect = reconnect;
 	connection->eventHandler = handler;
+	connection->receiveSpace = NULL;
 
 	// Add the connection to the linked list. Note that it's easier to just insert
 	// at position 0 because you don't have to traverse the list :)
@@ -109,6 +117,23 @@ adb_connection * adb_addConnection(const char * connectionString, boolean reconn
 	return connection;
 }
 
+/**
+ * Lets a connection hold off incoming data until the application has room for it. Before each packet of
+ * a WRTE payload is read from USB, the space function is asked how many bytes the application can take;
+ * if that is less than the packet, the rest of the payload is left in the USB pipe and reading resumes
+ * on a later call to adb_poll. The OKAY for the write is sent once the whole payload has been passed on,
+ * so the device holds further writes back in the meantime. No other messages are handled while a payload
+ * is held, so the space must become available without help from ADB, and must be able to reach
+ * ADB_USB_PACKETSIZE bytes.
+ *
+ * @param connection ADB connection.
+ * @param space space function, or NULL to pass on data as soon as it arrives.
+ */
+void adb_setReceiveSpace(adb_connection * connection, adb_receiveSpace * space)
+{
+	connection->receiveSpace = space;
+}
+
 /**
  * Prints an ADB_message, for debugging purposes.
  * @param message ADB message to print.
@@ -333,33 +358,28 @@ static void adb_handleClose(adb_connection * connection)
 }
 
 /**
- * Handles an ADB WRITE message.
- *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * Passes the payload of the current ADB WRITE message to its connection, for as long as the application
+ * has room for it, and acknowledges the write once the payload is complete.
  */
-static void adb_handleWrite(adb_connection * connection, adb_message * message)
+static void adb_receivePayload()
 {
-	uint32_t bytesLeft = message->data_length;
+	adb_connection * connection = payloadConnection;
 	uint8_t buf[ADB_USB_PACKETSIZE];
-	adb_connectionStatus previousStatus;
 	int bytesRead;
 
-	previousStatus = connection->status;
-
-	connection->status = ADB_RECEIVING;
-	connection->dataRead = 0;
-	connection->dataSize = message->data_length;
-
-	while (bytesLeft>0)
+	while (payloadLeft>0)
 	{
-		int len = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
+		int len = payloadLeft < ADB_USB_PACKETSIZE ? payloadLeft : ADB_USB_PACKETSIZE;
+
+		// Leave the rest in the USB pipe until the application can take the next packet.
+		if (connection->receiveSpace!=NULL && connection->receiveSpace(connection) < len)
+			return;
 
 		// Read payload
 		bytesRead = usb_bulkRead(adbDevice, len, buf, false);
 
 		if (len != bytesRead)
-			avr_serialPrintf("bytes read mismatch: %d expected, %d read, %ld left\n", len, bytesRead, bytesLeft);
+			avr_serialPrintf("bytes read mismatch: %d expected, %d read, %ld left\n", len, bytesRead, payloadLeft);
 
 		// Break out of the read loop if there's no data to read :(
 		if (bytesRead==-1) break;
@@ -367,13 +387,35 @@ static void adb_handleWrite(adb_connection * connection, adb_message * message)
 		connection->dataRead += len;
 		adb_fireEvent(connection, ADB_CONNECTION_RECEIVE, len, buf);
 
-		bytesLeft -= bytesRead;
+		payloadLeft -= bytesRead;
 	}
 
 	// Send OKAY message in reply.
-	bytesRead = adb_writeEmptyMessage(adbDevice, A_OKAY, message->arg1, message->arg0);
+	adb_writeEmptyMessage(adbDevice, A_OKAY, payloadMessage.arg1, payloadMessage.arg0);
 
-	connection->status = previousStatus;
+	connection->status = payloadStatus;
+	payloadConnection = NULL;
+}
+
+/**
+ * Handles an ADB WRITE message. The payload may be passed on over several calls to adb_poll, see
+ * adb_setReceiveSpace.
+ *
+ * @param connection ADB connection
+ * @param message ADB message struct.
+ */
+static void adb_handleWrite(adb_connection * connection, adb_message * message)
+{
+	payloadMessage = *message;
+	payloadConnection = connection;
+	payloadStatus = connection->status;
+	payloadLeft = message->data_length;
+
+	connection->status = ADB_RECEIVING;
+	connection->dataRead = 0;
+	connection->dataSize = message->data_length;
+
+	adb_receivePayload();
 }
 
 /**
@@ -440,6 +482,13 @@ void adb_poll()
 	if (connected)
 		adb_openClosedConnections();
 
+	// Continue a write whose payload was held back, and wait for it before handling anything else.
+	if (payloadConnection!=NULL)
+	{
+		adb_receivePayload();
+		if (payloadConnection!=NULL) return;
+	}
+
 	// Check for an incoming ADB message.
 	if (!adb_pollMessage(&message, true))
 		return;
@@ -617,7 +666,8 @@ static void adb_usbEventHandler(usb_device * device, usb_eventType event)
 		// Check if the device that was disconnected is the ADB device we've been using.
 		if (device == adbDevice)
 		{
-			// Close all open ADB connections.
+			// Drop a write that was still being received, and close all open ADB connections.
+			payloadConnection = NULL;
 			adb_closeAll();
 
 			// Signal that we're no longer connected by setting the global device handler to NULL;
@@ -693,6 +743,7 @@ void adb_init()
 	// Signal that we are not connected.
 	adbDevice = NULL;
 	connected = false;
+	payloadConnection = NULL;
 
 	// Initialise the USB layer and attach an event handler.
 	usb_setEventHandler(adb_usbEventHandler);
@@ -93,6 +93,9 @@ typedef struct _adb_connection adb_connection;
 // Event handler
 typedef void(adb_eventHandler)(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
 
+// Reports how many bytes of incoming data the application can take right now. See adb_setReceiveSpace.
+typedef uint16_t(adb_receiveSpace)(adb_connection * connection);
+
 struct _adb_connection
 {
 	char * connectionString;
@@ -102,6 +105,7 @@ struct _adb_connection
 	adb_connectionStatus status;
 	boolean reconnect;
 	adb_eventHandler * eventHandler;
+	adb_receiveSpace * receiveSpace;
 	adb_connection * next;
 };
 
@@ -110,6 +114,7 @@ void adb_poll();
 
 void adb_setEventHandler(adb_eventHandler * handler);
 adb_connection * adb_addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
+void adb_setReceiveSpace(adb_connection * connection, adb_receiveSpace * space);
 int adb_write(adb_connection * connection, uint16_t length, uint8_t * data);
 int adb_writeString(adb_connection * connection, char * str);
 
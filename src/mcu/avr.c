@@ -15,6 +15,7 @@ limitations under the License.#include <string.h>
 */
 #include "avr.h"
 #include <stdint.h>
+#include <string.h>
 
 #define TIMER1_MULTIPLIER 64
 #define TIMER1_MILLIS_DIVIDER (F_CPU / 1000L)
@@ -154,6 +155,53 @@ void avr_timerInit()
 
 }
 
+// Serial ring buffers. The indices run freely and are masked on access, so head - tail is the number of
+// queued bytes. The transmit head and the receive tail are only written outside interrupt context.
+static uint8_t serial_txBuffer[AVR_SERIAL_TX_BUFFER_SIZE];
+static volatile uint8_t serial_txHead = 0, serial_txTail = 0;
+static volatile uint16_t serial_txOverflow = 0;
+
+static uint8_t serial_rxBuffer[AVR_SERIAL_RX_BUFFER_SIZE];
+static volatile uint8_t serial_rxHead = 0, serial_rxTail = 0;
+static volatile uint16_t serial_rxOverflow = 0;
+
+// The ATmega1280 has several USARTs, the ATmega168/328 only one.
+#if defined(USART0_RX_vect)
+#define SERIAL_RX_vect USART0_RX_vect
+#define SERIAL_UDRE_vect USART0_UDRE_vect
+#else
+#define SERIAL_RX_vect USART_RX_vect
+#define SERIAL_UDRE_vect USART_UDRE_vect
+#endif
+
+SIGNAL(SERIAL_RX_vect)
+{
+	uint8_t value = UDR0;
+	uint8_t head = serial_rxHead;
+
+	if ((uint8_t)(head - serial_rxTail) < AVR_SERIAL_RX_BUFFER_SIZE)
+	{
+		serial_rxBuffer[head & (AVR_SERIAL_RX_BUFFER_SIZE - 1)] = value;
+		serial_rxHead = head + 1;
+	} else
+		serial_rxOverflow ++;
+}
+
+SIGNAL(SERIAL_UDRE_vect)
+{
+	uint8_t tail = serial_txTail;
+
+	if (tail == serial_txHead)
+	{
+		// Buffer empty, stop until the next write.
+		cbi(UCSR0B, UDRIE0);
+		return;
+	}
+
+	UDR0 = serial_txBuffer[tail & (AVR_SERIAL_TX_BUFFER_SIZE - 1)];
+	serial_txTail = tail + 1;
+}
+
 // adapted from the wiring stuff
 void avr_serialInit(uint32_t baud)
 {
@@ -168,6 +216,9 @@ void avr_serialInit(uint32_t baud)
     UBRR0H = baud_setting >> 8;
     UBRR0L = baud_setting;
 
+    serial_txHead = serial_txTail = 0;
+    serial_rxHead = serial_rxTail = 0;
+
     sbi(UCSR0B, RXEN0);
     sbi(UCSR0B, TXEN0);
     sbi(UCSR0B, RXCIE0);
@@ -175,16 +226,20 @@ void avr_serialInit(uint32_t baud)
 
 void avr_serialPrint(char * str)
 {
-	int i;
-	for (i=0; str[i]!=0; i++)
-		avr_serialWrite(str[i]);
+	avr_serialWriteBytes((uint8_t*)str, strlen(str));
 }
 
+static int avr_serialPut(char c, FILE * stream)
+{
+	avr_serialWrite(c);
+	return 0;
+}
+
+static FILE serial_stream = FDEV_SETUP_STREAM(avr_serialPut, NULL, _FDEV_SETUP_WRITE);
+
 void avr_serialVPrint(char * format, va_list arg)
 {
-	char temp[128];
-	vsnprintf(temp, 128, format, arg);
-	avr_serialPrint(temp);
+	vfprintf(&serial_stream, format, arg);
 }
 
 void avr_serialPrintf(char * format, ...)
@@ -199,6 +254,72 @@ void avr_serialPrintf(char * format, ...)
 
 void avr_serialWrite(unsigned char value)
 {
-	while (!((UCSR0A) & (1 << UDRE0)));
-	UDR0 = value;
+	avr_serialWriteBytes(&value, 1);
+}
+
+uint16_t avr_serialWriteBytes(const uint8_t * data, uint16_t length)
+{
+	uint8_t head = serial_txHead;
+	uint8_t space = AVR_SERIAL_TX_BUFFER_SIZE - (uint8_t)(head - serial_txTail);
+	uint16_t i, count = length < space ? length : space;
+
+	for (i = 0; i < count; i++)
+		serial_txBuffer[head++ & (AVR_SERIAL_TX_BUFFER_SIZE - 1)] = data[i];
+	serial_txHead = head;
+
+	if (count < length)
+		serial_txOverflow += length - count;
+
+	// (Re)start the data register empty interrupt, which drains the buffer.
+	if (count > 0)
+		sbi(UCSR0B, UDRIE0);
+
+	return count;
+}
+
+uint8_t avr_serialAvailableForWrite()
+{
+	return AVR_SERIAL_TX_BUFFER_SIZE - (uint8_t)(serial_txHead - serial_txTail);
+}
+
+void avr_serialFlush()
+{
+	while (serial_txHead != serial_txTail)
+		;
+}
+
+uint8_t avr_serialAvailable()
+{
+	return serial_rxHead - serial_rxTail;
+}
+
+int avr_serialRead()
+{
+	uint8_t tail = serial_rxTail;
+	uint8_t value;
+
+	if (tail == serial_rxHead) return -1;
+
+	value = serial_rxBuffer[tail & (AVR_SERIAL_RX_BUFFER_SIZE - 1)];
+	serial_rxTail = tail + 1;
+
+	return value;
+}
+
+uint16_t avr_serialTxOverflow()
+{
+	return serial_txOverflow;
+}
+
+uint16_t avr_serialRxOverflow()
+{
+	uint16_t overflow;
+	uint8_t oldSREG = SREG;
+
+	// Updated from interrupt context, read atomically.
+	cli();
+	overflow = serial_rxOverflow;
+	SREG = oldSREG;
+
+	return overflow;
 }
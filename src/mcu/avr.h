@@ -83,8 +83,19 @@ uint32_t avr_micros();
  */
 void avr_delay(unsigned long ms);
 
+// Serial ring buffer sizes, powers of two up to 128.
+#ifndef AVR_SERIAL_TX_BUFFER_SIZE
+#define AVR_SERIAL_TX_BUFFER_SIZE 128
+#endif
+#ifndef AVR_SERIAL_RX_BUFFER_SIZE
+#define AVR_SERIAL_RX_BUFFER_SIZE 64
+#endif
+
 /**
- * Set up serial port 0.
+ * Set up serial port 0. Transmission and reception are interrupt driven: output is queued in a ring buffer
+ * that the data register empty interrupt drains, and input is collected by the receive interrupt. None of
+ * the serial functions wait for the UART; output that does not fit in the transmit buffer is dropped and
+ * counted, so logging can never stall ADB processing. Interrupts must be enabled (avr_timerInit does that).
  * @param baud desired baud rate (i.e. 576000.
  */
 void avr_serialInit(uint32_t baud);
@@ -96,7 +107,7 @@ void avr_serialInit(uint32_t baud);
 void avr_serialPrint(char * str);
 
 /**
- * Serial printf.
+ * Serial printf. Formats straight into the transmit buffer.
  * @param format printf format string.
  */
 void avr_serialPrintf(char * format, ...);
@@ -107,4 +118,42 @@ void avr_serialPrintf(char * format, ...);
  */
 void avr_serialWrite(uint8_t value);
 
+/**
+ * Print a block of bytes to the serial port.
+ * @param data bytes to print.
+ * @param length number of bytes.
+ * @return number of bytes queued, less than length if the transmit buffer is full.
+ */
+uint16_t avr_serialWriteBytes(const uint8_t * data, uint16_t length);
+
+/**
+ * @return number of bytes that can be written without being dropped.
+ */
+uint8_t avr_serialAvailableForWrite();
+
+/**
+ * Busy-wait until all queued output has been sent, e.g. before a reset.
+ */
+void avr_serialFlush();
+
+/**
+ * @return number of received bytes waiting to be read.
+ */
+uint8_t avr_serialAvailable();
+
+/**
+ * @return the next received byte, or -1 if there is none.
+ */
+int avr_serialRead();
+
+/**
+ * @return number of output bytes dropped because the transmit buffer was full.
+ */
+uint16_t avr_serialTxOverflow();
+
+/**
+ * @return number of received bytes dropped because the receive buffer was full.
+ */
+uint16_t avr_serialRxOverflow();
+
 #endif
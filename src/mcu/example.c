@@ -16,18 +16,21 @@ limitations under the License.#include <string.h>
 #include "avr.h"
 #include "adb.h"
 
+// Reports the room in the UART transmit buffer, so that ADB data is only read as fast as the UART sends it.
+uint16_t serialSpace(adb_connection * connection)
+{
+	return avr_serialAvailableForWrite();
+}
+
 // Event handler to process incoming data from ADB.
 void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
 {
-	int i;
-
 	switch (event)
 	{
 	case ADB_CONNECTION_RECEIVE:
 
-		// Write the results to UART
-		for (i=0; i<length; i++)
-			avr_serialPrintf("%c", data[i]);
+		// Write the results to UART. serialSpace makes sure they fit.
+		avr_serialWriteBytes(data, length);
 
 		break;
 	default:
@@ -38,6 +41,8 @@ void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t
 
 int main()
 {
+	adb_connection * connection;
+
 	// Initialise avr timers
 	avr_timerInit();
 
@@ -48,7 +53,8 @@ int main()
 	adb_init();
 
 	// Create a new ADB connection, run logcat
-	adb_addConnection("shell:exec logcat -s MYAPP:*", false, adbEventHandler);
+	connection = adb_addConnection("shell:exec logcat -s MYAPP:*", false, adbEventHandler);
+	adb_setReceiveSpace(connection, serialSpace);
 
 	// ADB polling.
 	while (1)
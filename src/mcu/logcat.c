@@ -16,11 +16,15 @@ limitations under the License.#include <string.h>
 #include "avr.h"
 #include "adb.h"
 
+// Reports the room in the UART transmit buffer, so that ADB data is only read as fast as the UART sends it.
+uint16_t serialSpace(adb_connection * connection)
+{
+	return avr_serialAvailableForWrite();
+}
+
 // Event handler to process incoming data from ADB.
 void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
 {
-	int i;
-
 	switch (event)
 	{
 	case ADB_CONNECTION_OPEN:
@@ -34,9 +38,9 @@ void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t
 		break;
 	case ADB_CONNECTION_RECEIVE:
 
-		// Write the results to UART
-		for (i=0; i<length; i++)
-			avr_serialPrintf("%c", data[i]);
+		// Write the results to UART. serialSpace makes sure they fit; the OKAY goes out once the whole write
+		// has been passed on, so the phone holds off the next write in the meantime.
+		avr_serialWriteBytes(data, length);
 
 		break;
 	default:
@@ -47,6 +51,8 @@ void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t
 
 int main()
 {
+	adb_connection * connection;
+
 	// Initialise avr timers
 	avr_timerInit();
 
@@ -57,7 +63,8 @@ int main()
 	adb_init();
 
 	// Create a new ADB connection, run logcat
-	adb_addConnection("shell:exec logcat", false, adbEventHandler);
+	connection = adb_addConnection("shell:exec logcat", false, adbEventHandler);
+	adb_setReceiveSpace(connection, serialSpace);
 
 	// ADB polling.
 	while (1)
@@ -18,10 +18,14 @@ limitations under the License.#include <string.h>
 
 adb_connection * logcat, * connection;
 
-void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+// Reports the room in the UART transmit buffer, so that ADB data is only read as fast as the UART sends it.
+uint16_t serialSpace(adb_connection * connection)
 {
-	int i;
+	return avr_serialAvailableForWrite();
+}
 
+void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
 	switch (event)
 	{
 	case ADB_CONNECT:
@@ -41,8 +45,7 @@ void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t
 		break;
 	case ADB_CONNECTION_RECEIVE:
 
-		for (i=0; i<length; i++)
-			avr_serialPrintf("%c", data[i]);
+		avr_serialWriteBytes(data, length);
 
 		break;
 	}
@@ -61,6 +64,8 @@ int main()
 	adb_init();
 	logcat = adb_addConnection("shell:exec logcat -s microbridge:*", true, adbEventHandler);
 	connection = adb_addConnection("tcp:4567", true, adbEventHandler);
+	adb_setReceiveSpace(logcat, serialSpace);
+	adb_setReceiveSpace(connection, serialSpace);
 
 	// Init ADC
 	uint32_t lastTime = avr_millis();